@@ -0,0 +1,100 @@
+# frozen_string_literal: true
+require "etc"
+require "open3"
+
+module Ocran
+  # IO-like writer that cuts the data written to it into fixed-size blocks
+  # and compresses each block on its own with an external LZMA or Zstandard
+  # command, running up to +jobs+ compressors at a time. Blocks are written
+  # to +io+ in order, followed by the block index the stub uses to decode
+  # them independently (and therefore in parallel):
+  #
+  #   [block 0]...[block n-1]
+  #   [compressed size 0][unpacked size 0]...[compressed size n-1][unpacked size n-1]
+  #   [n]
+  #
+  # All sizes are 32-bit little-endian, or 64-bit with +wide_sizes+.
+  class BlockCompressor
+    DEFAULT_BLOCK_SIZE = 8 * 1024 * 1024
+
+    # Offset of the unpacked size in an LZMA-alone header, after the
+    # properties byte and the 32-bit dictionary size.
+    LZMA_UNPACK_SIZE_OFFSET = 5
+
+    # +format+ is :lzma for LZMA-alone output, whose header gets the unpacked
+    # size patched in, or :zstd for Zstandard frames, stored as produced.
+    def initialize(io, command, format: :lzma, block_size: DEFAULT_BLOCK_SIZE, jobs: Etc.nprocessors,
+                   wide_sizes: false)
+      raise ArgumentError, "block_size must be positive" unless block_size.positive?
+
+      @io = io
+      @command = command
+      @format = format
+      @block_size = block_size
+      @jobs = [jobs, 1].max
+      @size_format = wide_sizes ? "Q<" : "V"
+      @buffer = String.new(capacity: block_size, encoding: Encoding::BINARY)
+      @pending = []
+      @index = []
+    end
+
+    def write(*strs)
+      strs.sum do |str|
+        str = str.to_s.b
+        @buffer << str
+        flush_full_blocks
+        str.bytesize
+      end
+    end
+
+    def <<(str)
+      write(str)
+      self
+    end
+
+    # Compresses the remaining data and writes the block index. Must be
+    # called exactly once, after the last write.
+    def finish
+      submit(@buffer.dup) unless @buffer.empty?
+      @buffer.clear
+      drain(0)
+      @index.each { |sizes| @io << sizes.pack(@size_format * 2) }
+      @io << [@index.size].pack(@size_format)
+    end
+
+    private
+
+    def flush_full_blocks
+      while @buffer.bytesize >= @block_size
+        submit(@buffer.byteslice(0, @block_size))
+        @buffer = @buffer.byteslice(@block_size..)
+      end
+    end
+
+    def submit(block)
+      drain(@jobs - 1)
+      @pending << Thread.new(block) { |data| compress_block(data) }
+    end
+
+    # Writes finished blocks, oldest first, until at most +limit+ remain.
+    def drain(limit)
+      while @pending.size > limit
+        block, size = @pending.shift.value
+        @io << block
+        @index << [block.bytesize, size]
+      end
+    end
+
+    def compress_block(data)
+      out, status = Open3.capture2(*@command, stdin_data: data, binmode: true)
+      raise "#{@command.first} compression failed (#{status})" unless status.success?
+
+      if @format == :lzma
+        # Compressors reading from a pipe leave the size unknown; record it
+        # so the stub can check each block's length.
+        out[LZMA_UNPACK_SIZE_OFFSET, 8] = [data.bytesize].pack("Q<")
+      end
+      [out, data.bytesize]
+    end
+  end
+end
@@ -0,0 +1,131 @@
+# frozen_string_literal: true
+
+module Ocran
+  # Branch converters (the BCJ filters of 7-Zip and xz) for native code.
+  # Relative call and branch targets are rewritten to absolute ones, which
+  # repeat across a binary and so compress better. The stub reverses the
+  # conversion after decompressing (src/branch_filter.c); both sides must
+  # stay in step, and the filter ids are stored in the payload.
+  module BranchFilter
+    X86 = 1
+    ARM64 = 2
+
+    # Bytes read to recognize an executable or shared library
+    HEADER_SIZE = 4096
+
+    ELF_MACHINES = { 3 => X86, 62 => X86, 183 => ARM64 }.freeze
+    PE_MACHINES = { 0x14c => X86, 0x8664 => X86, 0xaa64 => ARM64 }.freeze
+    MACHO_CPUS = { 7 => X86, 0x0100_0007 => X86, 0x0100_000c => ARM64 }.freeze
+
+    X86_MASK_TO_ALLOWED = [true, true, true, false, true, false, false, false].freeze
+    X86_MASK_TO_BIT_NUMBER = [0, 1, 2, 2, 3, 3, 3, 3].freeze
+    X86_OPCODE = /[\xE8\xE9]/n
+
+    module_function
+
+    # Returns the filter for the machine code of an ELF, PE or (thin)
+    # Mach-O file, or nil for anything else.
+    def detect(path)
+      header = File.open(path, "rb") { |f| f.read(HEADER_SIZE) } || "".b
+      if header.start_with?("\x7FELF".b) && header.getbyte(5) == 1
+        ELF_MACHINES[header.byteslice(18, 2)&.unpack1("v")]
+      elsif header.start_with?("MZ") && header.bytesize >= 64
+        pe = header.byteslice(60, 4).unpack1("V")
+        return nil unless header.byteslice(pe, 4) == "PE\0\0".b
+
+        PE_MACHINES[header.byteslice(pe + 4, 2)&.unpack1("v")]
+      elsif ["\xCE\xFA\xED\xFE".b, "\xCF\xFA\xED\xFE".b].include?(header.byteslice(0, 4))
+        MACHO_CPUS[header.byteslice(4, 4)&.unpack1("V")]
+      end
+    end
+
+    # Converts +data+, a binary String holding a whole file, in place.
+    def encode(filter, data)
+      case filter
+      when X86 then encode_x86(data)
+      when ARM64 then encode_arm64(data)
+      else raise ArgumentError, "Unknown branch filter #{filter.inspect}"
+      end
+      data
+    end
+
+    def ms_byte?(b)
+      b == 0 || b == 0xFF
+    end
+
+    # Mirrors unfilter_x86() with the conversion reversed. Everything it
+    # reads lies at or past the current position, ahead of the bytes
+    # converted so far, so it reads from an unmodified copy: searching the
+    # String being modified would rescan it each time.
+    def encode_x86(data)
+      size = data.bytesize
+      return if size < 5
+
+      input = data.dup
+      pos = 0
+      prev_pos = -1
+      prev_mask = 0
+      while (pos = input.index(X86_OPCODE, pos)) && pos < size - 4
+        distance = pos - prev_pos
+        if distance > 3
+          prev_mask = 0
+        else
+          prev_mask = (prev_mask << (distance - 1)) & 0x7
+          if prev_mask != 0
+            b = input.getbyte(pos + 4 - X86_MASK_TO_BIT_NUMBER[prev_mask])
+            if !X86_MASK_TO_ALLOWED[prev_mask] || ms_byte?(b)
+              prev_pos = pos
+              prev_mask = ((prev_mask << 1) & 0x7) | 1
+              pos += 1
+              next
+            end
+          end
+        end
+        prev_pos = pos
+
+        unless ms_byte?(input.getbyte(pos + 4))
+          prev_mask = ((prev_mask << 1) & 0x7) | 1
+          pos += 1
+          next
+        end
+
+        src = input.byteslice(pos + 1, 4).unpack1("V")
+        dest = nil
+        loop do
+          dest = (src + pos + 5) & 0xFFFF_FFFF
+          break if prev_mask == 0
+
+          index = X86_MASK_TO_BIT_NUMBER[prev_mask] * 8
+          break unless ms_byte?((dest >> (24 - index)) & 0xFF)
+
+          src = dest ^ ((1 << (32 - index)) - 1)
+        end
+        dest = (dest & 0x01FF_FFFF) | (dest & 0x0100_0000 == 0 ? 0 : 0xFF00_0000)
+        data[pos + 1, 4] = [dest].pack("V")
+        pos += 5
+      end
+    end
+
+    # Mirrors unfilter_arm64() with the conversion reversed.
+    def encode_arm64(data)
+      words = data.unpack("V*")
+      words.each_with_index do |instr, i|
+        pc = i * 4
+        if instr >> 26 == 0x25
+          words[i] = 0x9400_0000 | ((instr + (pc >> 2)) & 0x03FF_FFFF)
+        elsif instr & 0x9F00_0000 == 0x9000_0000
+          src = ((instr >> 29) & 3) | ((instr >> 3) & 0x001F_FFFC)
+          next unless (src + 0x0002_0000) & 0x001C_0000 == 0
+
+          dest = (src + (pc >> 12)) & 0xFFFF_FFFF
+          instr &= 0x9000_001F
+          instr |= (dest & 3) << 29
+          instr |= (dest & 0x0003_FFFC) << 3
+          instr |= (-(dest & 0x0002_0000)) & 0x00E0_0000
+          words[i] = instr
+        end
+      end
+      data[0, words.size * 4] = words.pack("V*")
+    end
+  end
+end
@@ -26,6 +26,9 @@ module Ocran
 
     include BuildConstants, CommandOutput, HostConfigHelper
 
+    # Files of digest/sha2, which the --precompile loader needs
+    DIGEST_FEATURE_REGEX = %r{/digest(?:/sha2)?(?:/loader|/version)?\.(?:rb|so|bundle)\z}
+
     # Packed name of the interpreter when a cosmopolitan Ruby payload is
     # used (--cosmo-ruby); the source APE is packed under this name.
     COSMO_RUBY_EXE = "ruby.com"
@@ -386,10 +389,47 @@ module Ocran
         end
       end
 
+      # With --precompile the packed loader checks the sources against
+      # their SHA-256 digests, so digest/sha2 is packed whether or not the
+      # application uses it.
+      if @option.precompile?
+        require "digest/sha2"
+        $LOADED_FEATURES.each do |f|
+          path = Pathname(f).cleanpath
+          next unless path.absolute? && path.to_posix.match?(DIGEST_FEATURE_REGEX)
+
+          features << path unless features.include?(path)
+        end
+      end
+
       say "Building #{@option.output_executable}"
       require_relative "build_helper"
       builder.extend(BuildHelper)
 
+      if @option.require_index?
+        require_relative "require_index"
+        hot = RequireIndex.read_access_log(@option.lazy_extract) if @option.lazy_extract
+        # Only the executable has a launch point. The loader of
+        # --precompile requires digest/sha2 before the index is in use.
+        if @option.launch_early? && builder.respond_to?(:launch)
+          boot = RequireIndex.boot_features(@option.precompile? ? ["digest/sha2"] : [])
+        end
+        require_index = RequireIndex.new(@post_env.load_path.map { |path| @post_env.expand_path(path) },
+                                         pack_sources: @option.pack_sources?, hot: hot, boot: boot)
+        require_index.attach(builder)
+      end
+
+      # Attached after the index, so that it also sees the sources that go
+      # into the blob of --pack-sources.
+      if @option.precompile?
+        require_relative "iseq_precompiler"
+        unless IseqPrecompiler.supported?
+          raise "--precompile is not supported by Ruby #{RUBY_VERSION}: its instruction sequence binaries cannot be relocated"
+        end
+        iseq_precompiler = IseqPrecompiler.new
+        iseq_precompiler.attach(builder)
+      end
+
       # Add the ruby executable and DLL
       say "Adding ruby executable #{ruby_executable}"
       if @option.cosmo_ruby
@@ -1039,7 +1079,10 @@ module Ocran
       end
 
       # Set environment variable
-      builder.export("RUBYOPT", rubyopt_result.rubyopt)
+      preloads = []
+      preloads << "-r#{RequireIndex::FEATURE}" if require_index
+      preloads << "-r#{IseqPrecompiler::FEATURE}" if iseq_precompiler
+      builder.export("RUBYOPT", [*preloads, rubyopt_result.rubyopt].reject(&:empty?).join(" "))
       neutralize_bundler_env(builder)
       # Add the load path that are required with the correct path after
       # src_prefix was adjusted.
@@ -1066,6 +1109,8 @@ module Ocran
         load_path = core_lib_paths + load_path
       end
 
+      load_path << RequireIndex::DIR if require_index
+      load_path << IseqPrecompiler::DIR if iseq_precompiler
       builder.set_env_path("RUBYLIB", *load_path)
       builder.set_env_path("GEM_HOME", GEMDIR)
 
@@ -1104,7 +1149,21 @@ module Ocran
       if rubyopt_result.translated?
         target_script = generate_rubyopt_launcher(builder, target_script, rubyopt_result)
       end
+      if iseq_precompiler
+        say "Precompiled #{iseq_precompiler.write(builder)} Ruby source files"
+      end
+      if require_index
+        say "Indexed #{require_index.write(builder, load_path)} loadable files for require"
+        say "Packed #{require_index.packed_count} Ruby source files into one file" if @option.pack_sources?
+        if @option.lazy_extract
+          say "Deferred extraction of #{require_index.cold_count} files (#{require_index.cold_size} bytes) to their first use"
+        end
+      end
       builder.exec(installed_ruby_exe, target_script, *@option.argv)
+      if boot
+        say "Starting the application before extracting #{require_index.tail_count} files (#{require_index.tail_size} bytes)"
+        require_index.write_tail(builder)
+      end
     end
 
     # Maps an absolute build-machine path to its location (relative to the
@@ -1325,11 +1384,17 @@ module Ocran
       say "Building app bundle #{bundle_path}"
 
       StubBuilder.new(executable_path,
+                      block_size: @option.block_size,
+                      branch_filter: @option.branch_filter?,
                       chdir_before: @option.chdir_before?,
                       chdir_to_exe_dir: @option.chdir_exe_dir?,
+                      compression: @option.compression,
+                      compression_level: @option.compression_level,
                       debug_extract: @option.enable_debug_extract?,
                       debug_mode: @option.enable_debug_mode?,
                       enable_compression: @option.enable_compression?,
+                      extract_cache: @option.enable_extract_cache?,
+                      extract_to_memory: @option.extract_to_memory?,
                       gui_mode: false,
                       icon_path: nil,
                       stub_path: cosmo_stub_path,
@@ -1393,6 +1458,12 @@ module Ocran
       if @option.enable_debug_extract?
         warning "--debug-extract has no effect in this mode: nothing is extracted, the application is read from the executable's own ZIP store"
       end
+      if @option.enable_extract_cache?
+        warning "--extract-cache has no effect in this mode: nothing is extracted, the application is read from the executable's own ZIP store"
+      end
+      if @option.extract_to_memory?
+        warning "--extract-to-memory has no effect in this mode: nothing is extracted, the application is read from the executable's own ZIP store"
+      end
 
       _, _, unsupported = ZipPayloadBuilder.parse_rubyopt(rubyopt)
       unless unsupported.empty?
@@ -1410,13 +1481,20 @@ module Ocran
       end
 
       StubBuilder.new(@option.output_executable,
+                      block_size: @option.block_size,
+                      branch_filter: @option.branch_filter?,
                       chdir_before: @option.chdir_before?,
                       chdir_to_exe_dir: @option.chdir_exe_dir?,
+                      compression: @option.compression,
+                      compression_level: @option.compression_level,
                       debug_extract: @option.enable_debug_extract?,
                       debug_mode: @option.enable_debug_mode?,
                       enable_compression: @option.enable_compression?,
+                      extract_cache: @option.enable_extract_cache?,
+                      extract_to_memory: @option.extract_to_memory?,
                       gui_mode: @option.windowed?,
                       icon_path: @option.icon_filename,
+                      launch_early: @option.launch_early?,
                       stub_path: cosmo_stub_path,
                       &to_proc) => builder
       say "Finished building #{@option.output_executable} (#{@option.output_executable.size} bytes)"
@@ -0,0 +1,135 @@
+# frozen_string_literal: true
+
+require "digest/sha2"
+
+# Loads the instruction sequences compiled by ocran --precompile in place of
+# the packed Ruby sources. It is packed as iseq/ocran_iseq.rb and required
+# through RUBYOPT when the application starts. Ocran::IseqPrecompiler loads
+# it at build time for the binary format, without installing the hook.
+#
+# The sources are compiled under ROOT_PLACEHOLDER, as the extraction
+# directory is only known at run time, and the path is stored in each
+# binary as string objects (path, realpath, __FILE__). Each binary file is
+#   [count: 32 bits][object index: 32 bits] * count [YARB binary]
+# listing the objects to relocate. relocate appends a copy of each of them
+# with the extraction directory in place of the placeholder and points the
+# object list at the copies, so nothing else in the binary moves.
+module OcranIseq
+  ROOT_PLACEHOLDER = "/ocran-iseq-root"
+
+  # Offsets of the header fields of a YARB binary (struct ibf_header)
+  SIZE_FIELD = 12
+  EXTRA_SIZE_FIELD = 16
+  OBJECT_LIST_SIZE_FIELD = 24
+  OBJECT_LIST_OFFSET_FIELD = 32
+
+  # Type of a string object in its header byte (RUBY_T_STRING)
+  T_STRING = 0x05
+
+  module_function
+
+  # Name of the binary of the source +data+ packed at +rel_path+
+  def binary_name(rel_path, data)
+    (Digest::SHA256.new << rel_path << "\0" << data).hexdigest + ".yarb"
+  end
+
+  # Reads an unsigned integer as written by ibf_dump_write_small_value(),
+  # returning it and the position after it.
+  def read_small_value(bin, pos)
+    c = bin.getbyte(pos)
+    n = c.odd? ? 1 : c.zero? ? 9 : (c & -c).bit_length
+    x = n == 9 ? 0 : c >> n
+    (1...n).each { |i| x = (x << 8) | bin.getbyte(pos + i) }
+    [x, pos + n]
+  end
+
+  def small_value(x)
+    bytes = []
+    while bytes.size < 8 && x >> (7 - bytes.size) != 0
+      bytes.unshift(x & 0xFF)
+      x >>= 8
+    end
+    bytes.unshift((((x << 1) | 1) << bytes.size) & 0xFF)
+    bytes.pack("C*")
+  end
+
+  def object_offsets(bin)
+    count = bin.unpack1("L", offset: OBJECT_LIST_SIZE_FIELD)
+    bin.unpack("L#{count}", offset: bin.unpack1("L", offset: OBJECT_LIST_OFFSET_FIELD))
+  end
+
+  # Returns the encoding index, position and size of the string object at
+  # +offset+, or nil for other objects.
+  def read_string(bin, offset)
+    return nil unless bin.getbyte(offset) & 0x3F == T_STRING
+
+    encoding, pos = read_small_value(bin, offset + 1)
+    size, pos = read_small_value(bin, pos)
+    [encoding, pos, size]
+  end
+
+  # Turns a binary compiled under ROOT_PLACEHOLDER into a binary file.
+  def prepare(bin)
+    offsets = object_offsets(bin)
+    indexes = offsets.each_index.select do |i|
+      _, pos, size = read_string(bin, offsets[i])
+      pos && size >= ROOT_PLACEHOLDER.bytesize &&
+        bin.byteslice(pos, ROOT_PLACEHOLDER.bytesize) == ROOT_PLACEHOLDER
+    end
+    [indexes.size, *indexes].pack("L*") + bin
+  end
+
+  # Returns the YARB binary of a binary file with +root+ in place of
+  # ROOT_PLACEHOLDER.
+  def relocate(data, root)
+    count = data.unpack1("L")
+    indexes = data.unpack("L#{count}", offset: 4)
+    bin = data.byteslice(4 * (count + 1)..)
+    raise ArgumentError, "unexpected extra data" unless bin.unpack1("L", offset: EXTRA_SIZE_FIELD).zero?
+
+    offsets = object_offsets(bin)
+    out = bin.byteslice(0, bin.unpack1("L", offset: SIZE_FIELD))
+    indexes.each do |i|
+      encoding, pos, size = read_string(bin, offsets[i])
+      path = root.b + bin.byteslice(pos + ROOT_PLACEHOLDER.bytesize, size - ROOT_PLACEHOLDER.bytesize)
+      header = bin.byteslice(offsets[i], 1)
+      offsets[i] = out.bytesize
+      out << header << small_value(encoding) << small_value(path.bytesize) << path
+    end
+    out << "\0" * (-out.bytesize % 4)
+    list_offset = out.bytesize
+    out << offsets.pack("L*")
+    out[SIZE_FIELD, 4] = [out.bytesize].pack("L")
+    out[OBJECT_LIST_OFFSET_FIELD, 4] = [list_offset].pack("L")
+    out
+  end
+
+  # Returns the instruction sequence of the packed source at +path+ if it
+  # was precompiled and has not changed since, nil otherwise.
+  def load_binary(path, root, dir)
+    return nil unless path.start_with?(root) && path.getbyte(root.bytesize) == 0x2F
+
+    # Sources stored by --pack-sources are not extracted
+    source = OcranRequireIndex.read_packed(path) if defined?(OcranRequireIndex)
+    name = binary_name(path.byteslice(root.bytesize + 1..), source || File.binread(path))
+    file = File.join(dir, name)
+    return nil unless File.file?(file)
+
+    RubyVM::InstructionSequence.load_from_binary(relocate(File.binread(file), root))
+  rescue StandardError
+    nil
+  end
+
+  # Makes require and load use the binaries in +dir+, the directory of this
+  # file in the extraction directory.
+  def install(dir)
+    root = File.dirname(dir)
+    RubyVM::InstructionSequence.singleton_class.prepend(Module.new do
+      define_method(:load_iseq) do |path|
+        OcranIseq.load_binary(path, root, dir) || (defined?(super) ? super(path) : nil)
+      end
+    end)
+  end
+end
+
+OcranIseq.install(File.dirname(File.expand_path(__FILE__))) unless defined?(Ocran::IseqPrecompiler)
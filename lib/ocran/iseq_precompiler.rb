@@ -0,0 +1,101 @@
+# frozen_string_literal: true
+require "pathname"
+require "tempfile"
+
+module Ocran
+  # Compiles the Ruby sources packed by a builder to instruction sequence
+  # binaries (--precompile), so that the application loads them instead of
+  # parsing and compiling every source file on each start. The binaries are
+  # packed in DIR together with the loader (iseq_loader.rb), which the
+  # packed RUBYOPT requires as FEATURE; a source whose contents changed is
+  # compiled as usual.
+  #
+  # Binaries only load into the Ruby version they were made by, so the
+  # sources are compiled by the running interpreter, which is the one that
+  # gets packed.
+  class IseqPrecompiler
+    load File.expand_path("refine_pathname.rb", __dir__) unless defined? RefinePathname
+    using RefinePathname
+
+    DIR = Pathname("iseq")
+    FEATURE = "ocran_iseq"
+    LOADER = File.expand_path("iseq_loader.rb", __dir__)
+
+    load LOADER unless defined? OcranIseq
+
+    # Extended into a builder to hand every packed Ruby source to the
+    # precompiler.
+    module Recording
+      attr_accessor :iseq_precompiler
+
+      def cp(source, target)
+        result = super
+        iseq_precompiler.add(source, target)
+        result
+      end
+    end
+
+    # True if binaries of the running Ruby can be relocated to another
+    # extraction directory, which depends on its binary format.
+    def self.supported?
+      path = "#{OcranIseq::ROOT_PLACEHOLDER}/src/check.rb"
+      code = "[__FILE__, __dir__]"
+      bin = OcranIseq.prepare(RubyVM::InstructionSequence.compile(code, path, path).to_binary)
+      root = "/ocran/#{'x' * 200}"
+      iseq = RubyVM::InstructionSequence.load_from_binary(OcranIseq.relocate(bin, root))
+      iseq.eval == ["#{root}/src/check.rb", "#{root}/src"]
+    rescue StandardError
+      false
+    end
+
+    def initialize
+      @sources = {}
+      @binaries = []
+    end
+
+    def attach(builder)
+      builder.extend(Recording)
+      builder.iseq_precompiler = self
+    end
+
+    def add(source, target)
+      target = Pathname(target)
+      return unless target.extname?(".rb") && !target.subpath?(DIR)
+
+      @sources[target.to_posix] = Pathname(source)
+    end
+
+    # Packs the loader and a binary for each source that compiles.
+    def write(builder)
+      builder.cp(Pathname(LOADER), DIR / "#{FEATURE}.rb")
+      @sources.each do |target, source|
+        data = File.binread(source)
+        bin = compile(data, target)
+        next unless bin
+
+        # Kept until the build finishes; the Inno Setup builder reads its
+        # source files only when the installer is compiled.
+        file = Tempfile.new(["ocran-iseq", ".yarb"])
+        file.binmode
+        file.write(bin)
+        file.close
+        @binaries << file
+        builder.cp(Pathname(file.path), DIR / OcranIseq.binary_name(target, data))
+      end
+      @binaries.size
+    end
+
+    def compile(data, target)
+      path = "#{OcranIseq::ROOT_PLACEHOLDER}/#{target}"
+      code = data.dup.force_encoding(Encoding::UTF_8)
+      verbose, $VERBOSE = $VERBOSE, nil
+      OcranIseq.prepare(RubyVM::InstructionSequence.compile(code, path, path).to_binary)
+    rescue SyntaxError, StandardError
+      # Left to be compiled when it is loaded, where any error shows
+      nil
+    ensure
+      $VERBOSE = verbose
+    end
+    private :compile
+  end
+end
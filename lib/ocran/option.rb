@@ -12,6 +12,8 @@ module Ocran
         :add_all_encoding? => true,
         :argv => [],
         :auto_detect_dlls? => true,
+        :block_size => nil,
+        :branch_filter? => false,
         :bundle_identifier => nil,
         :macosx_bundle => nil,
         :macosx_bundle? => false,
@@ -20,9 +22,13 @@ module Ocran
         :cosmo_cc => nil,
         :cosmo_ruby => nil,
         :cosmo_zip? => false,
+        :compression => :lzma,
+        :compression_level => nil,
         :enable_compression? => true,
         :enable_debug_extract? => false,
         :enable_debug_mode? => false,
+        :enable_extract_cache? => false,
+        :extract_to_memory? => false,
         :extra_dlls => [],
         :force_console? => false,
         :force_windows? => false,
@@ -30,11 +36,16 @@ module Ocran
         :gemfile => nil,
         :icon_filename => nil,
         :inno_setup_script => nil,
+        :launch_early? => false,
+        :lazy_extract => nil,
         :load_autoload? => true,
         :output_dir => nil,
         :output_override => nil,
         :output_zip => nil,
+        :pack_sources? => false,
+        :precompile? => false,
         :quiet? => false,
+        :require_index? => false,
         :rubyopt => nil,
         :run_script? => true,
         :script => nil,
@@ -100,6 +111,33 @@ Output options:
 --macosx-bundle    Build a macOS .app bundle. Use --output to name it (default: <scriptname>.app).
 --bundle-id <id>   Bundle identifier for the macOS app bundle (default: com.example.<appname>).
 --no-lzma          Disable LZMA compression of the executable.
+--compress=<codec> Compress the executable with lzma (default), zstd or
+                   zstd:<level> (1-22, default 19), or not at all with none.
+                   Zstandard needs the zstd command and makes a somewhat
+                   larger executable that unpacks several times faster.
+--block-size <n>   Compress the executable in independent blocks of <n> bytes
+                   (K and M suffixes allowed, default 8M), which the
+                   executable decompresses in parallel.
+--bcj              Convert the branch targets of x86, x86-64 and ARM64
+                   executables and libraries before compressing them, so
+                   that they compress better. Ignored without compression.
+--precompile       Compile the packed Ruby files to instruction sequences at
+                   build time and load those when the executable starts, so
+                   that they are not parsed and compiled on every start.
+--require-index    Pack an index of the Ruby files in the load path, so that
+                   require finds them without searching the directories.
+--pack-sources     Store the Ruby files of the load path in a single file that
+                   require reads them from, instead of extracting each of
+                   them. Implies --require-index.
+--lazy-extract <file>
+                   Extract only the gem files listed in <file>, written by
+                   running an executable built with --require-index with
+                   OCRAN_ACCESS_LOG=<file>, at startup; the others are
+                   extracted when first used. Implies --require-index.
+--launch-early     Start the application as soon as the interpreter and the
+                   files it loads to boot are extracted, and extract the
+                   rest while it starts; the application waits for a file
+                   only if it needs it before then. Implies --require-index.
 --innosetup <file> Use given Inno Setup script (.iss) to create an installer.
 
 Executable options:
@@ -115,6 +153,13 @@ Executable options:
                    translated to their packed locations at build time.
 --debug            Executable will be verbose.
 --debug-extract    Executable will unpack to local dir and not delete after.
+--extract-cache    Executable will unpack to a persistent directory in the
+                   temp dir keyed on a hash of its contents, and reuse it on
+                   later runs instead of unpacking again.
+--extract-to-memory
+                   On Linux, executable will unpack to a private in-memory
+                   filesystem that only it and its child processes can see,
+                   which works with a noexec /tmp and vanishes on exit.
 
 Experimental options:
 
@@ -168,6 +213,36 @@ EOF
         case arg
         when /\A--(no-)?lzma\z/
           @options[:enable_compression?] = !$1
+        when "--bcj"
+          @options[:branch_filter?] = true
+        when "--precompile"
+          @options[:precompile?] = true
+        when "--require-index"
+          @options[:require_index?] = true
+        when "--pack-sources"
+          @options[:pack_sources?] = true
+          @options[:require_index?] = true
+        when "--lazy-extract"
+          path = argv.shift
+          raise "Access log #{path} not found" unless path && File.file?(path)
+          @options[:lazy_extract] = Pathname.new(path).expand_path
+          @options[:require_index?] = true
+        when "--launch-early"
+          @options[:launch_early?] = true
+          @options[:require_index?] = true
+        when "--block-size"
+          size = argv.shift
+          unless size =~ /\A(\d+)([KM])?\z/i && $1.to_i.positive?
+            raise "Invalid block size #{size.inspect}: expected a positive number of bytes, optionally suffixed with K or M"
+          end
+          @options[:block_size] = $1.to_i * { nil => 1, "K" => 1024, "M" => 1024 * 1024 }[$2&.upcase]
+        when /\A--compress=(lzma|zstd|none)(?::(\d+))?\z/
+          codec, level = $1, $2
+          raise "--compress=#{codec} takes no level" if level && codec != "zstd"
+          raise "Zstandard level must be between 1 and 22" if level && !(1..22).cover?(level.to_i)
+          @options[:enable_compression?] = codec != "none"
+          @options[:compression] = codec.to_sym unless codec == "none"
+          @options[:compression_level] = level&.to_i
         when "--no-dep-run"
           @options[:run_script?] = false
         when "--add-all-core"
@@ -238,6 +313,10 @@ EOF
           @options[:enable_debug_mode?] = true
         when "--debug-extract"
           @options[:enable_debug_extract?] = true
+        when "--extract-cache"
+          @options[:enable_extract_cache?] = true
+        when "--extract-to-memory"
+          @options[:extract_to_memory?] = true
         when "--"
           @options[:argv] = argv.dup
           argv.clear
@@ -303,6 +382,26 @@ EOF
         raise "--chdir-first and --chdir-exe-dir cannot be used together"
       end
 
+      if enable_extract_cache? && enable_debug_extract?
+        raise "--extract-cache and --debug-extract cannot be used together"
+      end
+
+      if extract_to_memory? && (enable_extract_cache? || enable_debug_extract?)
+        raise "--extract-to-memory cannot be used with --extract-cache or --debug-extract"
+      end
+
+      if launch_early? && enable_extract_cache?
+        raise "--launch-early and --extract-cache cannot be used together"
+      end
+
+      if precompile? && cosmo_ruby
+        raise "--precompile cannot be used with --cosmo-ruby: the packed interpreter is not the one running OCRAN"
+      end
+
+      if require_index? && cosmo_ruby
+        raise "--require-index, --pack-sources, --lazy-extract and --launch-early cannot be used with --cosmo-ruby: the standard library of the payload Ruby is not packed as files"
+      end
+
       @options[:use_inno_setup?] = !!inno_setup_script
 
       @options[:verbose?] &&= !quiet?
@@ -314,8 +413,16 @@ EOF
           raise "The --debug-extract option conflicts with use of Inno Setup"
         end
 
+        if enable_extract_cache?
+          raise "The --extract-cache option conflicts with use of Inno Setup"
+        end
+
+        if extract_to_memory?
+          raise "The --extract-to-memory option conflicts with use of Inno Setup"
+        end
+
         if enable_compression?
-          raise "LZMA compression must be disabled (--no-lzma) when using Inno Setup"
+          raise "Compression must be disabled (--no-lzma or --compress=none) when using Inno Setup"
         end
 
         unless chdir_before?
@@ -379,6 +486,10 @@ EOF
 
     def auto_detect_dlls? = @options[__method__]
 
+    def block_size = @options[__method__]
+
+    def branch_filter? = @options[__method__]
+
     def chdir_before? = @options[__method__]
 
     def chdir_exe_dir? = @options[__method__]
@@ -404,12 +515,20 @@ EOF
     # or both.
     def cosmo? = !!(cosmo_cc || cosmo_ruby)
 
+    def compression = @options[__method__]
+
+    def compression_level = @options[__method__]
+
     def enable_compression? = @options[__method__]
 
     def enable_debug_extract? = @options[__method__]
 
     def enable_debug_mode? = @options[__method__]
 
+    def enable_extract_cache? = @options[__method__]
+
+    def extract_to_memory? = @options[__method__]
+
     def extra_dlls = @options[__method__]
 
     def force_autoload? = @options[__method__]
@@ -426,6 +545,10 @@ EOF
 
     def inno_setup_script = @options[__method__]
 
+    def launch_early? = @options[__method__]
+
+    def lazy_extract = @options[__method__]
+
     def load_autoload? = @options[__method__]
 
     def output_dir = @options[__method__]
@@ -436,6 +559,12 @@ EOF
 
     def output_zip = @options[__method__]
 
+    def pack_sources? = @options[__method__]
+
+    def precompile? = @options[__method__]
+
+    def require_index? = @options[__method__]
+
     def quiet? = @options[__method__]
 
     def wrapper_exe? = @options[__method__]
@@ -0,0 +1,251 @@
+# frozen_string_literal: true
+require "pathname"
+require "set"
+require "tempfile"
+require_relative "build_constants"
+
+module Ocran
+  # Writes the index of the Ruby files packed by a builder (--require-index)
+  # that lets the application resolve require without searching the load
+  # path directories. The index is packed in DIR together with the loader
+  # (require_index_loader.rb), which the packed RUBYOPT requires as FEATURE.
+  #
+  # The directories indexed are those that hold a packed file under the
+  # same relative path as its source has under a load path directory of the
+  # build, as well as the packed RUBYLIB directories: those that the load
+  # path of the application is made of.
+  #
+  # With pack_sources (--pack-sources) the .rb files packed in the first
+  # kind of directories, apart from those of the application in SRCDIR, go
+  # into a single blob file in DIR instead of being extracted one by one.
+  #
+  # With hot (--lazy-extract) the files of gem directories that are not in
+  # that list of the files a recorded run touched are stored in the blob
+  # too, to be extracted when the application first touches them. Native
+  # binaries and executables stay out of it, as they are opened by the
+  # system rather than through Ruby.
+  #
+  # With boot (--launch-early) the files of both kinds of directories that
+  # the interpreter does not load while it boots are held back, and written
+  # after the launch point of the stub (#write_tail), so that the
+  # application starts without waiting for them. Until the stub has written
+  # them all, the loader waits for that before touching one of them.
+  class RequireIndex
+    load File.expand_path("refine_pathname.rb", __dir__) unless defined? RefinePathname
+    using RefinePathname
+
+    include BuildConstants
+
+    DIR = Pathname("require_index")
+    FEATURE = "ocran_require_index"
+    LOADER = File.expand_path("require_index_loader.rb", __dir__)
+
+    # Files under the directory of an installed gem (gems/<name>-<version>/)
+    GEM_CONTENT_REGEX = %r{(?:\A|/)gems/[^/]+-\d[^/]*/}
+
+    NATIVE_EXTENSIONS = %w[.so .bundle .dll .dylib].freeze
+
+    load LOADER unless defined? OcranRequireIndex
+
+    # Extended into a builder to hand every packed file to the index,
+    # which keeps those it stores in the blob.
+    module Recording
+      attr_accessor :require_index
+
+      def cp(source, target)
+        case require_index.add(source, target)
+        when :packed
+          verbose "pack #{source} #{target}"
+        when :cold
+          mkdir(Pathname(target).dirname)
+          verbose "defer #{source} #{target}"
+        when :tail
+          mkdir(Pathname(target).dirname)
+          verbose "hold #{source} #{target}"
+        else
+          super
+        end
+      end
+    end
+
+    # +load_path+ is the load path of the application at build time, as
+    # absolute paths. +hot+ is the set of files (relative to the extraction
+    # root) to extract eagerly, or nil to extract all. +boot+ is the set of
+    # files the interpreter loads before the application starts (see
+    # ::boot_features), or nil to write all before the launch point.
+    def initialize(load_path, pack_sources: false, hot: nil, boot: nil)
+      @load_path = load_path.map { |path| Pathname(path).cleanpath.to_posix }.to_set
+      @pack_sources = pack_sources
+      @hot = hot
+      @boot = boot
+      @dirs = Set.new
+      @targets = []
+      @sources = {}
+      @cold = {}
+      @tail = {}
+    end
+
+    # Reads an OCRAN_ACCESS_LOG file
+    def self.read_access_log(path)
+      File.readlines(path, chomp: true).reject(&:empty?).to_set
+    end
+
+    # Files that the running Ruby loads before the packed RUBYOPT takes
+    # effect, as a plain interpreter with +features+ required
+    def self.boot_features(features = [])
+      script = "puts $LOADED_FEATURES"
+      out = IO.popen([{ "RUBYOPT" => nil }, RbConfig.ruby, *features.map { |f| "-r#{f}" }, "-e", script], &:read)
+      raise "Failed to list the files Ruby loads at startup" unless $?.success?
+
+      out.lines(chomp: true).map { |path| Pathname(path).cleanpath.to_posix }.to_set
+    end
+
+    def attach(builder)
+      builder.extend(Recording)
+      builder.require_index = self
+    end
+
+    # Records a packed file, returning :packed or :cold if it goes into the
+    # blob, or :tail if it is held back until #write_tail.
+    def add(source, target)
+      return nil if @launched
+
+      target = Pathname(target)
+      posix = target.to_posix
+      @targets << posix
+      mirrored = false
+      Pathname(source).cleanpath.ascend do |dir|
+        next unless @load_path.include?(dir.to_posix)
+
+        rel = Pathname(source).cleanpath.relative_path_from(dir).to_posix
+        next unless posix.end_with?("/#{rel}")
+
+        @dirs << posix.delete_suffix("/#{rel}")
+        mirrored = true
+      end
+      if @pack_sources && mirrored && target.extname?(".rb") && !target.subpath?(SRCDIR)
+        @sources[posix] = Pathname(source)
+        :packed
+      elsif cold?(source, posix)
+        @cold[posix] = Pathname(source)
+        :cold
+      elsif tail?(source, target, mirrored)
+        @tail[posix] = Pathname(source)
+        :tail
+      end
+    end
+
+    def cold?(source, target)
+      @hot && !@hot.include?(target) && target.match?(GEM_CONTENT_REGEX) &&
+        !NATIVE_EXTENSIONS.include?(File.extname(target).downcase) &&
+        File.file?(source) && !File.executable?(source)
+    end
+    private :cold?
+
+    # The files of the load path directories that the interpreter does not
+    # load while it boots, and those of gem directories. Encodings, which
+    # the interpreter loads, and binaries of gems, which the system opens,
+    # stay before the launch point: the loader never sees them opened.
+    def tail?(source, target, mirrored)
+      return false unless @boot && File.file?(source) && !target.subpath?(SRCDIR) && !target.subpath?(DIR)
+
+      posix = target.to_posix
+      return false if posix.include?("/enc/")
+
+      if mirrored
+        !@boot.include?(Pathname(source).cleanpath.to_posix)
+      else
+        posix.match?(GEM_CONTENT_REGEX) &&
+          !NATIVE_EXTENSIONS.include?(File.extname(posix).downcase) && !File.executable?(source)
+      end
+    end
+    private :tail?
+
+    # Packs the loader, the blob and the index of the files in the load
+    # path directories, among them +rubylib+ (relative to the extraction
+    # root). Returns the number of files indexed.
+    def write(builder, rubylib)
+      builder.cp(Pathname(LOADER), DIR / "#{FEATURE}.rb")
+      @targets << (DIR / OcranRequireIndex::INDEX_NAME).to_posix
+      rubylib.each { |dir| @dirs << Pathname(dir).to_posix unless Pathname(dir).absolute? }
+
+      dirs = @dirs.to_a
+      dir_indexes = dirs.each_with_index.to_h
+      names = Hash.new { |h, k| h[k] = [] }
+      loadable = [".rb", ".#{RbConfig::CONFIG["DLEXT"]}"]
+      @targets.uniq.each do |target|
+        next unless loadable.include?(File.extname(target))
+
+        dir = target
+        while (i = dir.rindex("/"))
+          dir = dir[0, i]
+          index = dir_indexes[dir]
+          names[target[(i + 1)..]] << index if index
+        end
+      end
+      names.default_proc = nil
+
+      # Kept until the build finishes; the Inno Setup builder reads its
+      # source files only when the installer is compiled.
+      @files = []
+      sources = {}
+      cold = {}
+      unless @sources.empty? && @cold.empty?
+        blob = new_tempfile(".blob")
+        [[@sources, sources], [@cold, cold]].each do |files, table|
+          files.each do |target, source|
+            data = File.binread(source)
+            table[target] = [blob.pos, data.bytesize]
+            blob.write(data)
+          end
+        end
+        blob.close
+        builder.cp(Pathname(blob.path), DIR / OcranRequireIndex::BLOB_NAME)
+      end
+      index = new_tempfile(".dump")
+      index.write(Marshal.dump([dirs, names, sources, cold, @tail.transform_values { true }]))
+      index.close
+      builder.cp(Pathname(index.path), DIR / OcranRequireIndex::INDEX_NAME)
+      names.each_value.sum(&:size)
+    end
+
+    # Writes the launch point of the stub, then the files held back for
+    # after it.
+    def write_tail(builder)
+      @launched = true
+      builder.launch
+      @tail.each { |target, source| builder.cp(source, target) }
+    end
+
+    # Number and total size of the files written after the launch point
+    def tail_count
+      @tail.size
+    end
+
+    def tail_size
+      @tail.each_value.sum(&:size)
+    end
+
+    # Number of Ruby sources stored in the blob
+    def packed_count
+      @sources.size
+    end
+
+    # Number and total size of the files extracted on first access
+    def cold_count
+      @cold.size
+    end
+
+    def cold_size
+      @cold.each_value.sum(&:size)
+    end
+
+    def new_tempfile(ext)
+      file = Tempfile.new(["ocran-require-index", ext])
+      file.binmode
+      @files << file
+      file
+    end
+    private :new_tempfile
+  end
+end
@@ -0,0 +1,453 @@
+# frozen_string_literal: true
+
+require "rbconfig"
+
+# Resolves require from the list of packed files written by ocran
+# --require-index, instead of probing every load path directory with stat.
+# It is packed as require_index/ocran_require_index.rb and required through
+# RUBYOPT when the application starts. Ocran::RequireIndex loads it at build
+# time for INDEX_NAME and BLOB_NAME, without installing the hook.
+#
+# The index maps each loadable file name, relative to a load path directory
+# of the package, to the directories (relative to the extraction directory)
+# that hold it. Each of those directories is listed completely, so a
+# $LOAD_PATH entry that is one of them needs no file system access; only
+# the other entries before it are checked. A feature that may already be
+# loaded is left to the normal search.
+#
+# With --pack-sources the Ruby files of those directories are not extracted
+# but stored in BLOB_NAME, at the offset and size the index gives for their
+# path. require, require_relative and load compile them from there, under
+# the path they would have had as files.
+#
+# With --lazy-extract the files of gems that no recorded run opened are
+# stored in the blob as well, and are extracted by the first require, load,
+# File, IO or Dir call that touches them. Runs with OCRAN_ACCESS_LOG set
+# record the packed files they touch there, for --lazy-extract.
+#
+# With --launch-early the stub starts the application before it has written
+# the files listed as the tail of the index. Until it has, OCRAN_EXTRACTING
+# names a marker file, and the first require, load, File, IO or Dir call
+# that touches one of them waits for the marker to go away.
+module OcranRequireIndex
+  INDEX_NAME = "index.dump"
+  BLOB_NAME = "sources.blob"
+
+  DLEXT = ".#{RbConfig::CONFIG["DLEXT"]}"
+
+  @mutex = Mutex.new
+  @entries_key = nil
+  @present = {}
+  @features = nil
+  @loaded = {}
+  @loaded_size = 0
+  @locks = {}
+  @sources = {}
+  @cold = {}
+  @blob_mutex = Mutex.new
+  @accessed = nil
+  @tail = {}
+  @extracting = nil
+
+  class << self
+    attr_reader :root
+
+    # Reads the index of the extraction directory +root+. +sources+ and
+    # +cold+ map the files in +blob+ to their offset and size; +tail+ has
+    # the files the stub writes after starting the application.
+    def setup(root, dirs, names, sources = {}, blob = nil, cold = {}, tail = {})
+      @root = root
+      @dir_indexes = dirs.each_with_index.to_h
+      @names = names
+      @sources = sources
+      @blob = blob
+      @cold = cold
+      @tail = tail
+    end
+
+    # Returns the absolute path of the packed file that require +feature+
+    # loads, or nil if it is not known.
+    def resolve(feature)
+      return nil unless feature.is_a?(String)
+      return resolve_path(feature) if path_feature?(feature)
+
+      names = file_names(feature)
+      return nil unless names
+
+      @mutex.synchronize { resolve_names(names) }
+    rescue StandardError
+      nil
+    end
+
+    # True if +feature+ names a file rather than a feature in $LOAD_PATH
+    def path_feature?(feature)
+      feature.start_with?("/", "./", "../", "~") || File.absolute_path?(feature)
+    end
+
+    # True if +path+ is stored in the blob instead of extracted.
+    def packed?(path)
+      rel = relative(path)
+      !rel.nil? && @sources.key?(rel)
+    end
+
+    # True if +path+ is in the blob, extracted or not.
+    def stored?(path)
+      rel = relative(path)
+      !rel.nil? && (@sources.key?(rel) || @cold.key?(rel))
+    end
+
+    # Returns the contents of +path+ if it is stored in the blob.
+    def read_packed(path)
+      offset, size = @sources[relative(path)]
+      return nil unless offset
+
+      @blob_mutex.synchronize { read_blob(offset, size) }
+    end
+
+    # Called with each path that a File, IO or Dir method is given:
+    # extracts it if it has not been yet and records it for
+    # OCRAN_ACCESS_LOG.
+    def access(path)
+      return unless path.is_a?(String) || path.respond_to?(:to_path)
+
+      rel = relative(File.expand_path(File.path(path)))
+      return unless rel
+
+      @accessed[rel] = true if @accessed
+      wait_extracted if @extracting && @tail.key?(rel)
+      extract(rel) if @cold.key?(rel)
+    rescue StandardError
+      nil
+    end
+
+    # Calls access with the files that require or load reads for +feature+
+    # given as a path
+    def access_feature(feature)
+      return unless feature.is_a?(String) && path_feature?(feature)
+
+      path = File.expand_path(feature)
+      if File.extname(path).empty?
+        access("#{path}.rb")
+        access("#{path}#{DLEXT}")
+      else
+        access(path)
+      end
+    end
+
+    # Extracts the files under +dir+, for methods that list a directory
+    def access_tree(dir)
+      return if @cold.empty? && !@extracting
+
+      dir = File.expand_path(File.path(dir))
+      rel = dir == @root ? "" : relative(dir)
+      return unless rel
+
+      prefix = rel.empty? ? "" : "#{rel}/"
+      wait_extracted if @extracting && @tail.each_key.any? { |key| key.start_with?(prefix) }
+      @cold.keys.each { |key| extract(key) if key.start_with?(prefix) }
+    rescue StandardError
+      nil
+    end
+
+    # Extracts the directory part of each Dir.glob pattern
+    def access_glob(patterns, base)
+      Array(patterns).each do |pattern|
+        pattern = File.path(pattern)
+        dir = File.dirname(pattern[/\A[^*?\[{]*/] + "x")
+        access_tree(File.expand_path(dir, base || Dir.pwd))
+      end
+    rescue StandardError
+      nil
+    end
+
+    # Loads +path+ from the blob as require does, returning false if it
+    # is already loaded or being loaded by this thread.
+    def require_packed(path)
+      lock = @mutex.synchronize { @locks[path] ||= Mutex.new }
+      return false if lock.owned?
+
+      lock.synchronize do
+        return false if @mutex.synchronize { sync_loaded; @loaded.key?(path) }
+
+        load_packed(path)
+        $LOADED_FEATURES << path
+        true
+      end
+    end
+
+    def load_packed(path)
+      iseq = RubyVM::InstructionSequence.load_iseq(path) if RubyVM::InstructionSequence.respond_to?(:load_iseq)
+      iseq ||= RubyVM::InstructionSequence.compile(read_packed(path).force_encoding(Encoding::UTF_8), path, path)
+      iseq.eval
+    end
+
+    # Blocks until the stub has written every file, as long as it is
+    # running.
+    def wait_extracted
+      marker = @extracting
+      return unless marker
+
+      sleep(0.001) while FileTest.exist?(marker) && Process.ppid == @stub_pid
+      @extracting = nil
+    end
+
+    # Makes require resolve features from the index of +dir+, the
+    # directory of this file in the extraction directory. With RubyGems
+    # the method that does the search under its require is replaced, so
+    # gem activation sees the feature as given.
+    def install(dir)
+      dirs, names, sources, cold, tail = Marshal.load(File.binread(File.join(dir, INDEX_NAME)))
+      setup(File.dirname(dir), dirs, names, sources || {}, File.join(dir, BLOB_NAME), cold || {}, tail || {})
+      marker = ENV["OCRAN_EXTRACTING"]
+      marker &&= File.expand_path(marker)
+      if !@tail.empty? && marker && relative(marker)
+        @extracting = marker
+        @stub_pid = Process.ppid
+      end
+      name = Kernel.private_method_defined?(:gem_original_require) ? :gem_original_require : :require
+      original = Kernel.instance_method(name)
+      Kernel.module_eval do
+        define_method(name) do |path|
+          resolved = OcranRequireIndex.resolve(path)
+          if resolved && OcranRequireIndex.packed?(resolved)
+            OcranRequireIndex.require_packed(resolved)
+          else
+            OcranRequireIndex.access_feature(resolved || path)
+            original.bind_call(self, resolved || path)
+          end
+        end
+        private name
+      end
+      install_packed(name) unless @sources.empty? && @cold.empty? && !@extracting
+      log = ENV["OCRAN_ACCESS_LOG"]
+      if log && !log.empty?
+        @accessed = {}
+        at_exit { write_access_log(log) }
+      end
+      install_access_hooks unless @cold.empty? && !@accessed && !@extracting
+    end
+
+    private
+
+    def read_blob(offset, size)
+      @blob_io ||= File.open(@blob, "rb")
+      @blob_io.seek(offset)
+      @blob_io.read(size)
+    end
+
+    # Writes a cold file where the stub would have, through a temporary
+    # file so that other processes sharing the directory (--extract-cache)
+    # never see it partly written.
+    def extract(rel)
+      @blob_mutex.synchronize do
+        offset, size = @cold[rel]
+        return unless offset
+
+        path = File.join(@root, rel)
+        temp = "#{path}.#{Process.pid}.tmp"
+        File.binwrite(temp, read_blob(offset, size))
+        File.rename(temp, path)
+        @cold.delete(rel)
+      end
+    end
+
+    # Appends the files under the extraction directory that were loaded
+    # or touched to the OCRAN_ACCESS_LOG file.
+    def write_access_log(log)
+      $LOADED_FEATURES.each do |feature|
+        rel = relative(feature)
+        @accessed[rel] = true if rel
+      end
+      File.open(log, "a") { |f| @accessed.each_key { |rel| f.puts(rel) } }
+    end
+
+    # Makes File, IO and Dir methods given a path extract and record it
+    def install_access_hooks
+      File.prepend(Module.new do
+        def initialize(path, *args, **kwargs, &block)
+          OcranRequireIndex.access(path)
+          super
+        end
+      end)
+
+      IO.singleton_class.prepend(Module.new do
+        %i[read binread readlines foreach].each do |name|
+          define_method(name) do |path, *args, **kwargs, &block|
+            OcranRequireIndex.access(path)
+            super(path, *args, **kwargs, &block)
+          end
+        end
+      end)
+
+      File.singleton_class.prepend(Module.new do
+        %i[exist? file? readable? size size? zero? empty? stat lstat mtime].each do |name|
+          define_method(name) do |path, *args|
+            OcranRequireIndex.access(path)
+            super(path, *args)
+          end
+        end
+      end)
+
+      Dir.singleton_class.prepend(Module.new do
+        define_method(:glob) do |pattern, *args, **kwargs, &block|
+          OcranRequireIndex.access_glob(pattern, kwargs[:base])
+          super(pattern, *args, **kwargs, &block)
+        end
+
+        define_method(:[]) do |*patterns, **kwargs|
+          OcranRequireIndex.access_glob(patterns, kwargs[:base])
+          super(*patterns, **kwargs)
+        end
+
+        %i[children entries each_child foreach empty?].each do |name|
+          define_method(name) do |path, *args, **kwargs, &block|
+            OcranRequireIndex.access_tree(path)
+            super(path, *args, **kwargs, &block)
+          end
+        end
+      end)
+    end
+
+    # Makes require_relative, load and RubyGems find the files in the blob
+    def install_packed(require_name)
+      original_load = Kernel.instance_method(:load)
+      Kernel.module_eval do
+        define_method(:require_relative) do |path|
+          base = caller_locations(1, 1).first&.absolute_path
+          raise LoadError, "cannot infer basepath" unless base
+
+          __send__(require_name, File.expand_path(path, File.dirname(base)))
+        end
+        private :require_relative
+
+        define_method(:load) do |path, wrap = false|
+          file = File.expand_path(path) if path.is_a?(String) && !wrap && OcranRequireIndex.path_feature?(path)
+          if file && OcranRequireIndex.packed?(file)
+            OcranRequireIndex.load_packed(file)
+            true
+          else
+            OcranRequireIndex.access(file) if file
+            original_load.bind_call(self, path, wrap)
+          end
+        end
+        private :load
+      end
+
+      return unless defined?(Gem::BasicSpecification)
+
+      Gem::BasicSpecification.prepend(Module.new do
+        def have_file?(file, suffixes)
+          super || full_require_paths.any? do |path|
+            suffixes.any? { |suffix| OcranRequireIndex.stored?(File.join(path, file + suffix)) }
+          end
+        end
+        private :have_file?
+      end)
+    end
+
+    # Path of +path+ relative to the extraction directory, if under it
+    def relative(path)
+      return nil unless @root && path.start_with?(@root) && path.getbyte(@root.bytesize) == 0x2F
+
+      path.byteslice(@root.bytesize + 1..)
+    end
+
+    # A feature given as a path is only resolved to a file in the blob;
+    # those on disk are left to the normal search.
+    def resolve_path(feature)
+      path = File.expand_path(feature)
+      path += ".rb" unless path.end_with?(".rb")
+      stored?(path) ? path : nil
+    end
+
+    # File names require tries for +feature+ in each directory, in order
+    def file_names(feature)
+      return nil if feature.empty? || feature.include?("\\") || feature.include?(":") ||
+                    feature == "." || feature == ".."
+
+      case (ext = File.extname(feature))
+      when ".rb", DLEXT then [feature]
+      when ".so", ".o" then [feature.delete_suffix(ext) + DLEXT]
+      else [feature + ".rb", feature + DLEXT]
+      end
+    end
+
+    def resolve_names(names)
+      refresh_entries
+      sync_loaded
+      best = nil
+      names.each do |name|
+        @names.fetch(name, []).each do |dir|
+          pos = @positions[dir]
+          next unless pos
+
+          path = "#{@entries[pos]}/#{name}"
+          return nil if @loaded.key?(path)
+
+          best = [pos, path] if best.nil? || pos < best[0]
+        end
+      end
+      return nil unless best
+
+      @unknown.each do |pos, entry|
+        entry = File.expand_path(entry)
+        if pos < best[0]
+          return nil if names.any? { |name| File.file?("#{entry}/#{name}") }
+        elsif names.any? { |name| @loaded.key?("#{entry}/#{name}") }
+          return nil
+        end
+      end
+      best[1]
+    end
+
+    # Classifies the $LOAD_PATH entries as indexed directories, missing
+    # directories and others (@unknown), again whenever $LOAD_PATH changes.
+    def refresh_entries
+      key = $LOAD_PATH.hash
+      return if key == @entries_key
+
+      @entries = []
+      @positions = {}
+      @unknown = []
+      $LOAD_PATH.each_with_index do |entry, pos|
+        entry = File.path(entry)
+        # Relative entries follow the working directory
+        unless File.absolute_path?(entry)
+          @entries << nil
+          @unknown << [pos, entry]
+          next
+        end
+
+        entry = File.expand_path(entry)
+        @entries << entry
+        dir = relative(entry)
+        dir &&= @dir_indexes[dir]
+        if dir
+          @positions[dir] ||= pos
+        elsif @present.fetch(entry) { @present[entry] = File.directory?(entry) }
+          @unknown << [pos, entry]
+        end
+      end
+      @entries_key = key
+    end
+
+    # Brings @loaded up to date with $LOADED_FEATURES, which normally only
+    # grows; it is read again if it was replaced or shrunk.
+    def sync_loaded
+      features = $LOADED_FEATURES
+      unless features.equal?(@features) && features.size >= @loaded_size &&
+             (@loaded_size.zero? || features[@loaded_size - 1].equal?(@last_feature))
+        @features = features
+        @loaded = {}
+        @loaded_size = 0
+      end
+      while @loaded_size < features.size
+        @loaded[features[@loaded_size]] = true
+        @loaded_size += 1
+      end
+      @last_feature = features.last
+    end
+  end
+end
+
+OcranRequireIndex.install(File.dirname(File.expand_path(__FILE__))) unless defined?(Ocran::RequireIndex)
@@ -1,5 +1,8 @@
 # frozen_string_literal: true
 require "tempfile"
+require "digest/sha2"
+require_relative "block_compressor"
+require_relative "branch_filter"
 require_relative "file_path_set"
 
 module Ocran
@@ -14,6 +17,30 @@ module Ocran
     OP_SETENV = 3
     OP_SET_SCRIPT = 4
     OP_CREATE_SYMLINK = 5
+    OP_PADDING = 6
+    OP_DUPLICATE_FILE = 7
+    OP_CREATE_FILTERED_FILE = 8
+    OP_LAUNCH = 9
+
+    # Uncompressed files of at least ALIGN_MIN_SIZE bytes start on an
+    # ALIGNMENT boundary of the executable, so that the stub can have the
+    # kernel copy them, or share their blocks on copy-on-write filesystems,
+    # instead of writing them from memory. Smaller files are not worth the
+    # padding.
+    ALIGNMENT = 4096
+    ALIGN_MIN_SIZE = 64 * 1024
+
+    # Files of at least DEDUP_MIN_SIZE bytes whose contents were already
+    # added under another name are stored once; the stub hard links (or
+    # copies) the earlier file instead. Smaller files cost less to store
+    # again than to hash.
+    DEDUP_MIN_SIZE = 256
+
+    # With branch_filter, executables and shared libraries within these
+    # sizes are converted with a BranchFilter before compression. The stub
+    # holds such a file in memory whole to convert it back.
+    BRANCH_FILTER_MIN_SIZE = 4096
+    BRANCH_FILTER_MAX_SIZE = 64 * 1024 * 1024
 
     DEBUG_MODE          = 0x01
     EXTRACT_TO_EXE_DIR  = 0x02
@@ -22,6 +49,16 @@ module Ocran
     DATA_COMPRESSED     = 0x10
     RUN_IN_EXE_DIR      = 0x20
     CHDIR_TO_EXE_DIR    = 0x40
+    EXTRACT_CACHE       = 0x80
+    DATA_ZSTD           = 0x100
+    COMPACT_OPCODES     = 0x200
+    WIDE_SIZES          = 0x400
+    EXTRACT_TO_MEMORY   = 0x800
+    LAUNCH_EARLY        = 0x1000
+
+    # Stands in the 32-bit footer offset of WIDE_SIZES payloads, after the
+    # 64-bit offset.
+    WIDE_OFFSET_MARKER = 0xFFFF_FFFF
 
     WINDOWS = Gem.win_platform?
 
@@ -44,6 +81,24 @@ module Ocran
 
     LZMA_CMD = WINDOWS ? [LZMA_PATH, "e", "-si", "-so"] : find_posix_lzma_cmd
 
+    ZSTD_DEFAULT_LEVEL = 19
+    ZSTD_MAX_LEVEL = 22
+
+    # Zstandard is not shipped with the gem; the zstd command must be on
+    # PATH. Levels above 19 need --ultra.
+    def self.zstd_cmd(level = nil)
+      level ||= ZSTD_DEFAULT_LEVEL
+      unless (1..ZSTD_MAX_LEVEL).cover?(level)
+        raise ArgumentError, "Zstandard level #{level} is out of range (1-#{ZSTD_MAX_LEVEL})"
+      end
+
+      null = WINDOWS ? "NUL" : "/dev/null"
+      unless system("zstd", "--version", out: null, err: null)
+        raise "No zstd command found; install Zstandard or use LZMA compression"
+      end
+      ["zstd", "-q", "-c", *("--ultra" if level > 19), "-#{level}"]
+    end
+
     attr_reader :data_size
 
     # Clear invalid security directory entries from PE executables
@@ -74,6 +129,19 @@ module Ocran
       end
     end
 
+    # block_size:
+    # Size in bytes of the blocks the data is cut into before compression.
+    # Each block is compressed on its own so the stub can decompress them in
+    # parallel; smaller blocks parallelize better, larger ones compress
+    # better. Defaults to BlockCompressor::DEFAULT_BLOCK_SIZE.
+    #
+    # branch_filter:
+    # When set to true along with enable_compression, ELF, PE and Mach-O
+    # files for x86, x86-64 and ARM64 are stored with their call and branch
+    # targets converted to absolute addresses (OP_CREATE_FILTERED_FILE),
+    # which usually makes native code compress 5-10% better. The stub
+    # converts them back after decompressing.
+    #
     # chdir_before:
     # When set to true, the working directory is changed to the application's
     # deployment location at runtime.
@@ -84,6 +152,15 @@ module Ocran
     # relative file access resolve next to the executable regardless of how
     # it was invoked. Mutually exclusive with chdir_before.
     #
+    # compression:
+    # Codec for enable_compression: :lzma (the default) or :zstd. Zstandard
+    # output is somewhat larger but decompresses several times faster, so
+    # the executable starts sooner.
+    #
+    # compression_level:
+    # Zstandard compression level (1-22), ZSTD_DEFAULT_LEVEL when nil.
+    # Ignored for LZMA.
+    #
     # debug_mode:
     # When the debug_mode option is set to true, the stub will output debug information
     # when the exe file is executed. Debug mode can also be enabled within the directive
@@ -96,6 +173,23 @@ module Ocran
     # When set to false, the runtime file is extracted to the system's temporary directory,
     # and the extracted files are deleted after the application exits.
     #
+    # extract_cache:
+    # When set to true, the stub extracts into a persistent directory in the
+    # system's temporary directory whose name is derived from a SHA-256 hash
+    # of the payload, and later runs of the same executable reuse it without
+    # decompressing anything. OP_SETENV and OP_SET_SCRIPT are then written to
+    # an uncompressed launch section after the data, followed by the hash.
+    # The directory is never deleted by the stub. Cannot be combined with
+    # debug_extract or run_in_exe_dir.
+    #
+    # extract_to_memory:
+    # When set to true, the stub mounts a private tmpfs over its temporary
+    # extraction directory on Linux, in mount (and user) namespaces of its
+    # own, so the files stay in memory, may be executed on a noexec /tmp
+    # and disappear with the application. Where that is not permitted, and
+    # on other platforms, it extracts to disk as usual. Cannot be combined
+    # with extract_cache, debug_extract or run_in_exe_dir.
+    #
     # gui_mode:
     # When set to true, the stub does not display a console window at startup. Errors are shown in a dialog window.
     # When set to false, the stub reports errors through the console window.
@@ -103,6 +197,21 @@ module Ocran
     # icon_path:
     # Specifies the path to the icon file to be embedded in the stub's resources.
     #
+    # launch_early:
+    # When set to true, the stub starts the application at the OP_LAUNCH
+    # written by #launch, as soon as the files before it are on disk, and
+    # writes the files after it while the application starts up. A marker
+    # file whose path the application gets in OCRAN_EXTRACTING exists
+    # until they are all written. Cannot be combined with extract_cache or
+    # run_in_exe_dir.
+    #
+    # legacy_opcodes:
+    # When set to true, the opcodes are written in the version 1 encoding,
+    # with 32-bit sizes and whole paths, instead of the compact version 2
+    # encoding (COMPACT_OPCODES): LEB128 sizes and paths front-coded
+    # against the previous one, which saves most of the repeated
+    # lib/ruby/... prefixes. Stubs read both.
+    #
     # run_in_exe_dir:
     # When set to true, the stub runs the application directly from its own
     # directory instead of extracting to a temporary directory. Used for
@@ -116,13 +225,57 @@ module Ocran
     # cosmocc, see --cosmo). When set, it takes precedence over both
     # STUB_PATH and STUBW_PATH.
     #
-    def initialize(path, chdir_before: nil, chdir_to_exe_dir: nil,
+    # wide_sizes:
+    # When set to true, the sizes and offsets around the opcode stream
+    # (block index, table of contents, launch section and footer) are
+    # 64-bit (WIDE_SIZES), so that the payload can exceed 4 GiB; when set to
+    # false, they are 32-bit. Defaults to the value of compact_opcodes (the
+    # opposite of legacy_opcodes): files over 4 GiB need the LEB128 sizes of
+    # the version 2 opcodes as well, so wide sizes only pay off with them,
+    # while the version 1 encoding keeps its smaller 32-bit fields.
+    #
+    def initialize(path, block_size: nil, branch_filter: nil, chdir_before: nil, chdir_to_exe_dir: nil,
+                   compression: nil, compression_level: nil,
                    debug_extract: nil, debug_mode: nil,
-                   enable_compression: nil, gui_mode: nil, icon_path: nil,
-                   run_in_exe_dir: nil, stub_path: nil)
+                   enable_compression: nil, extract_cache: nil,
+                   extract_to_memory: nil, gui_mode: nil,
+                   icon_path: nil, launch_early: nil, legacy_opcodes: nil,
+                   run_in_exe_dir: nil, stub_path: nil, wide_sizes: nil)
       @dirs = FilePathSet.new
       @files = FilePathSet.new
+      @contents = {}
       @data_size = 0
+      @toc = String.new(encoding: Encoding::BINARY)
+      @toc_count = 0
+      @compact_opcodes = !legacy_opcodes
+      @wide_sizes = wide_sizes.nil? ? @compact_opcodes : wide_sizes
+      @last_path = "".b
+      @block_size = block_size || BlockCompressor::DEFAULT_BLOCK_SIZE
+
+      if extract_cache && (debug_extract || run_in_exe_dir)
+        raise ArgumentError, "extract_cache cannot be combined with debug_extract or run_in_exe_dir"
+      end
+      if extract_to_memory && (extract_cache || debug_extract || run_in_exe_dir)
+        raise ArgumentError, "extract_to_memory cannot be combined with extract_cache, debug_extract or run_in_exe_dir"
+      end
+      if launch_early && (extract_cache || run_in_exe_dir)
+        raise ArgumentError, "launch_early cannot be combined with extract_cache or run_in_exe_dir"
+      end
+      @launch_early = launch_early
+      @launch = extract_cache ? String.new : nil
+      @align_files = !enable_compression
+      @branch_filter = branch_filter && enable_compression
+
+      compression ||= :lzma
+      command = if !enable_compression
+                  nil
+                elsif compression == :zstd
+                  self.class.zstd_cmd(compression_level)
+                elsif compression == :lzma
+                  LZMA_CMD
+                else
+                  raise ArgumentError, "Unknown compression #{compression.inspect}"
+                end
 
       if icon_path && !File.exist?(icon_path)
         raise "Icon file #{icon_path} not found"
@@ -154,14 +307,14 @@ module Ocran
         @of = of
         @opcode_offset = @of.size
 
-        write_header(debug_mode, debug_extract, chdir_before, enable_compression, run_in_exe_dir, chdir_to_exe_dir)
+        write_header(debug_mode, debug_extract, chdir_before, command && compression, run_in_exe_dir, chdir_to_exe_dir, extract_cache, extract_to_memory)
 
         b = proc {
           yield(self)
         }
 
-        if enable_compression && LZMA_CMD
-          compress(&b)
+        if command
+          compress(command, compression, &b)
         else
           b.yield
         end
@@ -178,12 +331,16 @@ module Ocran
 
       write_opcode(OP_CREATE_DIRECTORY)
       write_path(target)
+      add_toc_entry(OP_CREATE_DIRECTORY, target, 0, 0)
     end
 
     def symlink(link_path, target)
       write_opcode(OP_CREATE_SYMLINK)
       write_path(link_path)
-      write_string(target.to_s)
+      # The entry points at the target string, past its size field.
+      write_string(target.to_s) do
+        add_toc_entry(OP_CREATE_SYMLINK, link_path, @data_size, target.to_s.bytesize)
+      end
     end
 
     def cp(source, target)
@@ -193,11 +350,63 @@ module Ocran
 
       return unless @files.add?(source, target)
 
+      size = File.size(source)
+      if size >= DEDUP_MIN_SIZE
+        digest = Digest::SHA256.file(source).digest
+        if (original = @contents[digest])
+          duplicate_file(target, *original)
+          return
+        end
+      end
+
+      if @branch_filter && (filter = branch_filter_for(source, size))
+        filtered_file(source, target, filter, digest)
+        return
+      end
+
+      align_file(target, size) if @align_files
       write_opcode(OP_CREATE_FILE)
       write_path(target)
-      write_file(source)
+      write_size(size)
+      @contents[digest] = [target, OP_CREATE_FILE, @data_size, size] if digest
+      add_toc_entry(OP_CREATE_FILE, target, @data_size, size)
+      IO.copy_stream(source, @of)
+      @data_size += size
     end
 
+    # Creates +target+ from the file added earlier as +original+, whose
+    # entry of type +type+ starts at +offset+ of the opcode stream. The
+    # table of contents lists it as a file sharing those contents.
+    def duplicate_file(target, original, type, offset, size)
+      write_opcode(OP_DUPLICATE_FILE)
+      write_path(target)
+      write_path(original)
+      add_toc_entry(type, target, offset, size)
+    end
+    private :duplicate_file
+
+    def branch_filter_for(source, size)
+      return nil unless (BRANCH_FILTER_MIN_SIZE..BRANCH_FILTER_MAX_SIZE).cover?(size)
+
+      BranchFilter.detect(source)
+    end
+    private :branch_filter_for
+
+    # The table of contents entry of a filtered file points at the filter
+    # id, which the converted contents follow.
+    def filtered_file(source, target, filter, digest)
+      data = BranchFilter.encode(filter, File.binread(source))
+      size = data.bytesize
+      write_opcode(OP_CREATE_FILTERED_FILE)
+      write_path(target)
+      write_size(size)
+      @contents[digest] = [target, OP_CREATE_FILTERED_FILE, @data_size, size] if digest
+      add_toc_entry(OP_CREATE_FILTERED_FILE, target, @data_size, size)
+      @of << [filter].pack("C") << data
+      @data_size += 1 + size
+    end
+    private :filtered_file
+
     # Specifies the final application script to be launched, which can be called
     # from any position in the data stream. It cannot be specified more than once.
     #
@@ -210,36 +419,61 @@ module Ocran
       end
       @script_set = true
 
-      write_opcode(OP_SET_SCRIPT)
-      write_string_array(convert_to_native(image), convert_to_native(script), *argv)
+      with_launch_section do
+        write_opcode(OP_SET_SCRIPT)
+        write_string_array(convert_to_native(image), convert_to_native(script), *argv)
+      end
+    end
+
+    # With launch_early, ends the files that the application needs to
+    # start; the stub starts it here. Comes after exec and every export,
+    # which the application must have been given by then.
+    def launch
+      write_opcode(OP_LAUNCH)
     end
 
     def export(name, value)
-      write_opcode(OP_SETENV)
-      write_string(name.to_s)
-      write_string(value.to_s)
+      with_launch_section do
+        write_opcode(OP_SETENV)
+        write_string(name.to_s)
+        write_string(value.to_s)
+      end
     end
 
-    def compress
-      raise "No LZMA compressor found" unless LZMA_CMD
-
-      IO.popen(LZMA_CMD, "r+b") do |lzma|
-        _of, @of = @of, lzma
-        Thread.new { yield(self); lzma.close_write }
-        IO.copy_stream(lzma, _of)
+    # With extract_cache, opcodes that must run on every start are diverted
+    # to the launch section, which stays uncompressed and does not count
+    # towards data_size.
+    def with_launch_section
+      return yield unless @launch
+
+      of, data_size = @of, @data_size
+      @of = @launch
+      begin
+        yield
+      ensure
+        @of, @data_size = of, data_size
+      end
+    end
+    private :with_launch_section
+
+    def compress(command, format)
+      _of = @of
+      @of = BlockCompressor.new(_of, command, format: format, block_size: @block_size,
+                                wide_sizes: @wide_sizes)
+      begin
+        yield(self)
+        @of.finish
+      ensure
         @of = _of
       end
-
-      # Calculate the position to write the LZMA decompressed size (64-bit unsigned integer)
-      # @opcode_offset: start position of the data section
-      # 1: size of the header byte
-      # 5: size of the LZMA header in bytes
-      File.binwrite(@of.path, [@data_size].pack("Q<"), @opcode_offset + 1 + 5)
     end
     private :compress
 
-    def write_header(debug_mode, debug_extract, chdir_before, compressed, run_in_exe_dir = nil, chdir_to_exe_dir = nil)
+    # compression is the codec of compressed data (:lzma or :zstd), or nil.
+    def write_header(debug_mode, debug_extract, chdir_before, compression, run_in_exe_dir = nil, chdir_to_exe_dir = nil, extract_cache = nil, extract_to_memory = nil)
       next_to_exe, delete_after = debug_extract, !debug_extract
+      # The cache directory outlives the process by design.
+      delete_after = false if extract_cache
       if run_in_exe_dir
         # Wrapper mode: run in place next to the executable — never extract,
         # and (critically) never delete the application directory on exit.
@@ -250,10 +484,16 @@ module Ocran
                 (next_to_exe ? EXTRACT_TO_EXE_DIR : 0) |
                 (delete_after ? AUTO_CLEAN_INST_DIR : 0) |
                 (chdir_before ? CHDIR_BEFORE_SCRIPT : 0) |
-                (compressed ? DATA_COMPRESSED : 0) |
+                (compression ? DATA_COMPRESSED : 0) |
+                (compression == :zstd ? DATA_ZSTD : 0) |
                 (run_in_exe_dir ? RUN_IN_EXE_DIR : 0) |
-                (chdir_to_exe_dir ? CHDIR_TO_EXE_DIR : 0)
-      ].pack("C")
+                (chdir_to_exe_dir ? CHDIR_TO_EXE_DIR : 0) |
+                (extract_cache ? EXTRACT_CACHE : 0) |
+                (@compact_opcodes ? COMPACT_OPCODES : 0) |
+                (@wide_sizes ? WIDE_SIZES : 0) |
+                (extract_to_memory ? EXTRACT_TO_MEMORY : 0) |
+                (@launch_early ? LAUNCH_EARLY : 0)
+      ].pack("v")
     end
     private :write_header
 
@@ -264,15 +504,44 @@ module Ocran
     private :write_opcode
 
     def write_size(i)
-      if i > 0xFFFF_FFFF
-        raise ArgumentError, "Size #{i} is too large: must be 32-bit unsigned integer (0 to 4294967295)"
+      field = size_field(i)
+      @of << field
+      @data_size += field.bytesize
+    end
+    private :write_size
+
+    # Encodes a size: 32-bit little-endian, or unsigned LEB128 of at least
+    # +width+ bytes with COMPACT_OPCODES.
+    def size_field(i, width = 1)
+      unless @compact_opcodes
+        if i > 0xFFFF_FFFF
+          raise ArgumentError, "Size #{i} is too large: must be 32-bit unsigned integer (0 to 4294967295)"
+        end
+        return [i].pack("V")
       end
+      leb128(i, width)
+    end
+    private :size_field
+
+    # Encodes an unsigned LEB128 integer of at least +width+ bytes.
+    def leb128(i, width = 1)
+      if i > 0xFFFF_FFFF_FFFF_FFFF
+        raise ArgumentError, "Size #{i} is too large: must be 64-bit unsigned integer"
+      end
+
+      field = String.new(encoding: Encoding::BINARY)
+      loop do
+        byte = i & 0x7F
+        i >>= 7
+        width -= 1
+        return field << byte if i.zero? && width <= 0
 
-      @of << [i].pack("V")
-      @data_size += 4
+        field << (byte | 0x80)
+      end
     end
-    private :write_size
+    private :leb128
 
+    # Yields after writing the size, with @data_size at the string itself.
     def write_string(str)
       len = str.bytesize + 1 # +1 to account for the null terminator
 
@@ -281,6 +550,7 @@ module Ocran
       end
 
       write_size(len)
+      yield if block_given?
       @of << [str].pack("Z*")
       @data_size += len
     end
@@ -304,24 +574,138 @@ module Ocran
     end
     private :write_string_array
 
-    def write_file(src)
-      size = File.size(src)
-      write_size(size)
-      IO.copy_stream(src, @of)
-      @data_size += size
-    end
-    private :write_file
-
+    # With COMPACT_OPCODES a path is the length of the prefix it shares
+    # with the previous path, then the rest of it as a string.
     def write_path(path)
-      write_string(convert_to_native(path))
+      path = convert_to_native(path).b
+      unless @compact_opcodes
+        write_string(path)
+        return
+      end
+
+      if path.bytesize + 1 > 0xFFFF
+        raise ArgumentError, "Path #{path} is too long: must be less than or equal to 65535 bytes including null terminator"
+      end
+      shared = shared_path_size(path)
+      @last_path = path
+      write_size(shared)
+      write_string(path.byteslice(shared..))
     end
     private :write_path
 
+    def shared_path_size(path)
+      max = [path.bytesize, @last_path.bytesize].min
+      shared = 0
+      shared += 1 while shared < max && path.getbyte(shared) == @last_path.getbyte(shared)
+      shared
+    end
+    private :shared_path_size
+
+    # Size of the encoded path and the size field following it
+    def file_header_size(path, size)
+      path = convert_to_native(path).b
+      return 4 + path.bytesize + 1 + 4 unless @compact_opcodes
+
+      shared = shared_path_size(path)
+      suffix = path.bytesize - shared + 1
+      size_field(shared).bytesize + size_field(suffix).bytesize + suffix +
+        size_field(size).bytesize
+    end
+    private :file_header_size
+
+    # Pads the data with OP_PADDING so that the contents of the
+    # OP_CREATE_FILE for +target+ written next start on an ALIGNMENT
+    # boundary of the executable.
+    def align_file(target, size)
+      return if size < ALIGN_MIN_SIZE
+
+      header = 1 + file_header_size(target, size)
+      pad = -(@of.size + header) % ALIGNMENT
+      return if pad.zero?
+
+      # OP_PADDING takes the opcode and a size field of fixed width itself:
+      # 4 bytes, or 2 LEB128 bytes, enough for any padding below 16 KiB.
+      width = @compact_opcodes ? 2 : 4
+      pad += ALIGNMENT if pad < 1 + width
+      write_opcode(OP_PADDING)
+      field = size_field(pad - 1 - width, width)
+      @of << field << "\0" * (pad - 1 - width)
+      @data_size += field.bytesize + pad - 1 - width
+    end
+    private :align_file
+
+    # Records an entry of the table of contents written by write_footer.
+    # offset and size locate the file contents or the symlink target in the
+    # opcode stream (the data before compression).
+    def add_toc_entry(type, path, offset, size)
+      path = convert_to_native(path)
+      @toc << if @wide_sizes
+                [type].pack("C") << leb128(offset) << leb128(size) <<
+                  leb128(path.bytesize + 1) << [path].pack("Z*")
+              else
+                [type, offset].pack("CQ<") << footer_size(size) <<
+                  [path.bytesize + 1, path].pack("VZ*")
+              end
+      @toc_count += 1
+    end
+    private :add_toc_entry
+
+    # The table of contents follows the data, uncompressed, so that the stub
+    # can list the payload and extract single entries without running the
+    # opcodes (OCRAN_INSPECT):
+    #
+    #   [entry 0]...[entry n-1][n][table size]
+    #   entry: [type: opcode, 1 byte][offset: 8 bytes][size][path size][path]
+    #
+    # With WIDE_SIZES n and the table size are 64-bit, and the offset and
+    # sizes of an entry LEB128.
+    def write_toc
+      @toc << footer_size(@toc_count)
+      @of << @toc << footer_size(@toc.bytesize)
+    end
+    private :write_toc
+
+    # The sizes after the data: 32-bit, or 64-bit with WIDE_SIZES.
+    def footer_size(i)
+      return [i].pack("Q<") if @wide_sizes
+      if i > 0xFFFF_FFFF
+        raise ArgumentError, "Size #{i} is too large: must be 32-bit unsigned integer without wide_sizes"
+      end
+      [i].pack("V")
+    end
+    private :footer_size
+
     def write_footer
-      @of << ([@opcode_offset] + Signature).pack("VC*")
+      write_toc
+      if @launch
+        @of << @launch << footer_size(@launch.bytesize)
+        @of << payload_digest
+      end
+      if @wide_sizes
+        @of << [@opcode_offset, WIDE_OFFSET_MARKER].pack("Q<V")
+      else
+        @of << footer_size(@opcode_offset)
+      end
+      @of << Signature.pack("C*")
     end
     private :write_footer
 
+    # SHA-256 of everything written after the stub so far, used by the stub
+    # as the extraction cache key. Read back from the file so that it covers
+    # the data as stored, compressed or not.
+    def payload_digest
+      @of.flush
+      digest = Digest::SHA256.new
+      File.open(@of.path, "rb") do |f|
+        f.seek(@opcode_offset)
+        while (chunk = f.read(1 << 20))
+          digest << chunk
+        end
+      end
+      digest.digest
+    end
+    private :payload_digest
+
     def convert_to_native(path)
       WINDOWS ? path.to_s.tr(File::SEPARATOR, "\\") : path.to_s
     end
@@ -0,0 +1,143 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "branch_filter.h"
+
+/*
+   Both filters convert the whole file in one pass with the position of
+   the first byte taken as 0. They mirror Ocran::BranchFilter in the
+   builder, which does the opposite conversion; any change has to be made
+   on both sides.
+*/
+
+static uint32_t get_uint32(const uint8_t *b)
+{
+    return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16
+           | (uint32_t)b[3] << 24;
+}
+
+static void put_uint32(uint8_t *b, uint32_t v)
+{
+    b[0] = (uint8_t)v;
+    b[1] = (uint8_t)(v >> 8);
+    b[2] = (uint8_t)(v >> 16);
+    b[3] = (uint8_t)(v >> 24);
+}
+
+// Most significant byte of a plausible near call displacement
+static bool is_ms_byte(uint8_t b)
+{
+    return b == 0 || b == 0xFF;
+}
+
+static void unfilter_x86(uint8_t *data, size_t size)
+{
+    static const bool MaskToAllowed[8] = { 1, 1, 1, 0, 1, 0, 0, 0 };
+    static const unsigned MaskToBitNumber[8] = { 0, 1, 2, 2, 3, 3, 3, 3 };
+
+    if (size < 5) {
+        return;
+    }
+
+    /* prev_mask records which of the three bytes before an opcode were
+       E8/E9 candidates themselves, so that overlapping candidates are
+       decided the same way when encoding and decoding. */
+    size_t pos = 0, prev_pos = (size_t)0 - 1;
+    unsigned prev_mask = 0;
+    for (;;) {
+        while (pos < size - 4 && (data[pos] & 0xFE) != 0xE8) {
+            pos++;
+        }
+        if (pos >= size - 4) {
+            break;
+        }
+
+        uint8_t *p = data + pos;
+        size_t distance = pos - prev_pos;
+        if (distance > 3) {
+            prev_mask = 0;
+        } else {
+            prev_mask = (prev_mask << (distance - 1)) & 0x7;
+            if (prev_mask != 0) {
+                uint8_t b = p[4 - MaskToBitNumber[prev_mask]];
+                if (!MaskToAllowed[prev_mask] || is_ms_byte(b)) {
+                    prev_pos = pos;
+                    prev_mask = ((prev_mask << 1) & 0x7) | 1;
+                    pos++;
+                    continue;
+                }
+            }
+        }
+        prev_pos = pos;
+
+        if (!is_ms_byte(p[4])) {
+            prev_mask = ((prev_mask << 1) & 0x7) | 1;
+            pos++;
+            continue;
+        }
+
+        uint32_t src = get_uint32(p + 1);
+        uint32_t dest;
+        for (;;) {
+            dest = src - (uint32_t)(pos + 5);
+            if (prev_mask == 0) {
+                break;
+            }
+            unsigned index = MaskToBitNumber[prev_mask] * 8;
+            if (!is_ms_byte((uint8_t)(dest >> (24 - index)))) {
+                break;
+            }
+            src = dest ^ ((1u << (32 - index)) - 1);
+        }
+        /* The top byte only keeps the sign, which the encoder stored in
+           bit 24. */
+        dest = (dest & 0x01FFFFFF) | ((dest & 0x01000000) ? 0xFF000000 : 0);
+        put_uint32(p + 1, dest);
+        pos += 5;
+    }
+}
+
+static void unfilter_arm64(uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t pc = (uint32_t)i;
+        uint32_t instr = get_uint32(data + i);
+
+        if ((instr >> 26) == 0x25) {
+            // BL: 26-bit word offset
+            instr = 0x94000000 | ((instr - (pc >> 2)) & 0x03FFFFFF);
+            put_uint32(data + i, instr);
+        } else if ((instr & 0x9F000000) == 0x90000000) {
+            /* ADRP: 21-bit page offset split into immlo and immhi. Only
+               offsets within +/-512 MiB are converted, with the three
+               upper bits of the result holding its sign again. */
+            uint32_t src = ((instr >> 29) & 3) | ((instr >> 3) & 0x001FFFFC);
+            if ((src + 0x00020000) & 0x001C0000) {
+                continue;
+            }
+            uint32_t dest = src - (pc >> 12);
+            instr &= 0x9000001F;
+            instr |= (dest & 3) << 29;
+            instr |= (dest & 0x0003FFFC) << 3;
+            instr |= (0u - (dest & 0x00020000)) & 0x00E00000;
+            put_uint32(data + i, instr);
+        }
+    }
+}
+
+bool IsBranchFilter(unsigned filter)
+{
+    return filter == BRANCH_FILTER_X86 || filter == BRANCH_FILTER_ARM64;
+}
+
+void UnfilterBranches(BranchFilter filter, uint8_t *data, size_t size)
+{
+    switch (filter) {
+        case BRANCH_FILTER_X86:
+            unfilter_x86(data, size);
+            break;
+        case BRANCH_FILTER_ARM64:
+            unfilter_arm64(data, size);
+            break;
+    }
+}
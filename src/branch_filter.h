@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Branch converters applied by the builder to native code before it
+ *        is compressed.
+ *
+ * Calls and branches in machine code hold addresses relative to the
+ * instruction, so calls to the same function look different everywhere.
+ * The builder rewrites them to absolute addresses, which repeat and
+ * compress better, and the stub converts them back after decompressing.
+ * These are the BCJ filters of 7-Zip and xz; the values are stored in the
+ * payload and must not change.
+ */
+typedef enum {
+    BRANCH_FILTER_X86   = 1,   // E8/E9 call and jump rel32, x86 and x86-64
+    BRANCH_FILTER_ARM64 = 2,   // BL and ADRP
+} BranchFilter;
+
+/**
+ * @brief Checks whether @p filter names a known branch filter.
+ */
+bool IsBranchFilter(unsigned filter);
+
+/**
+ * @brief Reverses the builder's conversion of a whole file in place.
+ *
+ * @param filter  Filter the file was encoded with; must be known.
+ * @param data    Contents of the file, converted back in place.
+ * @param size    Size of @p data in bytes.
+ */
+void UnfilterBranches(BranchFilter filter, uint8_t *data, size_t size);
@@ -0,0 +1,475 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "system_utils.h"
+#include "file_batch.h"
+
+/*
+   io_uring is used through its raw system calls, so that the stub needs
+   neither liburing nor anything newer than the kernel headers. Other
+   platforms, cosmocc builds (which run on more than Linux) and headers too
+   old for direct descriptors get a batch that is never available.
+*/
+#if defined(__linux__) && !defined(__COSMOPOLITAN__) \
+    && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_CQE_SKIP
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#if HAVE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Number of files in flight, each taking one registered file slot and
+// three submission queue entries.
+#define FILE_BATCH_DEPTH 64
+#define SQES_PER_FILE 3
+
+// A single write request transfers at most this much (MAX_RW_COUNT).
+#define MAX_BATCH_WRITE_SIZE 0x7ffff000
+
+enum { OP_OPEN, OP_WRITE, OP_CLOSE };
+
+typedef struct {
+    DirHandle  *dir;
+    char       *name;
+    char       *path;        // full path, for directories without a descriptor
+    const void *data;
+    size_t      size;
+    void       *buffer;
+    int         pending;     // requests not completed yet
+    int         results[SQES_PER_FILE];
+} BatchFile;
+
+struct FileBatch {
+    int                  ring_fd;
+    void                *sq_ring;
+    size_t               sq_ring_size;
+    void                *cq_ring;
+    size_t               cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+
+    unsigned            *sq_tail;
+    unsigned            *sq_head;
+    unsigned             sq_mask;
+    unsigned             sq_entries;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned             to_submit;  // entries queued but not submitted
+    BatchFile            files[FILE_BATCH_DEPTH];
+    size_t               free_slots[FILE_BATCH_DEPTH];
+    size_t               free_count;
+    size_t               pending_size;
+    size_t               max_pending_size;
+    bool                 failed;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Checks that the kernel implements every request a file needs.
+static bool probe_ops(int ring_fd)
+{
+    size_t size = sizeof(struct io_uring_probe)
+                  + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) {
+        return false;
+    }
+
+    bool ok = sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE,
+                                    probe, 256) == 0;
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE
+    };
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op
+             && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static bool map_rings(FileBatch *batch, const struct io_uring_params *p)
+{
+    batch->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    batch->cq_ring_size = p->cq_off.cqes
+                          + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (batch->cq_ring_size > batch->sq_ring_size) {
+            batch->sq_ring_size = batch->cq_ring_size;
+        }
+        batch->cq_ring_size = batch->sq_ring_size;
+    }
+
+    batch->sq_ring = mmap(NULL, batch->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, batch->ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (batch->sq_ring == MAP_FAILED) {
+        batch->sq_ring = NULL;
+        return false;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        batch->cq_ring = batch->sq_ring;
+    } else {
+        batch->cq_ring = mmap(NULL, batch->cq_ring_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, batch->ring_fd,
+                              IORING_OFF_CQ_RING);
+        if (batch->cq_ring == MAP_FAILED) {
+            batch->cq_ring = NULL;
+            return false;
+        }
+    }
+
+    batch->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    batch->sqes = mmap(NULL, batch->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, batch->ring_fd,
+                       IORING_OFF_SQES);
+    if (batch->sqes == MAP_FAILED) {
+        batch->sqes = NULL;
+        return false;
+    }
+
+    uint8_t *sq = batch->sq_ring;
+    batch->sq_head    = (unsigned *)(sq + p->sq_off.head);
+    batch->sq_tail    = (unsigned *)(sq + p->sq_off.tail);
+    batch->sq_mask    = *(unsigned *)(sq + p->sq_off.ring_mask);
+    batch->sq_entries = p->sq_entries;
+    batch->sq_array   = (unsigned *)(sq + p->sq_off.array);
+
+    uint8_t *cq = batch->cq_ring;
+    batch->cq_head = (unsigned *)(cq + p->cq_off.head);
+    batch->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    batch->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    batch->cqes    = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return true;
+}
+
+static void unmap_rings(FileBatch *batch)
+{
+    if (batch->sqes) {
+        munmap(batch->sqes, batch->sqes_size);
+    }
+    if (batch->cq_ring && batch->cq_ring != batch->sq_ring) {
+        munmap(batch->cq_ring, batch->cq_ring_size);
+    }
+    if (batch->sq_ring) {
+        munmap(batch->sq_ring, batch->sq_ring_size);
+    }
+}
+
+FileBatch *CreateFileBatch(size_t max_pending_size)
+{
+    FileBatch *batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        APP_ERROR("Memory allocation failed for file batch");
+        return NULL;
+    }
+    batch->max_pending_size = max_pending_size;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    batch->ring_fd = sys_io_uring_setup(FILE_BATCH_DEPTH * SQES_PER_FILE,
+                                        &params);
+    if (batch->ring_fd < 0) {
+        DEBUG("io_uring is unavailable: %s", strerror(errno));
+        free(batch);
+        return NULL;
+    }
+
+    /* Direct descriptors (open and close into registered slots) are as old
+       as IORING_FEAT_CQE_SKIP, so the feature stands in for a version check. */
+    if (!(params.features & IORING_FEAT_CQE_SKIP) || !probe_ops(batch->ring_fd)) {
+        DEBUG("io_uring lacks the requests needed to write files");
+        goto error;
+    }
+
+    if (!map_rings(batch, &params)) {
+        DEBUG("Failed to map io_uring rings: %s", strerror(errno));
+        goto error;
+    }
+
+    int slots[FILE_BATCH_DEPTH];
+    for (size_t i = 0; i < FILE_BATCH_DEPTH; i++) {
+        slots[i] = -1;
+        batch->free_slots[i] = FILE_BATCH_DEPTH - 1 - i;
+    }
+    batch->free_count = FILE_BATCH_DEPTH;
+    if (sys_io_uring_register(batch->ring_fd, IORING_REGISTER_FILES, slots,
+                              FILE_BATCH_DEPTH) < 0) {
+        DEBUG("Failed to register io_uring file slots: %s", strerror(errno));
+        goto error;
+    }
+
+    DEBUG("Writing files through io_uring, %d in flight", FILE_BATCH_DEPTH);
+    return batch;
+
+error:
+    unmap_rings(batch);
+    close(batch->ring_fd);
+    free(batch);
+    return NULL;
+}
+
+static bool submit(FileBatch *batch, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    while (batch->to_submit > 0 || min_complete > 0) {
+        int n = sys_io_uring_enter(batch->ring_fd, batch->to_submit,
+                                   min_complete, flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            APP_ERROR("io_uring_enter failed: %s", strerror(errno));
+            return false;
+        }
+        batch->to_submit -= (unsigned)n;
+        if (batch->to_submit == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+static void finish_file(FileBatch *batch, size_t slot)
+{
+    BatchFile *file = &batch->files[slot];
+
+    if (file->results[OP_OPEN] < 0 || file->results[OP_CLOSE] < 0
+        || (size_t)file->results[OP_WRITE] != file->size) {
+        DEBUG("io_uring failed to write %s (open %d, write %d, close %d); "
+              "writing it directly", file->name, file->results[OP_OPEN],
+              file->results[OP_WRITE], file->results[OP_CLOSE]);
+        if (!ExportFileAt(file->dir, file->name, file->data, file->size)) {
+            APP_ERROR("Failed to export file: %s", file->name);
+            batch->failed = true;
+        }
+    }
+
+    batch->pending_size -= file->size;
+    free(file->name);
+    free(file->path);
+    free(file->buffer);
+    memset(file, 0, sizeof(*file));
+    batch->free_slots[batch->free_count++] = slot;
+}
+
+// Records the completions that have arrived, finishing complete files.
+static void reap(FileBatch *batch)
+{
+    unsigned head = *batch->cq_head;
+    unsigned tail = __atomic_load_n(batch->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &batch->cqes[head & batch->cq_mask];
+        size_t slot = (size_t)(cqe->user_data / SQES_PER_FILE);
+        BatchFile *file = &batch->files[slot];
+
+        file->results[cqe->user_data % SQES_PER_FILE] = cqe->res;
+        if (--file->pending == 0) {
+            finish_file(batch, slot);
+        }
+    }
+    __atomic_store_n(batch->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submits what is queued and waits for at least one completion.
+static bool wait_one(FileBatch *batch)
+{
+    if (!submit(batch, 1)) {
+        return false;
+    }
+    reap(batch);
+    return true;
+}
+
+static struct io_uring_sqe *get_sqe(FileBatch *batch)
+{
+    unsigned tail = *batch->sq_tail;
+    unsigned index = tail & batch->sq_mask;
+    struct io_uring_sqe *sqe = &batch->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    batch->sq_array[index] = index;
+    __atomic_store_n(batch->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    batch->to_submit++;
+    return sqe;
+}
+
+bool AddFileToBatch(FileBatch *batch, DirHandle *dir, char *name,
+                    const void *data, size_t size, void *buffer)
+{
+    bool ok = false;
+    char *path = NULL;
+
+    if (!batch || !dir || !name || (!data && size > 0)) {
+        APP_ERROR("batch, dir, name or data is NULL");
+        goto cleanup;
+    }
+    if (batch->failed) {
+        goto cleanup;
+    }
+    if (size > MAX_BATCH_WRITE_SIZE) {
+        ok = ExportFileAt(dir, name, data, size);
+        goto cleanup;
+    }
+
+    int dir_fd = GetDirHandleFd(dir);
+    if (dir_fd < 0) {
+        path = JoinPath(GetDirHandlePath(dir), name);
+        if (!path) {
+            goto cleanup;
+        }
+        dir_fd = AT_FDCWD;
+    }
+
+    while (batch->free_count == 0
+           || (batch->pending_size > 0
+               && size > batch->max_pending_size - batch->pending_size)) {
+        if (!wait_one(batch)) {
+            goto cleanup;
+        }
+    }
+    if (batch->sq_entries - (*batch->sq_tail - *batch->sq_head)
+        < SQES_PER_FILE && !submit(batch, 0)) {
+        goto cleanup;
+    }
+
+    size_t slot = batch->free_slots[--batch->free_count];
+    BatchFile *file = &batch->files[slot];
+    file->dir     = dir;
+    file->name    = name;
+    file->path    = path;
+    file->data    = data;
+    file->size    = size;
+    file->buffer  = buffer;
+    file->pending = SQES_PER_FILE;
+    batch->pending_size += size;
+
+    /* open -> write -> close; the close is hard-linked so that it runs,
+       and frees the slot, even when the write falls short. */
+    struct io_uring_sqe *sqe = get_sqe(batch);
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->fd         = dir_fd;
+    sqe->addr       = (uint64_t)(uintptr_t)(path ? path : name);
+    sqe->len        = 0777;
+    /* direct descriptors are never inherited; O_CLOEXEC is rejected */
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = (uint32_t)slot + 1;
+    sqe->flags      = IOSQE_IO_LINK;
+    sqe->user_data  = slot * SQES_PER_FILE + OP_OPEN;
+
+    sqe = get_sqe(batch);
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = (int)slot;
+    sqe->addr      = (uint64_t)(uintptr_t)data;
+    sqe->len       = (uint32_t)size;
+    sqe->off       = 0;
+    sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->user_data = slot * SQES_PER_FILE + OP_WRITE;
+
+    sqe = get_sqe(batch);
+    sqe->opcode     = IORING_OP_CLOSE;
+    sqe->file_index = (uint32_t)slot + 1;
+    sqe->user_data  = slot * SQES_PER_FILE + OP_CLOSE;
+
+    return true;
+
+cleanup:
+    free(name);
+    free(path);
+    free(buffer);
+    return ok;
+}
+
+bool WaitFileBatch(FileBatch *batch)
+{
+    if (!batch) {
+        APP_ERROR("batch is NULL");
+        return false;
+    }
+
+    while (batch->free_count < FILE_BATCH_DEPTH) {
+        if (!wait_one(batch)) {
+            return false;
+        }
+    }
+    return !batch->failed;
+}
+
+void DestroyFileBatch(FileBatch *batch)
+{
+    if (!batch) {
+        return;
+    }
+
+    WaitFileBatch(batch);
+    unmap_rings(batch);
+    close(batch->ring_fd);
+    free(batch);
+}
+
+#else
+
+FileBatch *CreateFileBatch(size_t max_pending_size)
+{
+    (void)max_pending_size;
+    return NULL;
+}
+
+bool AddFileToBatch(FileBatch *batch, DirHandle *dir, char *name,
+                    const void *data, size_t size, void *buffer)
+{
+    (void)batch;
+    bool ok = ExportFileAt(dir, name, data, size);
+    free(name);
+    free(buffer);
+    return ok;
+}
+
+bool WaitFileBatch(FileBatch *batch)
+{
+    (void)batch;
+    return true;
+}
+
+void DestroyFileBatch(FileBatch *batch)
+{
+    (void)batch;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Opaque handle to a batch of files written asynchronously by the
+ *        kernel (io_uring on Linux).
+ *
+ * Each file is created, written and closed by a chain of linked requests,
+ * with many files in flight and a single system call submitting many
+ * requests. A FileBatch is driven from one thread only.
+ */
+typedef struct FileBatch FileBatch;
+
+/**
+ * @brief Sets up a file batch.
+ *
+ * @param max_pending_size
+ *   Upper bound of the summed size of files in flight. AddFileToBatch()
+ *   waits for earlier files to complete while a new file would exceed it.
+ * @return
+ *   A new FileBatch, or NULL if asynchronous file I/O is unavailable on
+ *   this platform or kernel, in which case files are written as before.
+ */
+FileBatch *CreateFileBatch(size_t max_pending_size);
+
+/**
+ * @brief Queues a file to be created with the given contents.
+ *
+ * The file is opened relative to @p dir. A file the kernel fails to write
+ * is written again with ExportFileAt() once its requests complete, so
+ * transient io_uring errors do not fail extraction.
+ *
+ * @param batch   Batch to add to; must not be NULL.
+ * @param dir     Existing directory to create the file in; must stay open
+ *                until the file is complete.
+ * @param name    File name within @p dir. Ownership passes to the batch,
+ *                which frees it when the file is complete, also on failure.
+ * @param data    Contents; must stay valid until the file is complete.
+ * @param size    Size of @p data in bytes.
+ * @param buffer  Memory freed along with @p name when the file is
+ *                complete (e.g. the copy @p data points into), or NULL.
+ * @return
+ *   true if the file was queued or written; false on failure.
+ */
+bool AddFileToBatch(FileBatch *batch, struct DirHandle *dir, char *name,
+                    const void *data, size_t size, void *buffer);
+
+/**
+ * @brief Submits the queued files and waits until all of them are
+ *        complete.
+ *
+ * @return true if every file was written, false if any failed.
+ */
+bool WaitFileBatch(FileBatch *batch);
+
+/**
+ * @brief Waits for the remaining files and frees the batch. Passing NULL
+ *        does nothing.
+ */
+void DestroyFileBatch(FileBatch *batch);
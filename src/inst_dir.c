@@ -1,3 +1,5 @@
+#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifndef _WIN32
@@ -21,10 +23,86 @@ static inline bool IsInstDirSet(void)
     return InstDir != NULL && InstDir[0] != '\0';
 }
 
+// Name prefix of installation directories and the length of the unique
+// part that follows it.
+#define INST_DIR_PREFIX "ocran"
+#define INST_DIR_UNIQUE_LEN 6
+
+/*
+   Directories temporary installation directories are created in, tried in
+   order until one passes IsUsableTempDirectory() with room for the
+   extracted files and TEMP_DIR_RESERVE to spare. Entries are separated by
+   TEMP_DIRS_SEPARATOR; an entry starting with '$' names an environment
+   variable, and is skipped if that is unset or empty. The system's
+   temporary directory is used if none qualifies. OCRAN_TEMP_DIRS in the
+   environment replaces the list, "make TEMP_DIRS=..." the default.
+*/
+#ifndef DEFAULT_TEMP_DIRS
+#ifdef _WIN32
+#define DEFAULT_TEMP_DIRS ""
+#else
+#define DEFAULT_TEMP_DIRS "$XDG_RUNTIME_DIR:/dev/shm:$TMPDIR"
+#endif
+#endif
+
+#ifdef _WIN32
+#define TEMP_DIRS_SEPARATOR ";"
+#else
+#define TEMP_DIRS_SEPARATOR ":"
+#endif
+
+#define TEMP_DIR_RESERVE (64ULL << 20)
+
+// Lock file inside a temporary installation directory, held while the stub
+// or the application runs. See SweepOrphanedInstDirs().
+#define OWNER_LOCK_NAME ".ocran-lock"
+
+// Lock on the installation directory, if it is a temporary one.
+static OwnerLock *InstDirLock = NULL;
+
+// Set while a private tmpfs is mounted over InstDir (MountInstDirInMemory).
+static bool InstDirInMemory = false;
+
+// Marks a freshly created temporary installation directory as in use. A
+// directory without the lock is merely never reclaimed by the sweep.
+static void lock_inst_dir(const char *dir)
+{
+    char *path = JoinPath(dir, OWNER_LOCK_NAME);
+    if (!path) {
+        APP_ERROR("Failed to build lock file path");
+        return;
+    }
+
+    InstDirLock = CreateOwnerLock(path);
+    if (!InstDirLock) {
+        DEBUG("Failed to lock installation directory '%s'", dir);
+    }
+    free(path);
+}
+
+// Releases the lock on the installation directory. With remove_file, the
+// lock file is deleted first, so the directory is never seen unlocked.
+static void unlock_inst_dir(bool remove_file)
+{
+    if (!InstDirLock) {
+        return;
+    }
+
+    if (remove_file) {
+        char *path = JoinPath(InstDir, OWNER_LOCK_NAME);
+        if (!path || !DeleteRecursively(path)) {
+            DEBUG("Failed to delete lock file in '%s'", InstDir);
+        }
+        free(path);
+    }
+    ReleaseOwnerLock(InstDirLock);
+    InstDirLock = NULL;
+}
+
 // Creates an installation directory with a unique name in the specified target directory.
 static char *create_uniq_dir(const char *target_dir)
 {
-    char *base_path = JoinPath(target_dir, "ocran" "XXXXXX");
+    char *base_path = JoinPath(target_dir, INST_DIR_PREFIX "XXXXXX");
     if (!base_path) {
         APP_ERROR("Failed to construct a base path");
         return NULL;
@@ -60,9 +138,62 @@ static char *create_debug_extract_inst_dir(void)
     return inst_dir;
 }
 
-// Creates a temporary installation directory in the system's temp directory.
-static char *create_temporary_inst_dir(void)
+typedef bool (*TempDirFunc)(const char *dir, void *arg);
+
+// Calls func for each candidate temp directory (see OCRAN_TEMP_DIRS) until
+// it returns false.
+static void for_each_temp_dir_candidate(TempDirFunc func, void *arg)
+{
+    const char *env = getenv("OCRAN_TEMP_DIRS");
+    char *list = malloc(strlen(env ? env : DEFAULT_TEMP_DIRS) + 1);
+    if (!list) {
+        APP_ERROR("Memory allocation failed for temp directory list");
+        return;
+    }
+    strcpy(list, env ? env : DEFAULT_TEMP_DIRS);
+
+    char *rest = list;
+    while (rest) {
+        char *entry = rest;
+        rest = strpbrk(rest, TEMP_DIRS_SEPARATOR);
+        if (rest) {
+            *rest++ = '\0';
+        }
+
+        const char *dir = entry[0] == '$' ? getenv(entry + 1) : entry;
+        if (dir && *dir && !func(dir, arg)) {
+            break;
+        }
+    }
+    free(list);
+}
+
+typedef struct {
+    unsigned long long  size;
+    char               *inst_dir;
+} TempDirChoice;
+
+static bool try_temp_dir(const char *dir, void *arg)
 {
+    TempDirChoice *choice = arg;
+    if (!IsUsableTempDirectory(dir, choice->size + TEMP_DIR_RESERVE)) {
+        return true;
+    }
+    choice->inst_dir = create_uniq_dir(dir);
+    return choice->inst_dir == NULL;
+}
+
+// Creates a temporary installation directory with room for size bytes in
+// the first usable candidate directory, or in the system's temp directory.
+static char *create_temporary_inst_dir(unsigned long long size)
+{
+    TempDirChoice choice = { .size = size };
+    for_each_temp_dir_candidate(try_temp_dir, &choice);
+    if (choice.inst_dir) {
+        lock_inst_dir(choice.inst_dir);
+        return choice.inst_dir;
+    }
+
     char *temp_dir = GetTempDirectoryPath();
     if (!temp_dir) {
         APP_ERROR("Failed to obtain the temporary directory path");
@@ -77,10 +208,11 @@ static char *create_temporary_inst_dir(void)
     }
 
     free(temp_dir);
+    lock_inst_dir(inst_dir);
     return inst_dir;
 }
 
-const char *CreateInstDir(bool is_extract_to_exe_dir)
+const char *CreateInstDir(bool is_extract_to_exe_dir, unsigned long long size)
 {
     if (InstDir != NULL) {
         APP_ERROR("Installation directory has already been set");
@@ -92,7 +224,7 @@ const char *CreateInstDir(bool is_extract_to_exe_dir)
     if (is_extract_to_exe_dir) {
         inst_dir = create_debug_extract_inst_dir();
     } else {
-        inst_dir = create_temporary_inst_dir();
+        inst_dir = create_temporary_inst_dir(size);
     }
     if (!inst_dir) {
         return NULL;
@@ -110,6 +242,209 @@ const char *CreateInstDir(bool is_extract_to_exe_dir)
     return InstDir;
 }
 
+// Name prefix and key length of persistent extraction cache entries. Only
+// a prefix of the key goes into the directory name to keep deep package
+// paths well within MAX_PATH; the marker below names the full key.
+#define CACHE_DIR_PREFIX "ocran-"
+#define CACHE_DIR_KEY_LEN 16
+#define CACHE_MARKER_PREFIX ".ocran-complete-"
+#define CACHE_ROOT_PREFIX "ocran-cache"
+
+// Path of the cache entry while InstDir is still its staging directory.
+static char *CachedInstDir = NULL;
+
+// Builds the path of the completion marker inside a cache entry.
+static char *cache_marker_path(const char *dir, const char *key)
+{
+    size_t len = strlen(CACHE_MARKER_PREFIX) + strlen(key) + 1;
+    char *name = malloc(len);
+    if (!name) {
+        APP_ERROR("Memory allocation failed for cache marker name");
+        return NULL;
+    }
+    snprintf(name, len, "%s%s", CACHE_MARKER_PREFIX, key);
+
+    char *marker = JoinPath(dir, name);
+    free(name);
+    return marker;
+}
+
+// Returns true if the cache entry holds the completion marker for key. An
+// entry or marker that another user could have planted or modified is never
+// trusted; it counts as a miss.
+static bool is_cache_complete(const char *dir, const char *key)
+{
+    if (!IsPrivateDirectory(dir)) {
+        return false;
+    }
+
+    char *marker = cache_marker_path(dir, key);
+    if (!marker) {
+        return false;
+    }
+
+    bool complete = IsOwnedFile(marker);
+    free(marker);
+    return complete;
+}
+
+// Creates the per-user directory holding the cache entries in temp_dir, so
+// that nobody else can create or replace an entry before it is published.
+// Returns NULL if the directory cannot be created or is not private.
+static char *open_cache_root(const char *temp_dir)
+{
+    char name[64];
+#ifdef _WIN32
+    snprintf(name, sizeof(name), "%s", CACHE_ROOT_PREFIX);
+#else
+    snprintf(name, sizeof(name), "%s-%lu", CACHE_ROOT_PREFIX, (unsigned long)geteuid());
+#endif
+
+    char *root = JoinPath(temp_dir, name);
+    if (!root) {
+        APP_ERROR("Failed to build the cache root path");
+        return NULL;
+    }
+    if (!CreatePrivateDirectory(root)) {
+        DEBUG("Extraction cache root '%s' is unusable", root);
+        free(root);
+        return NULL;
+    }
+    return root;
+}
+
+const char *OpenCachedInstDir(const char *key, bool *is_cached)
+{
+    const char *result   = NULL;
+    char       *temp_dir = NULL;
+    char       *long_dir = NULL;
+    char       *name     = NULL;
+    char       *root     = NULL;
+    char       *cache    = NULL;
+    char       *staging  = NULL;
+
+    if (InstDir != NULL) {
+        APP_ERROR("Installation directory has already been set");
+        goto cleanup;
+    }
+
+    if (!key || strlen(key) < CACHE_DIR_KEY_LEN || !is_cached) {
+        APP_ERROR("Invalid extraction cache key");
+        goto cleanup;
+    }
+
+    temp_dir = GetTempDirectoryPath();
+    if (!temp_dir) {
+        APP_ERROR("Failed to obtain the temporary directory path");
+        goto cleanup;
+    }
+
+    /* Normalize 8.3 short names for a consistent spelling (see CreateInstDir) */
+    long_dir = ToLongPath(temp_dir);
+    if (!long_dir) {
+        goto cleanup;
+    }
+
+    /* Without a usable root, extract to a staging directory that is never
+       published, as if the cache missed. */
+    root = open_cache_root(long_dir);
+    if (root) {
+        size_t name_len = strlen(CACHE_DIR_PREFIX) + CACHE_DIR_KEY_LEN + 1;
+        name = malloc(name_len);
+        if (!name) {
+            APP_ERROR("Memory allocation failed for cache directory name");
+            goto cleanup;
+        }
+        snprintf(name, name_len, "%s%.*s", CACHE_DIR_PREFIX, CACHE_DIR_KEY_LEN, key);
+
+        cache = JoinPath(root, name);
+        if (!cache) {
+            APP_ERROR("Failed to build the cache directory path");
+            goto cleanup;
+        }
+    }
+
+    if (cache && is_cache_complete(cache, key)) {
+        *is_cached = true;
+        InstDir = cache;
+        cache = NULL;
+        result = InstDir;
+        goto cleanup;
+    }
+
+    staging = create_uniq_dir(long_dir);
+    if (!staging) {
+        APP_ERROR("Failed to create installation directory in '%s'", long_dir);
+        goto cleanup;
+    }
+    lock_inst_dir(staging);
+
+    *is_cached = false;
+    InstDir = staging;
+    staging = NULL;
+    CachedInstDir = cache;
+    cache = NULL;
+    result = InstDir;
+
+cleanup:
+    free(temp_dir);
+    free(long_dir);
+    free(name);
+    free(root);
+    free(cache);
+    free(staging);
+    return result;
+}
+
+bool CommitCachedInstDir(const char *key)
+{
+    bool  result = false;
+    char *marker = NULL;
+
+    if (!IsInstDirSet()) {
+        APP_ERROR("No extraction cache entry is being populated");
+        return false;
+    }
+    if (!CachedInstDir) {
+        DEBUG("No usable extraction cache entry to publish");
+        return false;
+    }
+
+    marker = cache_marker_path(InstDir, key);
+    if (!marker || !ExportFile(marker, "", 0)) {
+        APP_ERROR("Failed to write the extraction cache marker");
+        goto cleanup;
+    }
+
+    /* The published entry is not swept, and Windows cannot rename a
+       directory with an open file in it. */
+    unlock_inst_dir(true);
+
+    if (!RenameDirectory(InstDir, CachedInstDir)) {
+        if (!is_cache_complete(CachedInstDir, key)) {
+            /* An incomplete entry can only be left behind by hand; it is
+               never published without the marker. Leave it alone and run
+               from the staging directory. */
+            DEBUG("Extraction cache entry '%s' is unusable", CachedInstDir);
+            goto cleanup;
+        }
+        /* Another process published the same payload first. */
+        DEBUG("Using extraction cache entry published concurrently: %s", CachedInstDir);
+        if (!DeleteRecursively(InstDir)) {
+            DEBUG("Failed to delete staging directory: %s", InstDir);
+        }
+    }
+
+    free(InstDir);
+    InstDir = CachedInstDir;
+    CachedInstDir = NULL;
+    result = true;
+
+cleanup:
+    free(marker);
+    return result;
+}
+
 // Sets the installation directory to the executable's own directory
 // (installer/wrapper mode, RUN_IN_EXE_DIR). No directory is created and
 // the directory must never be deleted by the stub.
@@ -144,11 +479,51 @@ const char *SetInstDirToExeDir(void)
     return InstDir;
 }
 
+// Mounts a private tmpfs over the installation directory (Linux only). The
+// lock file stays in the directory underneath, where stubs sweeping
+// orphaned directories find it, and keeps it locked as usual.
+bool MountInstDirInMemory(void)
+{
+    if (!IsInstDirSet()) {
+        APP_ERROR("Installation directory has not been set");
+        return false;
+    }
+
+    const char *env = getenv("OCRAN_MEMORY_EXTRACT");
+    if (env && strcmp(env, "0") == 0) {
+        DEBUG("In-memory extraction disabled by OCRAN_MEMORY_EXTRACT");
+        return false;
+    }
+
+    if (!MountPrivateTmpfs(InstDir)) {
+        return false;
+    }
+    InstDirInMemory = true;
+    return true;
+}
+
+// Uncovers the directory underneath a tmpfs mounted over InstDir, which
+// only holds the lock file, so that deleting it is cheap.
+static void unmount_inst_dir(void)
+{
+    if (!InstDirInMemory) {
+        return;
+    }
+    if (!UnmountPrivateTmpfs(InstDir)) {
+        DEBUG("Failed to unmount the tmpfs over '%s'", InstDir);
+    }
+    InstDirInMemory = false;
+}
+
 // Frees the allocated memory for the installation directory path.
 void FreeInstDir(void)
 {
+    CloseInstDirCache();
+    unlock_inst_dir(false);
     free(InstDir);
     InstDir = NULL;
+    free(CachedInstDir);
+    CachedInstDir = NULL;
 }
 
 // Returns the path to the installation directory.
@@ -195,9 +570,192 @@ bool DeleteInstDir(void)
         return false;
     }
 
+    unmount_inst_dir();
+    unlock_inst_dir(false);
     return DeleteRecursively(InstDir);
 }
 
+bool DeleteInstDirDetached(void)
+{
+    if (!IsInstDirSet()) {
+        APP_ERROR("Installation directory has not been set");
+        return false;
+    }
+
+    unmount_inst_dir();
+    unlock_inst_dir(false);
+    return DeleteRecursivelyDetached(InstDir);
+}
+
+/* ===== Orphaned installation directories ===== */
+
+// Defaults of OCRAN_GC_INTERVAL (seconds), OCRAN_GC_TIME_BUDGET
+// (milliseconds) and OCRAN_GC_MAX_DIRS.
+#define GC_DEFAULT_INTERVAL    3600
+#define GC_DEFAULT_TIME_BUDGET 2000
+#define GC_DEFAULT_MAX_DIRS    32
+
+// Time stamp file in the temp directory marking the last sweep.
+#define GC_STAMP_NAME ".ocran-gc"
+
+// Most directories swept at a time: the candidates and the temp directory
+#define GC_MAX_TEMP_DIRS 8
+
+typedef struct {
+    char     *temp_dirs[GC_MAX_TEMP_DIRS];
+    size_t    temp_dir_count;
+    size_t    current;       // index into temp_dirs of the one being swept
+    uint64_t  interval;      // seconds
+    uint64_t  time_budget;   // microseconds
+    uint64_t  deadline;
+    size_t    max_dirs;
+    size_t    swept;
+} SweepContext;
+
+// Reads a non-negative number from an environment variable.
+static uint64_t env_number(const char *name, uint64_t default_value)
+{
+    const char *env = getenv(name);
+    if (!env || !*env) {
+        return default_value;
+    }
+
+    char *end;
+    unsigned long long n = strtoull(env, &end, 10);
+    if (*end != '\0') {
+        DEBUG("Ignoring invalid %s=%s", name, env);
+        return default_value;
+    }
+    return n;
+}
+
+// True for names CreateInstDir() and OpenCachedInstDir() give their
+// directories, "ocran" and six random characters. Cache entries, named
+// "ocran-" and a key, do not match.
+static bool is_inst_dir_name(const char *name)
+{
+    size_t prefix_len = strlen(INST_DIR_PREFIX);
+    if (strncmp(name, INST_DIR_PREFIX, prefix_len) != 0
+        || strlen(name) != prefix_len + INST_DIR_UNIQUE_LEN) {
+        return false;
+    }
+    for (const char *p = name + prefix_len; *p; p++) {
+        if (!isalnum((unsigned char)*p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sweep_entry(const char *name, void *arg)
+{
+    SweepContext *ctx = arg;
+
+    if (!is_inst_dir_name(name)) {
+        return true;
+    }
+    if (ctx->swept >= ctx->max_dirs || GetMonotonicTime() >= ctx->deadline) {
+        DEBUG("Sweep budget exhausted");
+        return false;
+    }
+
+    /* Directories of other users, and symbolic links to anything, are
+       left alone even if their lock looks abandoned. */
+    char *dir  = JoinPath(ctx->temp_dirs[ctx->current], name);
+    char *lock = dir && IsPrivateDirectory(dir) ? JoinPath(dir, OWNER_LOCK_NAME) : NULL;
+    if (lock && IsOwnerLockAbandoned(lock)) {
+        DEBUG("Deleting orphaned installation directory: %s", dir);
+        if (DeleteRecursively(dir)) {
+            ctx->swept++;
+        }
+    }
+    free(lock);
+    free(dir);
+    return true;
+}
+
+static bool sweep_inst_dirs(void *arg)
+{
+    SweepContext *ctx = arg;
+    ctx->deadline = GetMonotonicTime() + ctx->time_budget;
+    bool ok = true;
+    for (ctx->current = 0; ctx->current < ctx->temp_dir_count; ctx->current++) {
+        ok = ForEachDirEntry(ctx->temp_dirs[ctx->current], sweep_entry, ctx) && ok;
+    }
+    return ok;
+}
+
+/* Adds a directory to the sweep unless it is listed already or was swept
+   less than an interval ago. Rate limit: at most one sweep per interval
+   across all executables sharing the directory. Directories that cannot
+   hold installation directories are skipped. */
+static bool add_sweep_dir(const char *dir, void *arg)
+{
+    SweepContext *ctx = arg;
+    if (ctx->temp_dir_count == GC_MAX_TEMP_DIRS) {
+        return false;
+    }
+
+    /* Normalize 8.3 short names for a consistent spelling (see CreateInstDir) */
+    char *long_dir = ToLongPath(dir);
+    if (!long_dir) {
+        return true;
+    }
+    for (size_t i = 0; i < ctx->temp_dir_count; i++) {
+        if (strcmp(ctx->temp_dirs[i], long_dir) == 0) {
+            free(long_dir);
+            return true;
+        }
+    }
+
+    char *stamp = JoinPath(long_dir, GC_STAMP_NAME);
+    uint64_t age;
+    if (!stamp || (GetFileAge(stamp, &age) && age < ctx->interval)
+        || !IsUsableTempDirectory(long_dir, 0) || !ExportFile(stamp, "", 0)) {
+        free(stamp);
+        free(long_dir);
+        return true;
+    }
+    free(stamp);
+
+    DEBUG("Sweeping orphaned installation directories in %s", long_dir);
+    ctx->temp_dirs[ctx->temp_dir_count++] = long_dir;
+    return true;
+}
+
+void SweepOrphanedInstDirs(void)
+{
+    const char *env = getenv("OCRAN_GC");
+    if (env && strcmp(env, "0") == 0) {
+        DEBUG("Sweep disabled by OCRAN_GC");
+        return;
+    }
+
+    SweepContext ctx = {
+        .interval    = env_number("OCRAN_GC_INTERVAL", GC_DEFAULT_INTERVAL),
+        .time_budget = env_number("OCRAN_GC_TIME_BUDGET", GC_DEFAULT_TIME_BUDGET) * 1000,
+        .max_dirs    = env_number("OCRAN_GC_MAX_DIRS", GC_DEFAULT_MAX_DIRS),
+    };
+
+    /* Installation directories may be in any candidate directory */
+    for_each_temp_dir_candidate(add_sweep_dir, &ctx);
+    char *temp_dir = GetTempDirectoryPath();
+    if (!temp_dir) {
+        APP_ERROR("Failed to obtain the temporary directory path");
+    } else {
+        add_sweep_dir(temp_dir, &ctx);
+        free(temp_dir);
+    }
+
+    if (ctx.temp_dir_count > 0 && !RunDetached(sweep_inst_dirs, &ctx)) {
+        DEBUG("Failed to sweep orphaned installation directories");
+    }
+
+    for (size_t i = 0; i < ctx.temp_dir_count; i++) {
+        free(ctx.temp_dirs[i]);
+    }
+}
+
 // Replaces placeholders in a string with the installation directory path.
 char *ReplaceInstDirPlaceholder(const char *tmpl)
 {
@@ -233,6 +791,214 @@ char *ReplaceInstDirPlaceholder(const char *tmpl)
     return replaced;
 }
 
+/*
+   Directories under the installation directory known to exist, keyed by
+   their relative path, each with a handle to create entries through. A
+   directory is created and opened once; afterwards its files cost one
+   open each, with no path expansion and no stat() of its ancestors. The
+   cache is only touched by the thread processing opcodes.
+*/
+typedef struct {
+    char      *rel_path;   // NULL for an empty slot
+    DirHandle *handle;
+} DirCacheEntry;
+
+static DirCacheEntry *DirCache = NULL;
+static size_t DirCacheCapacity = 0;   // power of two
+static size_t DirCacheCount = 0;
+static DirHandle *InstDirHandle = NULL;
+
+static size_t hash_rel_path(const char *path, size_t len)
+{
+    size_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+static DirCacheEntry *find_cache_slot(const char *rel_path, size_t len)
+{
+    size_t mask = DirCacheCapacity - 1;
+    size_t i = hash_rel_path(rel_path, len) & mask;
+
+    while (DirCache[i].rel_path) {
+        if (strncmp(DirCache[i].rel_path, rel_path, len) == 0
+            && DirCache[i].rel_path[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &DirCache[i];
+}
+
+static bool grow_dir_cache(void)
+{
+    size_t old_capacity = DirCacheCapacity;
+    DirCacheEntry *old = DirCache;
+
+    DirCacheCapacity = old_capacity ? old_capacity * 2 : 256;
+    DirCache = calloc(DirCacheCapacity, sizeof(*DirCache));
+    if (!DirCache) {
+        APP_ERROR("Memory allocation failed for directory cache");
+        DirCache = old;
+        DirCacheCapacity = old_capacity;
+        return false;
+    }
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].rel_path) {
+            *find_cache_slot(old[i].rel_path, strlen(old[i].rel_path)) = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+// Returns the handle of a directory under the installation directory,
+// creating it and its missing ancestors. rel_path need not be terminated
+// after len bytes.
+static DirHandle *get_inst_subdir(const char *rel_path, size_t len)
+{
+    if (len == 0) {
+        if (!InstDirHandle) {
+            InstDirHandle = OpenDirHandle(InstDir);
+        }
+        return InstDirHandle;
+    }
+
+    if (DirCacheCount * 2 >= DirCacheCapacity && !grow_dir_cache()) {
+        return NULL;
+    }
+    DirCacheEntry *entry = find_cache_slot(rel_path, len);
+    if (entry->rel_path) {
+        return entry->handle;
+    }
+
+    size_t name_start = len;
+    while (name_start > 0 && !is_path_separator(rel_path[name_start - 1])) {
+        name_start--;
+    }
+    size_t parent_len = name_start;
+    while (parent_len > 0 && is_path_separator(rel_path[parent_len - 1])) {
+        parent_len--;
+    }
+
+    DirHandle *parent = get_inst_subdir(rel_path, parent_len);
+    if (!parent) {
+        return NULL;
+    }
+
+    char *key = malloc(len + 1);
+    if (!key) {
+        APP_ERROR("Memory allocation failed for directory cache");
+        return NULL;
+    }
+    memcpy(key, rel_path, len);
+    key[len] = '\0';
+
+    DirHandle *handle = CreateSubdirHandle(parent, key + name_start);
+    if (!handle) {
+        APP_ERROR("Failed to create directory under installation directory: '%s'", key);
+        free(key);
+        return NULL;
+    }
+
+    /* The recursion may have grown the table; look the slot up again. */
+    entry = find_cache_slot(key, len);
+    entry->rel_path = key;
+    entry->handle = handle;
+    DirCacheCount++;
+    return handle;
+}
+
+DirHandle *GetParentUnderInstDir(const char *rel_path, const char **name)
+{
+    if (!IsInstDirSet()) {
+        APP_ERROR("Installation directory has not been set");
+        return NULL;
+    }
+
+    if (!rel_path || !*rel_path || !IsCleanRelativePath(rel_path)) {
+        APP_ERROR("invalid relative path '%s'", rel_path ? rel_path : "(null)");
+        return NULL;
+    }
+
+    size_t len = strlen(rel_path);
+    size_t name_start = len;
+    while (name_start > 0 && !is_path_separator(rel_path[name_start - 1])) {
+        name_start--;
+    }
+    if (name_start == len) {
+        APP_ERROR("relative path '%s' has no file name", rel_path);
+        return NULL;
+    }
+
+    size_t parent_len = name_start;
+    while (parent_len > 0 && is_path_separator(rel_path[parent_len - 1])) {
+        parent_len--;
+    }
+
+    *name = rel_path + name_start;
+    return get_inst_subdir(rel_path, parent_len);
+}
+
+DirHandle *GetDirUnderInstDir(const char *rel_path, size_t len)
+{
+    if (!IsInstDirSet()) {
+        APP_ERROR("Installation directory has not been set");
+        return NULL;
+    }
+
+    return get_inst_subdir(rel_path, len);
+}
+
+/*
+   Files queued by DuplicateFileUnderInstDir(). Their directories are cached
+   handles, valid until CloseInstDirCache().
+*/
+typedef struct {
+    DirHandle *dir;
+    char      *name;
+    DirHandle *src_dir;
+    char      *src_name;
+} FileDuplicate;
+
+static FileDuplicate *Duplicates = NULL;
+static size_t DuplicateCount = 0;
+static size_t DuplicateCapacity = 0;
+
+static void free_file_duplicates(void)
+{
+    for (size_t i = 0; i < DuplicateCount; i++) {
+        free(Duplicates[i].name);
+        free(Duplicates[i].src_name);
+    }
+    free(Duplicates);
+    Duplicates = NULL;
+    DuplicateCount = 0;
+    DuplicateCapacity = 0;
+}
+
+void CloseInstDirCache(void)
+{
+    free_file_duplicates();
+
+    for (size_t i = 0; i < DirCacheCapacity; i++) {
+        if (DirCache[i].rel_path) {
+            CloseDirHandle(DirCache[i].handle);
+            free(DirCache[i].rel_path);
+        }
+    }
+    free(DirCache);
+    DirCache = NULL;
+    DirCacheCapacity = 0;
+    DirCacheCount = 0;
+
+    CloseDirHandle(InstDirHandle);
+    InstDirHandle = NULL;
+}
+
 bool CreateDirectoryUnderInstDir(const char *rel_path)
 {
     if (!IsInstDirSet()) {
@@ -250,28 +1016,21 @@ bool CreateDirectoryUnderInstDir(const char *rel_path)
         return true;
     }
 
-    char *dir = ExpandInstDirPath(rel_path);
-    if (!dir) {
-        APP_ERROR("Failed to build full path");
+    if (!IsCleanRelativePath(rel_path)) {
+        APP_ERROR("invalid relative path '%s'", rel_path);
         return false;
     }
 
-    bool result = CreateDirectoriesRecursively(dir);
-    if (!result) {
-        APP_ERROR(
-            "Failed to create directory under installation directory: '%s'",
-            dir
-        );
+    size_t len = strlen(rel_path);
+    while (len > 0 && is_path_separator(rel_path[len - 1])) {
+        len--;
     }
-
-    free(dir);
-    return result;
+    return get_inst_subdir(rel_path, len) != NULL;
 }
 
 bool ExportFileToInstDir(const char *rel_path, const void *buf, size_t len)
 {
-    bool  result = false;
-    char *path   = NULL;
+    bool result = false;
 
     if (!IsInstDirSet()) {
         APP_ERROR("Installation directory has not been set");
@@ -290,25 +1049,48 @@ bool ExportFileToInstDir(const char *rel_path, const void *buf, size_t len)
         goto cleanup;
     }
 
-    path = ExpandInstDirPath(rel_path);
-    if (!path) {
+    const char *name;
+    DirHandle *dir = GetParentUnderInstDir(rel_path, &name);
+    if (!dir) {
         goto cleanup;
     }
 
-    if (!ExportFile(path, buf, len)) {
-        APP_ERROR("Failed to export file: %s", path);
+    if (!ExportFileAt(dir, name, buf, len)) {
+        APP_ERROR("Failed to export file: %s", rel_path);
         goto cleanup;
     }
 
     result = true;
 
 cleanup:
-    if (path) {
-        free(path);
-    }
     return result;
 }
 
+OutputFile *CreateFileUnderInstDir(const char *rel_path)
+{
+    if (!IsInstDirSet()) {
+        APP_ERROR("Installation directory has not been set");
+        return NULL;
+    }
+
+    if (rel_path == NULL || *rel_path == '\0') {
+        APP_ERROR("Relative path is null or empty");
+        return NULL;
+    }
+
+    const char *name;
+    DirHandle *dir = GetParentUnderInstDir(rel_path, &name);
+    if (!dir) {
+        return NULL;
+    }
+
+    OutputFile *file = CreateOutputFileAt(dir, name);
+    if (!file) {
+        APP_ERROR("Failed to create file: %s", rel_path);
+    }
+    return file;
+}
+
 #ifndef _WIN32
 bool CreateSymlinkUnderInstDir(const char *rel_link_path, const char *target)
 {
@@ -327,34 +1109,93 @@ bool CreateSymlinkUnderInstDir(const char *rel_link_path, const char *target)
         return false;
     }
 
-    char *link_path = ExpandInstDirPath(rel_link_path);
-    if (!link_path) {
+    const char *name;
+    DirHandle *dir = GetParentUnderInstDir(rel_link_path, &name);
+    if (!dir) {
+        APP_ERROR("Failed to create parent directory for symlink '%s'", rel_link_path);
         return false;
     }
 
-    bool result = false;
-    char *parent = GetParentPath(link_path);
-    if (parent && *parent && !CreateDirectoriesRecursively(parent)) {
-        APP_ERROR("Failed to create parent directory for symlink '%s'", link_path);
-        goto cleanup;
+    if (!CreateSymlinkAt(dir, name, target)) {
+        APP_ERROR("Failed to create symlink '%s' -> '%s'", rel_link_path, target);
+        return false;
     }
 
-    if (symlink(target, link_path) < 0) {
-        APP_ERROR("Failed to create symlink '%s' -> '%s': %s", link_path, target, strerror(errno));
-        goto cleanup;
+    DEBUG("CreateSymlinkUnderInstDir: '%s' -> '%s'", rel_link_path, target);
+    return true;
+}
+#endif /* _WIN32 */
+
+static char *copy_string(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    if (copy) {
+        memcpy(copy, str, len);
     }
+    return copy;
+}
 
-    DEBUG("CreateSymlinkUnderInstDir: '%s' -> '%s'", link_path, target);
-    result = true;
+bool DuplicateFileUnderInstDir(const char *rel_path, const char *src_rel_path)
+{
+    if (!IsInstDirSet()) {
+        APP_ERROR("Installation directory has not been set");
+        return false;
+    }
 
-cleanup:
-    if (parent) {
-        free(parent);
+    if (!rel_path || !*rel_path || !src_rel_path || !*src_rel_path) {
+        APP_ERROR("Relative path is null or empty");
+        return false;
     }
-    free(link_path);
-    return result;
+
+    const char *name, *src_name;
+    DirHandle *dir = GetParentUnderInstDir(rel_path, &name);
+    DirHandle *src_dir = dir ? GetParentUnderInstDir(src_rel_path, &src_name) : NULL;
+    if (!src_dir) {
+        return false;
+    }
+
+    if (DuplicateCount == DuplicateCapacity) {
+        size_t capacity = DuplicateCapacity ? DuplicateCapacity * 2 : 64;
+        FileDuplicate *grown = realloc(Duplicates, capacity * sizeof(*grown));
+        if (!grown) {
+            APP_ERROR("Failed to allocate memory");
+            return false;
+        }
+        Duplicates = grown;
+        DuplicateCapacity = capacity;
+    }
+
+    FileDuplicate *entry = &Duplicates[DuplicateCount];
+    entry->dir = dir;
+    entry->src_dir = src_dir;
+    entry->name = copy_string(name);
+    entry->src_name = copy_string(src_name);
+    if (!entry->name || !entry->src_name) {
+        APP_ERROR("Failed to allocate memory");
+        free(entry->name);
+        free(entry->src_name);
+        return false;
+    }
+    DuplicateCount++;
+    return true;
+}
+
+bool CompleteFileDuplicates(void)
+{
+    bool ok = true;
+    for (size_t i = 0; i < DuplicateCount; i++) {
+        FileDuplicate *entry = &Duplicates[i];
+        DEBUG("CompleteFileDuplicates: '%s' from '%s'", entry->name, entry->src_name);
+        if (!DuplicateFileAt(entry->src_dir, entry->src_name,
+                             entry->dir, entry->name)) {
+            APP_ERROR("Failed to create file '%s'", entry->name);
+            ok = false;
+        }
+    }
+    free_file_duplicates();
+    return ok;
 }
-#endif /* _WIN32 */
 
 bool SetEnvWithInstDir(const char *name, const char *value)
 {
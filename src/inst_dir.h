@@ -12,13 +12,18 @@
  *
  * @param is_extract_to_exe_dir
  *   If true, the extraction directory will be created in the same folder as
- *   the executable; if false, it will be created in the system’s temporary
- *   directory.
+ *   the executable; if false, it will be created in the first of the
+ *   candidate directories (OCRAN_TEMP_DIRS, by default $XDG_RUNTIME_DIR,
+ *   /dev/shm and $TMPDIR on POSIX) that is writable, not mounted noexec
+ *   and has room for @p size bytes plus a reserve, or else in the system’s
+ *   temporary directory.
+ * @param size
+ *   Bytes the extracted files take up; ignored with is_extract_to_exe_dir.
  * @return
  *   A pointer to the created directory path if successful, NULL if an error
  *   occurred. The returned path should not be freed by the caller.
  */
-const char *CreateInstDir(bool is_extract_to_exe_dir);
+const char *CreateInstDir(bool is_extract_to_exe_dir, unsigned long long size);
 
 /**
  * @brief Sets the installation directory to the executable's own directory.
@@ -34,6 +39,63 @@ const char *CreateInstDir(bool is_extract_to_exe_dir);
  */
 const char *SetInstDirToExeDir(void);
 
+/**
+ * @brief Looks up the persistent extraction cache entry for a payload key.
+ *
+ * The cache entry is a directory named "ocran-" followed by the first
+ * characters of @p key in a per-user directory ("ocran-cache-<uid>" on
+ * POSIX, "ocran-cache" on Windows) of the system's temporary directory,
+ * created private to the user. It counts as complete only if it holds the
+ * completion marker naming the full key, which is written before the
+ * entry is published by CommitCachedInstDir(), and if both are owned by
+ * the current user and the entry is not writable by anyone else. On a
+ * hit, the installation directory is set to the entry and nothing needs
+ * to be extracted. On a miss, a unique staging directory is created in
+ * the temporary directory and becomes the installation directory until
+ * CommitCachedInstDir() publishes it. If the per-user directory is
+ * unusable, the staging directory is never published.
+ *
+ * @param key
+ *   Hex-encoded payload hash stored in the executable.
+ * @param is_cached
+ *   Set to true on a cache hit, false on a miss.
+ * @return
+ *   A pointer to the installation directory path if successful, NULL if an
+ *   error occurred. The returned path should not be freed by the caller.
+ */
+const char *OpenCachedInstDir(const char *key, bool *is_cached);
+
+/**
+ * @brief Publishes a fully extracted staging directory as a cache entry.
+ *
+ * Writes the completion marker and atomically renames the staging
+ * directory created by OpenCachedInstDir() to the cache entry path. If a
+ * concurrent process published the same entry first, the staging
+ * directory is deleted and the existing entry is used instead.
+ *
+ * @param key
+ *   The key passed to OpenCachedInstDir().
+ * @return
+ *   true if the installation directory now is the published cache entry;
+ *   false if the staging directory remains the installation directory, in
+ *   which case the caller should delete it after use.
+ */
+bool CommitCachedInstDir(const char *key);
+
+/**
+ * @brief Mounts a private tmpfs over the installation directory created
+ *        by CreateInstDir() (MountPrivateTmpfs()).
+ *
+ * The extracted files then live in memory only. DeleteInstDir() and
+ * DeleteInstDirDetached() unmount it before deleting the directory.
+ * OCRAN_MEMORY_EXTRACT=0 disables it.
+ *
+ * @return
+ *   true if the tmpfs is mounted; false if it is not, in which case the
+ *   directory is used as it is.
+ */
+bool MountInstDirInMemory(void);
+
 /**
  * @brief Free the allocated installation directory path
  *        and reset the internal pointer to NULL.
@@ -84,6 +146,35 @@ char *ExpandInstDirPath(const char *rel_path);
  */
 bool DeleteInstDir(void);
 
+/**
+ * @brief Deletes the installation directory in a detached background
+ *        process (DeleteRecursivelyDetached()), so the caller can exit
+ *        right away.
+ *
+ * @return true if the deletion was handed off or completed, false otherwise.
+ */
+bool DeleteInstDirDetached(void);
+
+/**
+ * @brief Deletes installation directories in the temporary directory and
+ *        the candidate directories of CreateInstDir() that were left
+ *        behind by killed executables.
+ *
+ * Temporary installation directories hold a lock file for as long as the
+ * stub or the application runs (see CreateOwnerLock()). A directory whose
+ * lock file is no longer held by anybody is orphaned; directories without
+ * one, such as those of older stubs, are left alone, and so are directories
+ * and lock files not owned by the current user (see IsPrivateDirectory()).
+ *
+ * Each directory is swept at most once per OCRAN_GC_INTERVAL seconds
+ * (default 3600), tracked by the time stamp of a file in it, and the
+ * sweep runs detached (RunDetached()). A sweep stops after
+ * OCRAN_GC_TIME_BUDGET milliseconds (default 2000) or OCRAN_GC_MAX_DIRS
+ * deleted directories (default 32), whichever comes first. OCRAN_GC=0
+ * disables sweeping.
+ */
+void SweepOrphanedInstDirs(void);
+
 // Placeholder character used in paths.
 #define PLACEHOLDER '|'
 
@@ -101,6 +192,50 @@ bool DeleteInstDir(void);
  */
 char *ReplaceInstDirPlaceholder(const char *tmpl);
 
+/**
+ * @brief Returns the directory a file under the installation directory
+ *        goes in, creating it and any missing ancestors.
+ *
+ * Directories are created and opened once per extraction and cached by
+ * relative path, so files in a known directory need no path expansion or
+ * ancestor checks. The handle stays valid until CloseInstDirCache().
+ *
+ * @param rel_path
+ *   A clean relative file path under the installation directory.
+ * @param name
+ *   Receives a pointer to the last component of @p rel_path.
+ *
+ * @return
+ *   The parent directory handle; NULL on failure (error logged).
+ */
+struct DirHandle *GetParentUnderInstDir(const char *rel_path, const char **name);
+
+/**
+ * @brief Return the handle of a directory under the installation directory,
+ *        creating the directory and its missing ancestors.
+ *
+ * Unlike GetParentUnderInstDir(), the path is not validated, so that a
+ * caller decoding paths incrementally can check only what changed.
+ *
+ * @param rel_path
+ *   A relative path that has passed IsCleanRelativePath(); need not be
+ *   terminated after @p len bytes.
+ * @param len
+ *   Length of the directory path, without trailing separators. 0 means the
+ *   installation directory itself.
+ *
+ * @return
+ *   The cached directory handle; NULL on failure (error logged).
+ */
+struct DirHandle *GetDirUnderInstDir(const char *rel_path, size_t len);
+
+/**
+ * @brief Closes every directory handle cached during extraction.
+ *
+ * Must not be called while files are still being written through them.
+ */
+void CloseInstDirCache(void);
+
 /**
  * @brief Recursively create a directory under the installation directory.
  *
@@ -136,14 +271,30 @@ bool CreateDirectoryUnderInstDir(const char *rel_path);
  * @param buf
  *   Pointer to the data to write. Must be non-NULL if len > 0.
  * @param len
- *   Number of bytes to write. Zero creates an empty file. Values above
- *   MAXDWORD cause an error.
+ *   Number of bytes to write. Zero creates an empty file.
  *
  * @return
  *   true on success; false on failure (error logged via APP_ERROR/DEBUG).
  */
 bool ExportFileToInstDir(const char *rel_path, const void *buf, size_t len);
 
+/**
+ * @brief Create a file under the installation dir for streamed writing.
+ *
+ * Validates rel_path and creates any missing parent directories, like
+ * ExportFileToInstDir(), but leaves the file open
+ * so its contents can be written piece by piece with WriteOutputFile().
+ *
+ * @param rel_path
+ *   A relative file path under the installation directory. NULL or empty
+ *   string is invalid (returns NULL).
+ *
+ * @return
+ *   An OutputFile to be closed with CloseOutputFile(); NULL on failure
+ *   (error logged).
+ */
+struct OutputFile *CreateFileUnderInstDir(const char *rel_path);
+
 /**
  * @brief  Expands any installation-directory placeholder found in 'value' and
  *         sets the environment variable.
@@ -169,3 +320,28 @@ bool SetEnvWithInstDir(const char *name, const char *value);
  * @return true on success; false on failure.
  */
 bool CreateSymlinkUnderInstDir(const char *rel_link_path, const char *target);
+
+/**
+ * @brief Queue a file under the installation directory to be created with
+ *        the contents of another one extracted earlier.
+ *
+ * The source may still be in flight on an extraction thread, so the file
+ * is only created by CompleteFileDuplicates(), as a hard link to the
+ * source where the file system allows it and as a copy otherwise.
+ *
+ * @param rel_path      Relative path of the file to create.
+ * @param src_rel_path  Relative path of the file with the same contents.
+ *
+ * @return true if the file was queued; false on failure.
+ */
+bool DuplicateFileUnderInstDir(const char *rel_path, const char *src_rel_path);
+
+/**
+ * @brief Create the files queued by DuplicateFileUnderInstDir().
+ *
+ * Call once every extracted file has been completely written, and before
+ * CloseInstDirCache(), which drops any file still queued.
+ *
+ * @return true if every queued file was created; false otherwise.
+ */
+bool CompleteFileDuplicates(void);
@@ -28,7 +28,27 @@
   { UPDATE_0(p); i = (i + i); A0; } else \
   { UPDATE_1(p); i = (i + i) + 1; A1; }
 
+/* Ocran: with LZMA_DEC_BRANCHLESS, the bits of bit trees (literals,
+   lengths and position slots) are decoded without a conditional branch on
+   the bit value. Those bits are close to random for literals, so the
+   branch is mispredicted about every other time. GET_BIT_MASK() sets m to
+   0 for a 0 bit and to all ones for a 1 bit, and computes the same range,
+   code and probability as GET_BIT2() with masks. For a 0 bit the
+   probability update relies on
+   (ttt - (kBitModelTotal - 31)) >> 5 == -((kBitModelTotal - ttt) >> 5)
+   with an arithmetic right shift. */
+#ifdef LZMA_DEC_BRANCHLESS
+#define GET_BIT_MASK(p, i, m) { \
+  UInt32 t_ = *(p); NORMALIZE; bound = (range >> kNumBitModelTotalBits) * t_; \
+  m = (UInt32)0 - (UInt32)(code >= bound); \
+  range = ((range - bound) & m) | (bound & ~m); \
+  code -= bound & m; \
+  *(p) = (CLzmaProb)(t_ - (UInt32)((Int32)(t_ - (~m & (kBitModelTotal - (1 << kNumMoveBits) + 1))) >> kNumMoveBits)); \
+  i = (i + i) - (unsigned)m; }
+#define TREE_GET_BIT(probs, i) { UInt32 m_; GET_BIT_MASK(probs + i, i, m_); }
+#else
 #define TREE_GET_BIT(probs, i) { GET_BIT2(probs + i, i, ;, ;); }
+#endif
 
 #define REV_BIT(p, i, A0, A1) IF_BIT_0(p + i) \
   { UPDATE_0(p + i); A0; } else \
@@ -57,12 +77,21 @@
 #endif
 
 #define NORMAL_LITER_DEC TREE_GET_BIT(prob, symbol)
+#ifdef LZMA_DEC_BRANCHLESS
+#define MATCHED_LITER_DEC \
+  matchByte += matchByte; \
+  bit = offs; \
+  offs &= matchByte; \
+  probLit = prob + (offs + bit + symbol); \
+  { UInt32 m_; GET_BIT_MASK(probLit, symbol, m_); offs ^= bit & ~m_; }
+#else
 #define MATCHED_LITER_DEC \
   matchByte += matchByte; \
   bit = offs; \
   offs &= matchByte; \
   probLit = prob + (offs + bit + symbol); \
   GET_BIT2(probLit, symbol, offs ^= bit; , ;)
+#endif
 
 #endif // _LZMA_DEC_OPT
 
@@ -0,0 +1,151 @@
+/*
+   Self-test of the LZMA decoder kernel, run by "make check": decodes an
+   .lzma file (as written by lzma or xz --format=lzma) once in one call and
+   once fed in small pieces, and compares both results with the original.
+   It is linked with the selected and with the portable kernel.
+
+   Usage: lzma_check FILE.lzma ORIGINAL
+*/
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <LzmaDec.h>
+
+#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + 8)
+
+// Input is fed in pieces of these sizes in turn, to cover the paths where
+// a symbol straddles two calls.
+static const size_t PieceSizes[] = { 1, 7, 4096, 13, 65536 };
+
+static void *alloc_func(ISzAllocPtr p, size_t size)
+{
+    (void)p;
+    return malloc(size);
+}
+
+static void free_func(ISzAllocPtr p, void *address)
+{
+    (void)p;
+    free(address);
+}
+
+static const ISzAlloc Alloc = { alloc_func, free_func };
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    unsigned char *data = NULL;
+    size_t len = 0, capacity = 0;
+    for (;;) {
+        if (len == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            unsigned char *p = realloc(data, capacity);
+            if (!p) {
+                free(data);
+                fclose(f);
+                fprintf(stderr, "%s: out of memory\n", path);
+                return NULL;
+            }
+            data = p;
+        }
+        size_t n = fread(data + len, 1, capacity - len, f);
+        len += n;
+        if (n == 0) {
+            break;
+        }
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+        perror(path);
+        free(data);
+        return NULL;
+    }
+    *size = len;
+    return data;
+}
+
+static bool decode_whole(const unsigned char *src, size_t src_size,
+                         unsigned char *out, size_t out_size)
+{
+    SizeT dest_len = out_size;
+    SizeT src_len = src_size - LZMA_HEADER_SIZE;
+    ELzmaStatus status;
+    SRes res = LzmaDecode(out, &dest_len, src + LZMA_HEADER_SIZE, &src_len,
+                          src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY, &status,
+                          &Alloc);
+    return res == SZ_OK && dest_len == out_size;
+}
+
+static bool decode_pieces(const unsigned char *src, size_t src_size,
+                          unsigned char *out, size_t out_size)
+{
+    CLzmaDec dec;
+    LzmaDec_Construct(&dec);
+    if (LzmaDec_Allocate(&dec, src, LZMA_PROPS_SIZE, &Alloc) != SZ_OK) {
+        return false;
+    }
+    LzmaDec_Init(&dec);
+
+    bool ok = true;
+    size_t in_pos = LZMA_HEADER_SIZE, out_pos = 0;
+    for (size_t i = 0; ok && out_pos < out_size; i++) {
+        size_t piece = PieceSizes[i % (sizeof(PieceSizes) / sizeof(PieceSizes[0]))];
+        SizeT src_len = src_size - in_pos < piece ? src_size - in_pos : piece;
+        SizeT dest_len = out_size - out_pos < piece ? out_size - out_pos : piece;
+        ELzmaStatus status;
+        ok = LzmaDec_DecodeToBuf(&dec, out + out_pos, &dest_len, src + in_pos,
+                                 &src_len, LZMA_FINISH_ANY, &status) == SZ_OK
+             && (src_len > 0 || dest_len > 0);
+        in_pos += src_len;
+        out_pos += dest_len;
+    }
+
+    LzmaDec_Free(&dec, &Alloc);
+    return ok && out_pos == out_size;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s FILE.lzma ORIGINAL\n", argv[0]);
+        return 2;
+    }
+
+    size_t src_size, orig_size;
+    unsigned char *src = read_file(argv[1], &src_size);
+    unsigned char *orig = src ? read_file(argv[2], &orig_size) : NULL;
+    unsigned char *out = orig ? malloc(orig_size ? orig_size : 1) : NULL;
+    if (!out) {
+        return 1;
+    }
+    if (src_size < LZMA_HEADER_SIZE) {
+        fprintf(stderr, "%s: not an .lzma file\n", argv[1]);
+        return 1;
+    }
+
+    int status = 0;
+    memset(out, 0, orig_size);
+    if (!decode_whole(src, src_size, out, orig_size)
+        || memcmp(out, orig, orig_size) != 0) {
+        fprintf(stderr, "%s: decoding in one call failed\n", argv[1]);
+        status = 1;
+    }
+    memset(out, 0, orig_size);
+    if (!decode_pieces(src, src_size, out, orig_size)
+        || memcmp(out, orig, orig_size) != 0) {
+        fprintf(stderr, "%s: decoding in pieces failed\n", argv[1]);
+        status = 1;
+    }
+
+    free(out);
+    free(orig);
+    free(src);
+    return status;
+}
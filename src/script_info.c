@@ -163,8 +163,13 @@ static char **shallow_merge_argv(char *argv1[], char *argv2[])
     return outv;
 }
 
-bool RunScript(char *argv[], bool is_chdir_to_script_dir,
-               const char *chdir_dir, int *exit_code)
+/*
+   Runs the script as RunScript() does, or with child set only starts it
+   and stores its handle there.
+*/
+static bool launch_script(char *argv[], bool is_chdir_to_script_dir,
+                          const char *chdir_dir, bool replace_process,
+                          int *exit_code, ChildProcess **child)
 {
     if (!IsScriptInfoSet()) {
         APP_ERROR("Script info is not initialized");
@@ -237,7 +242,14 @@ bool RunScript(char *argv[], bool is_chdir_to_script_dir,
         merged_argv = new_argv;
     }
 
-    result = CreateAndWaitForProcess(app_name, merged_argv, exit_code);
+    if (child) {
+        *child = StartProcess(app_name, merged_argv);
+        result = *child != NULL;
+    } else if (replace_process) {
+        result = ReplaceProcess(app_name, merged_argv);
+    } else {
+        result = CreateAndWaitForProcess(app_name, merged_argv, exit_code);
+    }
 
 cleanup:
     if (script_info) {
@@ -257,3 +269,19 @@ cleanup:
     }
     return result;
 }
+
+bool RunScript(char *argv[], bool is_chdir_to_script_dir,
+               const char *chdir_dir, bool replace_process, int *exit_code)
+{
+    return launch_script(argv, is_chdir_to_script_dir, chdir_dir,
+                         replace_process, exit_code, NULL);
+}
+
+struct ChildProcess *StartScript(char *argv[], bool is_chdir_to_script_dir,
+                                 const char *chdir_dir)
+{
+    ChildProcess *child = NULL;
+    launch_script(argv, is_chdir_to_script_dir, chdir_dir, false, NULL,
+                  &child);
+    return child;
+}
@@ -15,7 +15,21 @@ void FreeScriptInfo(void);
  * @param chdir_dir               When non-NULL (and is_chdir_to_script_dir is
  *                                false), the script starts with its working
  *                                directory set to this path (--chdir-exe-dir).
+ * @param replace_process         When true, the interpreter replaces the stub
+ *                                process (ReplaceProcess()) instead of running
+ *                                as its child, and RunScript only returns on
+ *                                failure.
  * @param exit_code               Receives the script's exit code.
  */
 bool RunScript(char *argv[], bool is_chdir_to_script_dir,
-               const char *chdir_dir, int *exit_code);
+               const char *chdir_dir, bool replace_process, int *exit_code);
+
+struct ChildProcess;
+
+/**
+ * Starts the packaged script like RunScript(), without waiting for it.
+ *
+ * @return A handle to pass to WaitForProcess(), or NULL on failure.
+ */
+struct ChildProcess *StartScript(char *argv[], bool is_chdir_to_script_dir,
+                                 const char *chdir_dir);
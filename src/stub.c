@@ -17,6 +17,45 @@
 #include "inst_dir.h"
 #include "script_info.h"
 #include "unpack.h"
+#include "trace.h"
+
+/*
+   With LAUNCH_EARLY the application is started at OP_LAUNCH, while
+   ProcessImage() goes on extracting the files after it. LAUNCH_MARKER
+   exists in the extraction directory until they are all written;
+   OCRAN_EXTRACTING gives its path to the application.
+*/
+#define LAUNCH_MARKER ".ocran-extracting"
+
+typedef struct {
+    char        **argv;
+    bool          is_chdir_to_script_dir;
+    const char   *chdir_dir;
+    char         *marker;   // path of LAUNCH_MARKER once created
+    ChildProcess *child;    // the application once started
+} EarlyLaunch;
+
+static bool launch_early(void *arg)
+{
+    EarlyLaunch *launch = arg;
+
+    if (!ExportFileToInstDir(LAUNCH_MARKER, NULL, 0)) {
+        APP_ERROR("Failed to create the extraction marker");
+        return false;
+    }
+    launch->marker = ExpandInstDirPath(LAUNCH_MARKER);
+    if (!launch->marker || !SetEnvVar("OCRAN_EXTRACTING", launch->marker)) {
+        APP_ERROR("Failed to set the extraction marker");
+        return false;
+    }
+
+    DEBUG("Run application script while extracting the rest");
+    /* Ended, and TRACE_CHILD begun, once the child process is started. */
+    TraceBegin(TRACE_RUN_SCRIPT);
+    launch->child = StartScript(launch->argv, launch->is_chdir_to_script_dir,
+                                launch->chdir_dir);
+    return launch->child != NULL;
+}
 
 int main(int argc, char *argv[])
 {
@@ -26,6 +65,12 @@ int main(int argc, char *argv[])
     const char *extract_dir = NULL;
     char *image_path = NULL;
     char *exe_dir = NULL;
+    bool is_cached = false;
+    bool is_staging = false;
+    EarlyLaunch launch = { 0 };
+
+    /* Phase timings for OCRAN_TRACE; free when it is not set. */
+    InitTrace();
 
     /*
        Initialize signal and control handling so the parent process remains
@@ -47,12 +92,43 @@ int main(int argc, char *argv[])
     }
 
     /* Open and map the image (executable) into memory */
+    TraceBegin(TRACE_OPEN_PACK);
     unpack_ctx = OpenPackFile(image_path);
+    TraceEnd(TRACE_OPEN_PACK);
     if (!unpack_ctx) {
         FATAL("Failed to map the executable file");
         goto cleanup;
     }
 
+    /*
+       OCRAN_INSPECT=list prints the payload's table of contents and
+       OCRAN_INSPECT=extract:<path> extracts the entries at or below <path>
+       into the working directory; the application is not run. An
+       environment variable keeps the application's argv untouched.
+    */
+    const char *inspect = getenv("OCRAN_INSPECT");
+    if (inspect && *inspect) {
+        if (getenv("OCRAN_DEBUG")) {
+            EnableDebugMode();
+        }
+        if (strcmp(inspect, "list") == 0) {
+            if (!ListPackEntries(unpack_ctx)) {
+                FATAL("Failed to list the packed files");
+                goto cleanup;
+            }
+        } else if (strncmp(inspect, "extract:", 8) == 0) {
+            if (!ExtractPackEntries(unpack_ctx, inspect + 8, ".")) {
+                FATAL("Failed to extract '%s' from the packed files", inspect + 8);
+                goto cleanup;
+            }
+        } else {
+            FATAL("Unknown OCRAN_INSPECT command '%s' (use list or extract:<path>)", inspect);
+            goto cleanup;
+        }
+        status = EXIT_CODE_SUCCESS;
+        goto cleanup;
+    }
+
     /* Read header of packed data */
     op_modes = GetOperationModes(unpack_ctx);
 
@@ -71,29 +147,43 @@ int main(int argc, char *argv[])
             goto cleanup;
         }
         DEBUG("Running in executable directory: %s", extract_dir);
+    } else if (IsExtractCache(op_modes)) {
+        extract_dir = OpenCachedInstDir(GetExtractCacheKey(unpack_ctx), &is_cached);
+        if (!extract_dir) {
+            FATAL("Failed to open extraction cache directory");
+            goto cleanup;
+        }
+        is_staging = !is_cached;
+        DEBUG("%s extraction directory: %s",
+              is_cached ? "Reusing cached" : "Created staging", extract_dir);
     } else {
-        extract_dir = CreateInstDir(IsExtractToExeDir(op_modes));
+        unsigned long long extracted_size = 0;
+        if (!GetExtractedSize(unpack_ctx, &extracted_size)) {
+            DEBUG("Failed to estimate the size of the extracted files");
+        }
+        extract_dir = CreateInstDir(IsExtractToExeDir(op_modes), extracted_size);
         if (!extract_dir) {
             FATAL("Failed to create extraction directory");
             goto cleanup;
         }
         DEBUG("Created extraction directory: %s", extract_dir);
-    }
 
-    /* Unpacking process */
-    if (!ProcessImage(unpack_ctx)) {
-        FATAL("Failed to unpack image due to invalid or corrupted data");
-        goto cleanup;
+        /* Before any thread is started, which would rule out entering a
+           new namespace */
+        if (IsExtractToMemory(op_modes)) {
+            if (MountInstDirInMemory()) {
+                DEBUG("Extracting into a private tmpfs");
+            } else {
+                DEBUG("Extracting to disk: no private tmpfs available");
+            }
+        }
     }
 
-    // Memory map no longer needed after unpacking; free its resources.
-    ClosePackFile(unpack_ctx);
-
-    // Prevent accidental use of the freed map.
-    unpack_ctx = NULL;
-
-    /* Launching the script, provided there are no errors in file extraction from the image */
-    DEBUG("*** Starting application script in %s", extract_dir);
+    /* Reclaim extraction directories of executables that were killed
+       (rate limited, and in the background where possible) */
+    if (!IsRunInExeDir(op_modes) && !IsExtractToExeDir(op_modes)) {
+        SweepOrphanedInstDirs();
+    }
 
     DEBUG("Set the 'OCRAN_EXECUTABLE' environment variable to %s", image_path);
     if (!SetEnvVar("OCRAN_EXECUTABLE", image_path)) {
@@ -130,14 +220,98 @@ int main(int argc, char *argv[])
     }
 #endif
 
+    /* Unpacking process, skipped entirely on an extraction cache hit */
+    if (!is_cached) {
+        /* The application of a LAUNCH_EARLY payload starts at OP_LAUNCH,
+           unless it runs next to the executable or from a staging
+           directory that is yet to be published. */
+        bool early = IsLaunchEarly(op_modes) && !IsRunInExeDir(op_modes)
+            && !is_staging;
+        launch.argv = argv;
+        launch.is_chdir_to_script_dir = IsChdirBeforeScript(op_modes);
+        launch.chdir_dir = exe_dir;
+
+        TraceBegin(TRACE_PROCESS_OPCODES);
+        bool unpacked = ProcessImage(unpack_ctx, early ? launch_early : NULL,
+                                     &launch);
+        TraceEnd(TRACE_PROCESS_OPCODES);
+        /* Also after a failure, which the application then runs into */
+        if (launch.marker) {
+            DEBUG("Deleting extraction marker: %s", launch.marker);
+            if (!DeleteRecursively(launch.marker)) {
+                DEBUG("Failed to delete extraction marker");
+            }
+        }
+        if (!unpacked) {
+            FATAL("Failed to unpack image due to invalid or corrupted data");
+            goto cleanup;
+        }
+    }
+
+    /* Publish a freshly extracted cache entry. If that fails, run from the
+       staging directory and delete it afterwards. */
+    if (is_staging) {
+        if (CommitCachedInstDir(GetExtractCacheKey(unpack_ctx))) {
+            is_staging = false;
+        } else {
+            DEBUG("Failed to publish extraction cache entry");
+        }
+        extract_dir = GetInstDir();
+        DEBUG("Extraction directory: %s", extract_dir);
+    }
+
+    /* Environment and script opcodes kept outside the data (EXTRACT_CACHE) */
+    if (!ProcessLaunchSection(unpack_ctx)) {
+        FATAL("Failed to unpack image due to invalid or corrupted data");
+        goto cleanup;
+    }
+
+    // Memory map no longer needed after unpacking; free its resources.
+    ClosePackFile(unpack_ctx);
+
+    // Prevent accidental use of the freed map.
+    unpack_ctx = NULL;
+
+    /* Launching the script, provided there are no errors in file extraction from the image */
+    DEBUG("*** Starting application script in %s", extract_dir);
+
+    /*
+       With nothing to clean up afterwards -- the application runs next to
+       the executable, or the extraction directory is kept -- there is no
+       reason to wait for the interpreter: it replaces this process, keeps
+       its pid and receives signals directly. Not on Windows, which has no
+       exec.
+    */
+    bool replace_process = !launch.child && CanReplaceProcess() && !is_staging
+        && (IsRunInExeDir(op_modes) || !IsAutoCleanInstDir(op_modes));
+    if (replace_process) {
+        DEBUG("Replacing the stub process with the application");
+        /* The stub's last chance to write the trace. */
+        WriteTrace(image_path, EXIT_CODE_SUCCESS);
+    }
+
     /*
        RunScript uses the current value of status as its initial value
        and then overwrites it with the external script’s return code.
     */
-    DEBUG("Run application script");
-    if (!RunScript(argv, IsChdirBeforeScript(op_modes), exe_dir, &status)) {
-        FATAL("Failed to run script");
-        goto cleanup;
+    if (launch.child) {
+        /* Started at OP_LAUNCH */
+        DEBUG("Wait for application script");
+        ChildProcess *child = launch.child;
+        launch.child = NULL;
+        if (!WaitForProcess(child, &status)) {
+            FATAL("Failed to run script");
+            goto cleanup;
+        }
+    } else {
+        DEBUG("Run application script");
+        /* Ended, and TRACE_CHILD begun, once the child process is started. */
+        TraceBegin(TRACE_RUN_SCRIPT);
+        if (!RunScript(argv, IsChdirBeforeScript(op_modes), exe_dir,
+                       replace_process, &status)) {
+            FATAL("Failed to run script");
+            goto cleanup;
+        }
     }
     /*
        If the script executes successfully, its return code is stored in status.
@@ -149,8 +323,17 @@ cleanup:
        Cleanup failures are non-critical and logged as DEBUG only.
     */
 
-    if (image_path) {
-        free(image_path);
+    /* An application started before a failure is still using the
+       extraction directory */
+    if (launch.child) {
+        int child_status;
+        if (!WaitForProcess(launch.child, &child_status)) {
+            DEBUG("Failed to wait for application script");
+        }
+        launch.child = NULL;
+    }
+    if (launch.marker) {
+        free(launch.marker);
     }
 
     if (exe_dir) {
@@ -166,19 +349,31 @@ cleanup:
 
     /*
        If AUTO_CLEAN_INST_DIR is set, delete the extraction directory.
+       An extraction cache staging directory that was not published is
+       deleted as well.
     */
     /* Never delete in RUN_IN_EXE_DIR mode: the "installation directory"
        is the real application directory, not a temporary extraction dir. */
-    if (IsAutoCleanInstDir(op_modes) && !IsRunInExeDir(op_modes)) {
+    /* The exit status is not held up by the deletion: a detached process
+       does it, except in debug mode, whose messages it would lose. */
+    if ((IsAutoCleanInstDir(op_modes) && !IsRunInExeDir(op_modes)) || is_staging) {
         DEBUG("Deleting extraction directory: %s", extract_dir);
-        if (!DeleteInstDir()) {
+        TraceBegin(TRACE_DELETE_INST_DIR);
+        bool debug = IsDebugMode(op_modes) || getenv("OCRAN_DEBUG");
+        if (!(debug ? DeleteInstDir() : DeleteInstDirDetached())) {
             DEBUG("Failed to delete extraction directory");
         }
+        TraceEnd(TRACE_DELETE_INST_DIR);
     }
 
     FreeInstDir();
     extract_dir = NULL;
 
+    WriteTrace(image_path, status);
+    if (image_path) {
+        free(image_path);
+    }
+
 #ifdef __COSMOPOLITAN__
     /* On Windows, Cosmopolitan Libc's exit path encodes the full wait
        status into the process exit code (code << 8) so that cosmo
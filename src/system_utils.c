@@ -3,8 +3,10 @@
 #include <ntdef.h>
 #include <bcrypt.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include "error.h"
 #include "system_utils.h"
+#include "trace.h"
 
 /*
  * Returns true if `path` is a “clean” relative path:
@@ -319,8 +321,11 @@ bool CreateDirectoriesRecursively(const char *dir)
 
         if (!CreateDirectoryW(wpath, NULL)) {
             DWORD err = GetLastError();
-            APP_ERROR("Failed to create directory '%s', Error=%lu", path, err);
-            goto cleanup;
+            // Another extraction thread may have created it concurrently.
+            if (err != ERROR_ALREADY_EXISTS) {
+                APP_ERROR("Failed to create directory '%s', Error=%lu", path, err);
+                goto cleanup;
+            }
         }
 
         free(wpath);
@@ -339,7 +344,7 @@ cleanup:
     return result;
 }
 
-// Deletes a directory and all its contents recursively.
+// Deletes a directory and all its contents recursively, or a single file.
 bool DeleteRecursively(const char *path)
 {
     if (!path || !*path) {
@@ -347,6 +352,22 @@ bool DeleteRecursively(const char *path)
         return false;
     }
 
+    wchar_t *wfile = utf8_to_utf16(path);
+    if (!wfile) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        return false;
+    }
+    DWORD attr = GetFileAttributesW(wfile);
+    if (attr != INVALID_FILE_ATTRIBUTES && !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+        bool deleted = DeleteFileW(wfile);
+        if (!deleted) {
+            APP_ERROR("Failed to delete file, Error=%lu", GetLastError());
+        }
+        free(wfile);
+        return deleted;
+    }
+    free(wfile);
+
     char *findPath = JoinPath(path, "*");
     if (!findPath) {
         APP_ERROR("Failed to build find path for deletion");
@@ -423,6 +444,203 @@ bool DeleteRecursively(const char *path)
     return true;
 }
 
+/* Windows cannot fork; a stub waiting for a helper process it would have to
+   start saves nothing, so the work is done in place. */
+bool RunDetached(DetachedFunc func, void *arg)
+{
+    if (!func) {
+        APP_ERROR("func is NULL");
+        return false;
+    }
+    return func(arg);
+}
+
+bool DeleteRecursivelyDetached(const char *path)
+{
+    return DeleteRecursively(path);
+}
+
+bool ForEachDirEntry(const char *path, DirEntryFunc func, void *ctx)
+{
+    if (!path || !func) {
+        APP_ERROR("path or func is NULL");
+        return false;
+    }
+
+    char *findPath = JoinPath(path, "*");
+    if (!findPath) {
+        APP_ERROR("Failed to build find path");
+        return false;
+    }
+
+    wchar_t *wfindPath = utf8_to_utf16(findPath);
+    free(findPath);
+    if (!wfindPath) {
+        APP_ERROR("Failed to convert find path to UTF-16");
+        return false;
+    }
+
+    WIN32_FIND_DATAW findData;
+    HANDLE handle = FindFirstFileW(wfindPath, &findData);
+    free(wfindPath);
+    if (handle == INVALID_HANDLE_VALUE) {
+        APP_ERROR("Failed to read directory, Error=%lu", GetLastError());
+        return false;
+    }
+
+    do {
+        const wchar_t *wname = findData.cFileName;
+        if ( wname[0]==L'.' && (!wname[1] || (wname[1]==L'.' && !wname[2])) ) {
+            continue;
+        }
+
+        char *name = utf16_to_utf8(wname);
+        if (!name) {
+            APP_ERROR("Failed to convert filename to UTF-8");
+            continue;
+        }
+
+        bool more = func(name, ctx);
+        free(name);
+        if (!more) {
+            break;
+        }
+    } while (FindNextFileW(handle, &findData));
+
+    FindClose(handle);
+    return true;
+}
+
+bool GetFileAge(const char *path, uint64_t *seconds)
+{
+    if (!path || !seconds) {
+        return false;
+    }
+
+    wchar_t *wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        return false;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    BOOL found = GetFileAttributesExW(wpath, GetFileExInfoStandard, &data);
+    free(wpath);
+    if (!found) {
+        return false;
+    }
+
+    FILETIME now_ft;
+    GetSystemTimeAsFileTime(&now_ft);
+    ULARGE_INTEGER now, mtime;
+    now.LowPart    = now_ft.dwLowDateTime;
+    now.HighPart   = now_ft.dwHighDateTime;
+    mtime.LowPart  = data.ftLastWriteTime.dwLowDateTime;
+    mtime.HighPart = data.ftLastWriteTime.dwHighDateTime;
+
+    // FILETIME counts 100-nanosecond intervals
+    *seconds = now.QuadPart > mtime.QuadPart
+               ? (now.QuadPart - mtime.QuadPart) / 10000000 : 0;
+    return true;
+}
+
+uint64_t GetMonotonicTime(void)
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000
+                      + now.QuadPart % freq.QuadPart * 1000000
+                        / freq.QuadPart);
+}
+
+/*
+ * Owner locks. The holder keeps the file open without sharing write access;
+ * an open for writing fails with a sharing violation until every handle,
+ * including those inherited by child processes, is closed.
+ */
+struct OwnerLock {
+    HANDLE handle;
+};
+
+OwnerLock *CreateOwnerLock(const char *path)
+{
+    OwnerLock *lock  = NULL;
+    wchar_t   *wpath = NULL;
+
+    if (!path) {
+        APP_ERROR("path is NULL");
+        goto cleanup;
+    }
+
+    wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        goto cleanup;
+    }
+
+    lock = calloc(1, sizeof(*lock));
+    if (!lock) {
+        APP_ERROR("Memory allocation failed for owner lock");
+        goto cleanup;
+    }
+
+    /* Inheritable, so the application keeps the directory marked in use */
+    SECURITY_ATTRIBUTES sa = { .nLength = sizeof(sa), .bInheritHandle = TRUE };
+    lock->handle = CreateFileW(wpath, GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_DELETE, &sa,
+                               CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (lock->handle == INVALID_HANDLE_VALUE) {
+        APP_ERROR("Failed to create lock file, Error=%lu", GetLastError());
+        free(lock);
+        lock = NULL;
+        goto cleanup;
+    }
+
+    char pid[32];
+    int len = snprintf(pid, sizeof(pid), "%lu\r\n", (unsigned long)GetCurrentProcessId());
+    DWORD written;
+    if (!WriteFile(lock->handle, pid, (DWORD)len, &written, NULL)) {
+        DEBUG("Failed to record the pid in the lock file");
+    }
+
+cleanup:
+    free(wpath);
+    return lock;
+}
+
+void ReleaseOwnerLock(OwnerLock *lock)
+{
+    if (!lock) {
+        return;
+    }
+    CloseHandle(lock->handle);
+    free(lock);
+}
+
+bool IsOwnerLockAbandoned(const char *path)
+{
+    if (!path) {
+        return false;
+    }
+
+    wchar_t *wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        return false;
+    }
+
+    HANDLE handle = CreateFileW(wpath, GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(wpath);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    CloseHandle(handle);
+    return true;
+}
+
 static bool generate_unique_name(char *buffer, size_t buffer_size)
 {
     char base32[] = "0123456789ABCDEF"
@@ -501,6 +719,137 @@ char *CreateUniqueDirectory(char *tmpl)
     return NULL;
 }
 
+bool PathExists(const char *path)
+{
+    if (!path) {
+        return false;
+    }
+
+    wchar_t *wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        return false;
+    }
+
+    DWORD attr = GetFileAttributesW(wpath);
+    free(wpath);
+    return attr != INVALID_FILE_ATTRIBUTES;
+}
+
+// Returns the attributes of path, or INVALID_FILE_ATTRIBUTES.
+static DWORD get_path_attributes(const char *path)
+{
+    if (!path) {
+        return INVALID_FILE_ATTRIBUTES;
+    }
+
+    wchar_t *wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        return INVALID_FILE_ATTRIBUTES;
+    }
+
+    DWORD attr = GetFileAttributesW(wpath);
+    free(wpath);
+    return attr;
+}
+
+// The temporary directory is private to each user on Windows, so only
+// reparse points, which could redirect the path elsewhere, are refused.
+bool IsPrivateDirectory(const char *path)
+{
+    DWORD attr = get_path_attributes(path);
+    return attr != INVALID_FILE_ATTRIBUTES
+        && (attr & FILE_ATTRIBUTE_DIRECTORY)
+        && !(attr & FILE_ATTRIBUTE_REPARSE_POINT);
+}
+
+bool CreatePrivateDirectory(const char *path)
+{
+    if (!path) {
+        return false;
+    }
+
+    wchar_t *wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        return false;
+    }
+
+    BOOL created = CreateDirectoryW(wpath, NULL);
+    DWORD err = created ? ERROR_SUCCESS : GetLastError();
+    free(wpath);
+    if (!created && err != ERROR_ALREADY_EXISTS) {
+        DEBUG("CreatePrivateDirectory: CreateDirectoryW failed, Error=%lu", err);
+        return false;
+    }
+    return IsPrivateDirectory(path);
+}
+
+bool IsOwnedFile(const char *path)
+{
+    DWORD attr = get_path_attributes(path);
+    return attr != INVALID_FILE_ATTRIBUTES
+        && !(attr & FILE_ATTRIBUTE_REPARSE_POINT);
+}
+
+bool RenameDirectory(const char *src, const char *dst)
+{
+    bool     result = false;
+    wchar_t *wsrc   = NULL;
+    wchar_t *wdst   = NULL;
+
+    if (!src || !dst) {
+        APP_ERROR("RenameDirectory: src or dst is NULL");
+
+        goto cleanup;
+    }
+
+    wsrc = utf8_to_utf16(src);
+    wdst = utf8_to_utf16(dst);
+    if (!wsrc || !wdst) {
+        APP_ERROR("RenameDirectory: Failed to convert path to UTF-16");
+
+        goto cleanup;
+    }
+
+    // Without MOVEFILE_REPLACE_EXISTING an existing destination is an error.
+    if (!MoveFileExW(wsrc, wdst, 0)) {
+        DWORD err = GetLastError();
+        if (err == ERROR_ALREADY_EXISTS || err == ERROR_FILE_EXISTS) {
+            DEBUG("RenameDirectory: '%s' already exists", dst);
+        } else {
+            APP_ERROR("RenameDirectory: MoveFileExW failed, Error=%lu", err);
+        }
+
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    if (wsrc) {
+        free(wsrc);
+    }
+    if (wdst) {
+        free(wdst);
+    }
+    return result;
+}
+
+bool MountPrivateTmpfs(const char *dir)
+{
+    (void)dir;
+    DEBUG("MountPrivateTmpfs: not supported on Windows");
+    return false;
+}
+
+bool UnmountPrivateTmpfs(const char *dir)
+{
+    (void)dir;
+    return false;
+}
+
 // Maximum path length in Windows (32,767 chars).
 #define MAX_LONG_PATH 32767U
 
@@ -569,44 +918,72 @@ char *GetTempDirectoryPath(void)
     return temp_dir;
 }
 
-bool ExportFile(const char *path, const void *buffer, size_t buffer_size)
+bool IsUsableTempDirectory(const char *dir, unsigned long long size)
 {
-    bool     result  = false;
-    char    *parent  = NULL;
-    wchar_t *wpath   = NULL;
-    HANDLE   hFile   = INVALID_HANDLE_VALUE;
-    DWORD    written = 0;
+    bool result = false;
 
-    if (buffer_size > MAXDWORD) {
-        APP_ERROR(
-            "ExportFile: Write length %zu exceeds maximum DWORD",
-            buffer_size
-        );
+    wchar_t *wdir = utf8_to_utf16(dir);
+    if (!wdir) {
+        APP_ERROR("IsUsableTempDirectory: Failed to convert path to UTF-16");
 
         goto cleanup;
     }
 
-    parent = GetParentPath(path);
-    if (!parent) {
-        APP_ERROR("Failed to get parent path");
+    DWORD attr = GetFileAttributesW(wdir);
+    if (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+        DEBUG("IsUsableTempDirectory: '%s' is not a directory", dir);
 
         goto cleanup;
     }
 
-    if (!CreateDirectoriesRecursively(parent)) {
-        APP_ERROR("ExportFile: Failed to create parent directory for %s", path);
+    ULARGE_INTEGER available;
+    if (!GetDiskFreeSpaceExW(wdir, &available, NULL, NULL)) {
+        DEBUG("IsUsableTempDirectory: GetDiskFreeSpaceExW failed, Error=%lu", GetLastError());
 
         goto cleanup;
     }
+    if (available.QuadPart < size) {
+        DEBUG("IsUsableTempDirectory: '%s' has %llu bytes free, %llu needed",
+              dir, (unsigned long long)available.QuadPart, size);
+
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    if (wdir) {
+        free(wdir);
+    }
+    return result;
+}
+
+struct OutputFile {
+    HANDLE handle;
+};
+
+// Creates (or truncates) a file whose parent directory exists.
+static OutputFile *open_output_file(const char *path)
+{
+    OutputFile *file  = NULL;
+    wchar_t    *wpath = NULL;
 
     // Convert UTF-8 path to UTF-16 for proper multibyte support
     wpath = utf8_to_utf16(path);
     if (!wpath) {
-        APP_ERROR("ExportFile: Failed to convert path to UTF-16");
+        APP_ERROR("CreateOutputFile: Failed to convert path to UTF-16");
+
         goto cleanup;
     }
 
-    hFile = CreateFileW(
+    file = calloc(1, sizeof(*file));
+    if (!file) {
+        APP_ERROR("CreateOutputFile: Memory allocation failed");
+
+        goto cleanup;
+    }
+
+    file->handle = CreateFileW(
         wpath,                      // file path (UTF-16)
         GENERIC_WRITE,              // write-only access (like O_WRONLY)
         0,                          // no sharing (exclusive)
@@ -615,42 +992,221 @@ bool ExportFile(const char *path, const void *buffer, size_t buffer_size)
         FILE_ATTRIBUTE_NORMAL,      // normal file (no special flags)
         NULL                        // no template file
     );
-    if (hFile == INVALID_HANDLE_VALUE) {
+    if (file->handle == INVALID_HANDLE_VALUE) {
         DWORD err = GetLastError();
-        APP_ERROR("ExportFile: CreateFileW failed, Error=%u", err);
+        APP_ERROR("CreateOutputFile: CreateFileW failed, Error=%lu", err);
+        free(file);
+        file = NULL;
 
         goto cleanup;
     }
 
-    if (!WriteFile(hFile, buffer, (DWORD)buffer_size, &written, NULL)) {
+cleanup:
+    if (wpath) {
+        free(wpath);
+    }
+    return file;
+}
+
+OutputFile *CreateOutputFile(const char *path)
+{
+    char *parent = GetParentPath(path);
+    if (!parent) {
+        APP_ERROR("Failed to get parent path");
+        return NULL;
+    }
+
+    if (!CreateDirectoriesRecursively(parent)) {
+        APP_ERROR("CreateOutputFile: Failed to create parent directory for %s", path);
+        free(parent);
+        return NULL;
+    }
+    free(parent);
+
+    return open_output_file(path);
+}
+
+// Largest single WriteFile request; larger writes are split.
+#define MAX_WRITE_CHUNK 0x40000000U
+
+bool WriteOutputFile(OutputFile *file, const void *buffer, size_t buffer_size)
+{
+    if (!file || (!buffer && buffer_size > 0)) {
+        APP_ERROR("WriteOutputFile: file or buffer is NULL");
+        return false;
+    }
+
+    const char *p = buffer;
+    while (buffer_size > 0) {
+        DWORD chunk = buffer_size > MAX_WRITE_CHUNK
+                      ? MAX_WRITE_CHUNK : (DWORD)buffer_size;
+        DWORD written = 0;
+
+        if (!WriteFile(file->handle, p, chunk, &written, NULL)) {
+            DWORD err = GetLastError();
+            APP_ERROR("WriteOutputFile: WriteFile failed, Error=%lu", err);
+            return false;
+        }
+        if (written == 0) {
+            APP_ERROR("WriteOutputFile: WriteFile wrote nothing");
+            return false;
+        }
+
+        p += written;
+        buffer_size -= written;
+    }
+
+    return true;
+}
+
+bool CloseOutputFile(OutputFile *file)
+{
+    if (!file) {
+        return true;
+    }
+
+    bool result = true;
+    if (!CloseHandle(file->handle)) {
         DWORD err = GetLastError();
-        APP_ERROR("ExportFile: WriteFile failed, Error=%u", err);
+        APP_ERROR("CloseOutputFile: CloseHandle failed, Error=%lu", err);
+        result = false;
+    }
+    free(file);
+    return result;
+}
+
+bool ExportFile(const char *path, const void *buffer, size_t buffer_size)
+{
+    OutputFile *file = CreateOutputFile(path);
+    if (!file) {
+        APP_ERROR("ExportFile: Failed to create %s", path);
+        return false;
+    }
+
+    bool written = WriteOutputFile(file, buffer, buffer_size);
+    bool closed = CloseOutputFile(file);
+    return written && closed;
+}
+
+/*
+   Windows has no equivalent of openat() short of the native API, so a
+   directory handle is just the directory's path; what it saves is
+   checking and creating the ancestors of every file.
+*/
+struct DirHandle {
+    char *path;
+};
+
+DirHandle *OpenDirHandle(const char *path)
+{
+    if (!path) {
+        APP_ERROR("OpenDirHandle: path is NULL");
+        return NULL;
+    }
 
+    DirHandle *dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        APP_ERROR("OpenDirHandle: Memory allocation failed");
+        return NULL;
+    }
+
+    dir->path = _strdup(path);
+    if (!dir->path) {
+        APP_ERROR("OpenDirHandle: Memory allocation failed");
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+DirHandle *CreateSubdirHandle(const DirHandle *parent, const char *name)
+{
+    DirHandle *dir   = NULL;
+    char      *path  = NULL;
+    wchar_t   *wpath = NULL;
+
+    if (!parent || !name) {
+        APP_ERROR("CreateSubdirHandle: parent or name is NULL");
         goto cleanup;
     }
 
-    if (written != (DWORD)buffer_size) {
-        APP_ERROR(
-            "ExportFile: Write size mismatch, expected %zu, wrote %u",
-            buffer_size, written
-        );
-        
+    path = JoinPath(parent->path, name);
+    if (!path) {
         goto cleanup;
     }
 
-    result = true;
+    wpath = utf8_to_utf16(path);
+    if (!wpath) {
+        APP_ERROR("CreateSubdirHandle: Failed to convert path to UTF-16");
+        goto cleanup;
+    }
+
+    if (!CreateDirectoryW(wpath, NULL)) {
+        DWORD err = GetLastError();
+        DWORD attr = GetFileAttributesW(wpath);
+        if (err != ERROR_ALREADY_EXISTS || attr == INVALID_FILE_ATTRIBUTES
+            || !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+            APP_ERROR("CreateSubdirHandle: CreateDirectoryW(%s) failed, Error=%lu", path, err);
+            goto cleanup;
+        }
+    }
+
+    dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        APP_ERROR("CreateSubdirHandle: Memory allocation failed");
+        goto cleanup;
+    }
+    dir->path = path;
+    path = NULL;
 
 cleanup:
-    if (parent) {
-        free(parent);
+    free(path);
+    free(wpath);
+    return dir;
+}
+
+void CloseDirHandle(DirHandle *dir)
+{
+    if (!dir) {
+        return;
     }
-    if (wpath) {
-        free(wpath);
+    free(dir->path);
+    free(dir);
+}
+
+const char *GetDirHandlePath(const DirHandle *dir)
+{
+    return dir ? dir->path : NULL;
+}
+
+OutputFile *CreateOutputFileAt(const DirHandle *dir, const char *name)
+{
+    if (!dir || !name) {
+        APP_ERROR("CreateOutputFileAt: dir or name is NULL");
+        return NULL;
     }
-    if (hFile != INVALID_HANDLE_VALUE) {
-        CloseHandle(hFile);
+
+    char *path = JoinPath(dir->path, name);
+    if (!path) {
+        return NULL;
     }
-    return result;
+
+    OutputFile *file = open_output_file(path);
+    free(path);
+    return file;
+}
+
+bool ExportFileAt(const DirHandle *dir, const char *name, const void *buffer, size_t buffer_size)
+{
+    OutputFile *file = CreateOutputFileAt(dir, name);
+    if (!file) {
+        APP_ERROR("ExportFileAt: Failed to create %s", name);
+        return false;
+    }
+
+    bool written = WriteOutputFile(file, buffer, buffer_size);
+    bool closed = CloseOutputFile(file);
+    return written && closed;
 }
 
 struct MemoryMap {
@@ -845,6 +1401,71 @@ size_t GetMemoryMapSize(const MemoryMap *map)
     return map->size;
 }
 
+// Windows has no copy_file_range and clones blocks on ReFS only; the
+// contents are written from the mapping.
+bool ExportMappedFileAt(const DirHandle *dir, const char *name,
+                        const MemoryMap *map, const void *data, size_t size)
+{
+    (void)map;
+    return ExportFileAt(dir, name, data, size);
+}
+
+bool DuplicateFileAt(const DirHandle *src_dir, const char *src_name,
+                     const DirHandle *dir, const char *name)
+{
+    bool     result    = false;
+    char    *src_path  = NULL;
+    char    *path      = NULL;
+    wchar_t *wsrc_path = NULL;
+    wchar_t *wpath     = NULL;
+
+    if (!src_dir || !src_name || !dir || !name) {
+        APP_ERROR("DuplicateFileAt: directory or name is NULL");
+        goto cleanup;
+    }
+
+    src_path = JoinPath(src_dir->path, src_name);
+    path = JoinPath(dir->path, name);
+    if (!src_path || !path) {
+        APP_ERROR("DuplicateFileAt: failed to build paths");
+        goto cleanup;
+    }
+
+    wsrc_path = utf8_to_utf16(src_path);
+    wpath = utf8_to_utf16(path);
+    if (!wsrc_path || !wpath) {
+        APP_ERROR("Failed to convert path to UTF-16");
+        goto cleanup;
+    }
+
+    if (CreateHardLinkW(wpath, wsrc_path, NULL)) {
+        result = true;
+        goto cleanup;
+    }
+    DEBUG("DuplicateFileAt: CreateHardLinkW failed (%lu); copying", GetLastError());
+
+    /* No hard links here (FAT, or too many links): copy */
+    if (!CopyFileW(wsrc_path, wpath, FALSE)) {
+        APP_ERROR("Failed to copy file, Error=%lu", GetLastError());
+        goto cleanup;
+    }
+    result = true;
+
+cleanup:
+    free(src_path);
+    free(path);
+    free(wsrc_path);
+    free(wpath);
+    return result;
+}
+
+// Returns the number of processors across all processor groups, at least 1.
+size_t GetProcessorCount(void)
+{
+    DWORD n = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    return n > 0 ? (size_t)n : 1;
+}
+
 /**
  * @brief Handle console control events in the parent process.
  *
@@ -960,11 +1581,29 @@ static size_t quoted_args(char *args, char *argv[])
     return args_len;
 }
 
-bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code)
+/* Windows has no exec; the stub always waits for a child process. */
+bool CanReplaceProcess(void)
+{
+    return false;
+}
+
+bool ReplaceProcess(const char *app_name, char *argv[])
+{
+    (void)app_name;
+    (void)argv;
+    APP_ERROR("Replacing the process is not supported on Windows");
+    return false;
+}
+
+struct ChildProcess {
+    HANDLE process;
+};
+
+ChildProcess *StartProcess(const char *app_name, char *argv[])
 {
     PROCESS_INFORMATION pi = { 0 };
     STARTUPINFOW        si = { .cb = sizeof(si) };
-    bool result = false;
+    ChildProcess *child = NULL;
     char    *cmd_line  = NULL;
     wchar_t *wapp_name = NULL;
     wchar_t *wcmd_line = NULL;
@@ -991,22 +1630,23 @@ bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code)
         goto cleanup;
     }
 
-    if (!CreateProcessW(wapp_name, wcmd_line, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi)) {
-        APP_ERROR("Failed to create process (%lu)", GetLastError());
+    child = calloc(1, sizeof(*child));
+    if (!child) {
+        APP_ERROR("Failed to allocate memory");
         goto cleanup;
     }
 
-    if (WaitForSingleObject(pi.hProcess, INFINITE) != WAIT_OBJECT_0) {
-        APP_ERROR("Failed to wait script process (%lu)", GetLastError());
+    if (!CreateProcessW(wapp_name, wcmd_line, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi)) {
+        APP_ERROR("Failed to create process (%lu)", GetLastError());
+        free(child);
+        child = NULL;
         goto cleanup;
     }
 
-    if (!GetExitCodeProcess(pi.hProcess, (LPDWORD)exit_code)) {
-        APP_ERROR("Failed to get exit status (%lu)", GetLastError());
-        goto cleanup;
-    }
+    TraceEnd(TRACE_RUN_SCRIPT);
+    TraceBegin(TRACE_CHILD);
 
-    result = true;
+    child->process = pi.hProcess;
 
 cleanup:
     if (cmd_line) {
@@ -1018,11 +1658,44 @@ cleanup:
     if (wcmd_line) {
         free(wcmd_line);
     }
-    if (pi.hProcess && pi.hProcess != INVALID_HANDLE_VALUE) {
-        CloseHandle(pi.hProcess);
-    }
     if (pi.hThread && pi.hThread != INVALID_HANDLE_VALUE) {
         CloseHandle(pi.hThread);
     }
+    return child;
+}
+
+bool WaitForProcess(ChildProcess *child, int *exit_code)
+{
+    bool result = false;
+
+    if (!child || !exit_code) {
+        APP_ERROR("child or exit_code is NULL");
+        goto cleanup;
+    }
+
+    if (WaitForSingleObject(child->process, INFINITE) != WAIT_OBJECT_0) {
+        APP_ERROR("Failed to wait script process (%lu)", GetLastError());
+        goto cleanup;
+    }
+    TraceEnd(TRACE_CHILD);
+
+    if (!GetExitCodeProcess(child->process, (LPDWORD)exit_code)) {
+        APP_ERROR("Failed to get exit status (%lu)", GetLastError());
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    if (child) {
+        CloseHandle(child->process);
+        free(child);
+    }
     return result;
 }
+
+bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code)
+{
+    ChildProcess *child = StartProcess(app_name, argv);
+    return child && WaitForProcess(child, exit_code);
+}
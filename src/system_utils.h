@@ -3,6 +3,7 @@
 #endif
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef _WIN32
 #define PATH_SEPARATOR '\\'
@@ -73,6 +74,112 @@ bool CreateDirectoriesRecursively(const char *dir);
  */
 bool DeleteRecursively(const char *path);
 
+/**
+ * @brief Deletes a directory and all its contents like DeleteRecursively(),
+ *        but in a detached background process the caller does not wait for.
+ *
+ * On POSIX the deleting process is a grandchild in its own session, with
+ * stdio redirected to /dev/null and no other inherited descriptors, so
+ * neither the caller's exit nor a pipeline reading its output waits for
+ * it. Windows (and APE stubs running there) delete in place.
+ *
+ * @param path The path of the directory to delete.
+ * @return true if the deletion was handed off or, when it ran in place,
+ *         succeeded; false otherwise. A failure in the background process
+ *         goes unreported.
+ */
+bool DeleteRecursivelyDetached(const char *path);
+
+/**
+ * @brief Function run by RunDetached().
+ *
+ * @return true on success.
+ */
+typedef bool (*DetachedFunc)(void *arg);
+
+/**
+ * @brief Runs a function in a detached background process the caller does
+ *        not wait for.
+ *
+ * On POSIX the function runs in a grandchild in its own session, with stdio
+ * redirected to /dev/null and no other inherited descriptors. Where that is
+ * not possible (Windows, APE stubs running there, or fork() failing) the
+ * function runs in place.
+ *
+ * @return true if the function was handed off or, when it ran in place,
+ *         succeeded; false otherwise.
+ */
+bool RunDetached(DetachedFunc func, void *arg);
+
+/**
+ * @brief Function called by ForEachDirEntry() for each entry name.
+ *
+ * @return true to continue, false to stop the iteration.
+ */
+typedef bool (*DirEntryFunc)(const char *name, void *ctx);
+
+/**
+ * @brief Calls @p func for the name of every entry in a directory,
+ *        except "." and "..", in no particular order.
+ *
+ * @return true if the directory could be read, false otherwise.
+ */
+bool ForEachDirEntry(const char *path, DirEntryFunc func, void *ctx);
+
+/**
+ * @brief Gets the time since a file was last modified.
+ *
+ * @param path     Path of the file.
+ * @param seconds  Receives the age in seconds; 0 for a future time.
+ * @return true on success, false if the file does not exist or on error.
+ */
+bool GetFileAge(const char *path, uint64_t *seconds);
+
+/**
+ * @brief Returns a monotonic clock reading in microseconds, for measuring
+ *        intervals.
+ */
+uint64_t GetMonotonicTime(void);
+
+/**
+ * @brief Opaque handle to a lock file held by this process.
+ *
+ * A lock file marks a directory as in use for as long as the process that
+ * created it, or any process that inherited the lock, is running; it is
+ * released by the system when they are gone, however they exit. It holds
+ * the creating process's pid for the curious.
+ */
+typedef struct OwnerLock OwnerLock;
+
+/**
+ * @brief Creates and locks the lock file at @p path.
+ *
+ * The file is never visible unlocked under its name. The lock is inherited
+ * by child processes (e.g. the application), so it stays held while they
+ * run, even if this process is killed.
+ *
+ * @return A new OwnerLock, or NULL on failure.
+ */
+OwnerLock *CreateOwnerLock(const char *path);
+
+/**
+ * @brief Releases a lock created by CreateOwnerLock() in this process and
+ *        frees the handle. The file itself stays. Passing NULL does nothing.
+ */
+void ReleaseOwnerLock(OwnerLock *lock);
+
+/**
+ * @brief Checks whether the lock file at @p path exists and is not held by
+ *        any process.
+ *
+ * On POSIX the file must also be a regular file owned by the effective
+ * user.
+ *
+ * @return true only if the file exists and nobody holds it; false if it is
+ *         held, is missing, belongs to someone else or cannot be checked.
+ */
+bool IsOwnerLockAbandoned(const char *path);
+
 /**
  * @brief Windows-side replacement for POSIX mkdtemp().
  *
@@ -86,6 +193,89 @@ bool DeleteRecursively(const char *path);
  */
 char *CreateUniqueDirectory(char *tmpl);
 
+/**
+ * @brief Checks whether a file or directory exists at the given path.
+ *
+ * @param path  Path to test; must not be NULL.
+ * @return      true if something exists at @p path, false otherwise.
+ */
+bool PathExists(const char *path);
+
+/**
+ * @brief Checks that a directory can only be modified by the current user.
+ *
+ * On POSIX the path must be a directory itself, not a symbolic link, owned
+ * by the effective user and not writable by group or others. On Windows,
+ * where the temporary directory is private to each user, it must be a
+ * directory that is not a reparse point.
+ *
+ * @param path  Directory to check.
+ * @return      true if the directory passes the checks, false otherwise.
+ */
+bool IsPrivateDirectory(const char *path);
+
+/**
+ * @brief Creates a directory that only the current user can access, or
+ *        checks an existing one with IsPrivateDirectory().
+ *
+ * @param path  Directory to create.
+ * @return      true if the directory exists and is private, false otherwise.
+ */
+bool CreatePrivateDirectory(const char *path);
+
+/**
+ * @brief Checks that a file is owned by the current user.
+ *
+ * On POSIX the path must not be a symbolic link and must be owned by the
+ * effective user. On Windows it only has to exist and not be a reparse
+ * point.
+ *
+ * @param path  File to check.
+ * @return      true if the file passes the checks, false otherwise.
+ */
+bool IsOwnedFile(const char *path);
+
+/**
+ * @brief Renames a directory, failing if the destination already exists.
+ *
+ * The rename is atomic on the same filesystem, so concurrent callers
+ * publishing the same directory can detect that another one won the race.
+ * A failure caused by an existing destination is not reported as an error.
+ *
+ * @param src  Existing directory to rename.
+ * @param dst  New path; must not exist (or be an empty directory on POSIX).
+ * @return     true if the directory was renamed, false otherwise.
+ */
+bool RenameDirectory(const char *src, const char *dst);
+
+/**
+ * @brief Mounts a private tmpfs over an existing directory (Linux only).
+ *
+ * The process moves into a mount namespace of its own first, preceded by a
+ * user namespace mapping its uid and gid to themselves unless it runs as
+ * root, so the mount is seen only by it and the children it starts later,
+ * and goes away with the last of them. The files in it never reach a disk
+ * and may be executed even if the directory lies on a noexec mount.
+ * In the user namespace, files of other users show as owned by the
+ * overflow user, and setuid programs gain no privileges.
+ *
+ * Must be called while the process has a single thread.
+ *
+ * @param dir  Directory to mount over, owned by the calling user.
+ * @return     true if the tmpfs is mounted; false if the platform or the
+ *             kernel configuration does not permit it.
+ */
+bool MountPrivateTmpfs(const char *dir);
+
+/**
+ * @brief Detaches a tmpfs mounted by MountPrivateTmpfs(), uncovering the
+ *        directory underneath. Processes still using files in it keep it
+ *        until they are done.
+ *
+ * @return  true if it was detached, false otherwise.
+ */
+bool UnmountPrivateTmpfs(const char *dir);
+
 /**
  * GetImagePath - Retrieves the full path of the executable file of the current process.
  *
@@ -102,6 +292,19 @@ char *GetImagePath(void);
  */
 char *GetTempDirectoryPath(void);
 
+/**
+ * @brief Checks whether a directory can hold an extraction directory.
+ *
+ * The directory must exist, be writable and searchable by the process,
+ * and, where the platform tells, not lie on a read-only or noexec mount,
+ * since extracted extension libraries are mapped executable.
+ *
+ * @param dir   Directory to check.
+ * @param size  Bytes the filesystem must have available to the process.
+ * @return      true if all of this holds, false otherwise.
+ */
+bool IsUsableTempDirectory(const char *dir, unsigned long long size);
+
 /**
  * @brief Normalizes a path to its long form.
  *
@@ -116,6 +319,42 @@ char *GetTempDirectoryPath(void);
  */
 char *ToLongPath(const char *path);
 
+/**
+ * @brief Opaque handle to a file opened for writing.
+ *
+ * Lets a file be written piece by piece as its contents become available,
+ * e.g. while they are being decompressed. Obtain instances with
+ * CreateOutputFile() and release them with CloseOutputFile().
+ */
+typedef struct OutputFile OutputFile;
+
+/**
+ * @brief Creates (or truncates) a file for writing.
+ *        Creates any missing parent directories.
+ *
+ * @param path  Output file path (absolute or relative).
+ * @return      A new OutputFile on success, or NULL on failure.
+ */
+OutputFile *CreateOutputFile(const char *path);
+
+/**
+ * @brief Appends data to a file opened with CreateOutputFile().
+ *
+ * @param file        File to write to; must not be NULL.
+ * @param buffer      Data to write. May be NULL only if buffer_size is 0.
+ * @param buffer_size Number of bytes to write.
+ * @return            true if all bytes were written, false otherwise.
+ */
+bool WriteOutputFile(OutputFile *file, const void *buffer, size_t buffer_size);
+
+/**
+ * @brief Closes a file opened with CreateOutputFile() and frees the handle.
+ *
+ * @param file  File to close. Passing NULL does nothing and returns true.
+ * @return      true if the file was closed cleanly, false otherwise.
+ */
+bool CloseOutputFile(OutputFile *file);
+
 /**
  * @brief Writes the contents of a buffer to the specified file path.
  *        Creates any missing parent directories and overwrites existing files.
@@ -127,6 +366,86 @@ char *ToLongPath(const char *path);
  */
 bool ExportFile(const char *path, const void *buffer, size_t buffer_size);
 
+/**
+ * @brief Opaque handle to a directory that entries can be created in by
+ *        name, without resolving and checking its path again.
+ *
+ * On POSIX it holds an open descriptor, so creating a file in it is a
+ * single openat(); past a fixed number of open directories, and on
+ * Windows, it falls back to the directory's path. Handles are created and
+ * closed by one thread, but may be used to create files from any thread.
+ */
+typedef struct DirHandle DirHandle;
+
+/**
+ * @brief Opens an existing directory.
+ *
+ * @param path  Path of the directory.
+ * @return      A new DirHandle on success, or NULL on failure.
+ */
+DirHandle *OpenDirHandle(const char *path);
+
+/**
+ * @brief Creates a subdirectory, or accepts an existing one, and opens it.
+ *
+ * @param parent  Directory to create it in; must not be NULL.
+ * @param name    Single path component naming the subdirectory.
+ * @return        A new DirHandle on success, or NULL on failure (also
+ *                when @p name exists but is not a directory).
+ */
+DirHandle *CreateSubdirHandle(const DirHandle *parent, const char *name);
+
+/**
+ * @brief Closes a directory handle. Passing NULL does nothing.
+ */
+void CloseDirHandle(DirHandle *dir);
+
+/**
+ * @brief Returns the path of the directory, or NULL if @p dir is NULL.
+ */
+const char *GetDirHandlePath(const DirHandle *dir);
+
+#ifndef _WIN32
+/**
+ * @brief Returns the descriptor of the directory, or -1 if it is only
+ *        addressed by path.
+ */
+int GetDirHandleFd(const DirHandle *dir);
+#endif
+
+/**
+ * @brief Creates (or truncates) a file for writing in a directory.
+ *
+ * @param dir   Directory to create the file in; must exist.
+ * @param name  Single path component naming the file.
+ * @return      A new OutputFile on success, or NULL on failure.
+ */
+OutputFile *CreateOutputFileAt(const DirHandle *dir, const char *name);
+
+/**
+ * @brief Writes the contents of a buffer to a file in a directory,
+ *        overwriting an existing file.
+ *
+ * @param dir         Directory to create the file in; must exist.
+ * @param name        Single path component naming the file.
+ * @param buffer      Data to write. May be NULL only if buffer_size is 0.
+ * @param buffer_size Size of the data buffer in bytes.
+ * @return            true if the write succeeded, false otherwise.
+ */
+bool ExportFileAt(const DirHandle *dir, const char *name, const void *buffer, size_t buffer_size);
+
+#ifndef _WIN32
+/**
+ * @brief Creates a symbolic link in a directory.
+ *
+ * @param dir     Directory to create the link in; must exist.
+ * @param name    Single path component naming the link.
+ * @param target  Target the link points to.
+ * @return        true on success, false otherwise.
+ */
+bool CreateSymlinkAt(const DirHandle *dir, const char *name, const char *target);
+#endif
+
 /**
  * @brief Opaque handle to a memory-mapped file region.
  *
@@ -177,6 +496,47 @@ void *GetMemoryMapBase(const MemoryMap *map);
  */
 size_t GetMemoryMapSize(const MemoryMap *map);
 
+/**
+ * @brief Writes a file in a directory whose contents lie in a mapped file.
+ *
+ * Where the kernel supports it (Linux), the data is not copied through
+ * memory: the range is shared with FICLONERANGE on copy-on-write
+ * filesystems such as btrfs and XFS when its offset in the mapped file is
+ * block aligned, and copied inside the kernel with copy_file_range
+ * otherwise. Whatever the kernel does not copy is written from the
+ * mapping, as ExportFileAt() would.
+ *
+ * @param dir   Directory to create the file in; must exist.
+ * @param name  Single path component naming the file.
+ * @param map   Mapping @p data points into.
+ * @param data  Start of the contents within the mapping.
+ * @param size  Size of the contents in bytes.
+ * @return      true if the file was written, false otherwise.
+ */
+bool ExportMappedFileAt(const DirHandle *dir, const char *name,
+                        const MemoryMap *map, const void *data, size_t size);
+
+/**
+ * @brief Creates a file with the same contents as an existing, completely
+ *        written one: a hard link where the file system allows it, a copy
+ *        otherwise.
+ *
+ * @param src_dir   Directory of the existing file.
+ * @param src_name  Name of the existing file within @p src_dir.
+ * @param dir       Directory to create the new file in.
+ * @param name      Name of the new file within @p dir.
+ * @return          true on success, false otherwise.
+ */
+bool DuplicateFileAt(const DirHandle *src_dir, const char *src_name,
+                     const DirHandle *dir, const char *name);
+
+/**
+ * @brief Returns the number of processors available to this process.
+ *
+ * @return The number of online processors, at least 1.
+ */
+size_t GetProcessorCount(void);
+
 /**
  * @brief Initialize signal and control handling.
  *
@@ -221,3 +581,53 @@ bool SetEnvVar(const char *name, const char *value);
  *   code retrieved; false otherwise.
  */
 bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code);
+
+/**
+ * @brief Opaque handle to a process started by StartProcess().
+ */
+typedef struct ChildProcess ChildProcess;
+
+/**
+ * @brief Launches the specified application with given arguments without
+ *        waiting for it.
+ *
+ * @param app_name  Path of the executable to run.
+ * @param argv      NULL-terminated array of argument strings.
+ * @return
+ *   A handle to pass to WaitForProcess(); NULL if the process could not be
+ *   created.
+ */
+ChildProcess *StartProcess(const char *app_name, char *argv[]);
+
+/**
+ * @brief Waits for a process started by StartProcess() to finish,
+ *        retrieves its exit code and frees the handle.
+ *
+ * @return
+ *   True if the process was waited on and its exit code retrieved; false
+ *   otherwise.
+ */
+bool WaitForProcess(ChildProcess *child, int *exit_code);
+
+/**
+ * @brief Tells whether ReplaceProcess() is available: true on POSIX,
+ *        false on Windows, including APE stubs running there.
+ */
+bool CanReplaceProcess(void);
+
+/**
+ * @brief Replaces the current process image with the specified application
+ *        (execv), so it keeps this process's pid and receives its signals
+ *        directly.
+ *
+ * SIGINT and SIGTERM, ignored by the stub, are reset to their defaults
+ * first. Descriptors without close-on-exec are inherited, as they would be
+ * by a child process.
+ *
+ * @param app_name  Path of the executable to run.
+ * @param argv      NULL-terminated array of argument strings.
+ * @return
+ *   Does not return on success; false if the application could not be
+ *   executed or the platform has no exec.
+ */
+bool ReplaceProcess(const char *app_name, char *argv[]);
@@ -7,18 +7,32 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <signal.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#if defined(__linux__) && !defined(__COSMOPOLITAN__)
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>   /* FICLONERANGE */
+#include <linux/sched.h> /* CLONE_NEWNS, CLONE_NEWUSER */
+#endif
 #include "error.h"
 #include "system_utils.h"
+#include "worker_pool.h"
+#include "trace.h"
 
 /* Opaque handle for memory-mapped files */
 struct MemoryMap {
@@ -248,6 +262,177 @@ bool CreateDirectoriesRecursively(const char *dir) {
     return true;
 }
 
+/*
+ * Parallel removal of a directory tree. Every directory is a job that
+ * unlinks the non-directory entries through its own descriptor
+ * (unlinkat, d_type instead of a stat where the filesystem reports it)
+ * and queues a job per subdirectory. The directories themselves are
+ * removed bottom-up once every job has finished, since a directory can
+ * only go when all its children have.
+ *
+ * Subdirectories are only ever opened relative to the descriptor of their
+ * parent with O_NOFOLLOW and removed with unlinkat, never by full path, so
+ * a directory swapped for a symbolic link during the walk cannot redirect
+ * it out of the tree.
+ */
+
+// Threads removing a tree; more only contend for the same directory locks
+#define MAX_DELETE_THREADS 8
+
+// Queued directory jobs, each holding an open descriptor; beyond this the
+// scanning job descends itself, which only holds one per level
+#define MAX_DELETE_QUEUED_DIRS 256
+
+typedef struct DeleteTree {
+    WorkerPool *pool;
+    size_t      queued;            // jobs holding a descriptor, atomic
+} DeleteTree;
+
+typedef struct DeleteNode {
+    char              *name;       // name in the parent directory
+    int                fd;         // open until the node's job has run
+    struct DeleteNode *children;   // written only by the node's own job
+    struct DeleteNode *next;       // sibling
+    DeleteTree        *tree;
+} DeleteNode;
+
+static bool delete_dir_entries(void *arg);
+
+static bool delete_queued_dir(void *arg)
+{
+    DeleteNode *node = arg;
+    delete_dir_entries(node);
+    __atomic_sub_fetch(&node->tree->queued, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void delete_subdir(DeleteNode *parent, int parent_fd, const char *name)
+{
+    DeleteNode *child = calloc(1, sizeof(*child));
+    if (!child) {
+        FATAL("DeleteRecursively: memory allocation failed");
+        return;
+    }
+    child->name = strdup(name);
+    if (!child->name) {
+        FATAL("DeleteRecursively: memory allocation failed");
+        free(child);
+        return;
+    }
+    child->fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (child->fd < 0) {
+        FATAL("DeleteRecursively: openat(\"%s\") failed: %s", name, strerror(errno));
+        free(child->name);
+        free(child);
+        return;
+    }
+    child->tree = parent->tree;
+    child->next = parent->children;
+    parent->children = child;
+
+    /* Without a pool, once it stopped taking jobs, or with too many
+       descriptors queued already, recurse directly */
+    DeleteTree *tree = child->tree;
+    if (tree->pool) {
+        size_t queued = __atomic_add_fetch(&tree->queued, 1, __ATOMIC_RELAXED);
+        if (queued <= MAX_DELETE_QUEUED_DIRS
+            && SubmitWorkerJob(tree->pool, delete_queued_dir, child, 0)) {
+            return;
+        }
+        __atomic_sub_fetch(&tree->queued, 1, __ATOMIC_RELAXED);
+    }
+    delete_dir_entries(child);
+}
+
+// Unlinks the entries of the node's directory and closes its descriptor.
+static bool delete_dir_entries(void *arg)
+{
+    DeleteNode *node = arg;
+
+    int fd = node->fd;
+    node->fd = -1;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        FATAL("DeleteRecursively: fdopendir(\"%s\") failed: %s", node->name, strerror(errno));
+        close(fd);
+        return true;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        bool is_dir = false;
+#ifdef DT_DIR
+        if (entry->d_type == DT_DIR) {
+            is_dir = true;
+        } else if (entry->d_type == DT_UNKNOWN)
+#endif
+        {
+            struct stat st;
+            is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                     && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir) {
+            delete_subdir(node, fd, name);
+        } else if (unlinkat(fd, name, 0) < 0) {
+            FATAL("DeleteRecursively: unlink(\"%s/%s\") failed: %s", node->name, name, strerror(errno));
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
+// Frees a list of sibling nodes and everything below them.
+static void free_delete_nodes(DeleteNode *node)
+{
+    while (node) {
+        DeleteNode *next = node->next;
+        free_delete_nodes(node->children);
+        free(node->name);
+        free(node);
+        node = next;
+    }
+}
+
+// Removes the subdirectories of node, whose directory is open as fd,
+// children first, and frees their nodes. A directory left non-empty by an
+// earlier failure fails its removal, and so do all its ancestors.
+static bool remove_delete_nodes(DeleteNode *node, int fd)
+{
+    bool success = true;
+    DeleteNode *child = node->children;
+    node->children = NULL;
+    while (child) {
+        DeleteNode *next = child->next;
+        bool removed = false;
+        int child_fd = openat(fd, child->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child_fd < 0) {
+            FATAL("DeleteRecursively: openat(\"%s\") failed: %s", child->name, strerror(errno));
+        } else {
+            removed = remove_delete_nodes(child, child_fd);
+            close(child_fd);
+        }
+        if (removed && unlinkat(fd, child->name, AT_REMOVEDIR) < 0) {
+            FATAL("DeleteRecursively: rmdir(\"%s\") failed: %s", child->name, strerror(errno));
+            removed = false;
+        }
+        if (!removed) {
+            success = false;
+        }
+        free_delete_nodes(child->children);
+        free(child->name);
+        free(child);
+        child = next;
+    }
+    return success;
+}
+
 bool DeleteRecursively(const char *path) {
     if (!path || !*path) {
         return false;
@@ -268,44 +453,254 @@ bool DeleteRecursively(const char *path) {
         return true;
     }
 
-    /* It's a directory, delete contents recursively */
+    int root_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (root_fd < 0) {
+        FATAL("DeleteRecursively: open(\"%s\") failed: %s", path, strerror(errno));
+        return false;
+    }
+
+    DeleteTree tree = { 0 };
+    DeleteNode root = { .name = (char *)path, .tree = &tree };
+    /* The scan closes its descriptor; the removal needs one of its own */
+    root.fd = fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    if (root.fd < 0) {
+        FATAL("DeleteRecursively: dup(\"%s\") failed: %s", path, strerror(errno));
+        close(root_fd);
+        return false;
+    }
+
+    size_t threads = GetProcessorCount();
+    if (threads > MAX_DELETE_THREADS) {
+        threads = MAX_DELETE_THREADS;
+    }
+    if (threads > 1) {
+        tree.pool = CreateWorkerPool(threads, SIZE_MAX);
+    }
+
+    delete_dir_entries(&root);
+    if (tree.pool) {
+        WaitWorkerPool(tree.pool);
+        DestroyWorkerPool(tree.pool);
+    }
+
+    bool success = remove_delete_nodes(&root, root_fd);
+    close(root_fd);
+    if (success && rmdir(path) < 0) {
+        FATAL("DeleteRecursively: rmdir(\"%s\") failed: %s", path, strerror(errno));
+        success = false;
+    }
+    return success;
+}
+
+bool RunDetached(DetachedFunc func, void *arg) {
+    if (!func) {
+        return false;
+    }
+
+#ifdef __COSMOPOLITAN__
+    /* fork() is emulated on Windows by copying the whole process */
+    if (IsWindows()) {
+        return func(arg);
+    }
+#endif
+
+    /* The intermediate child starts a new session and forks the process
+       that does the work, so the latter is reparented to init and nobody
+       waits for it. Only the short-lived intermediate child is reaped. */
+    pid_t pid = fork();
+    if (pid < 0) {
+        DEBUG("RunDetached: fork() failed: %s", strerror(errno));
+        return func(arg);
+    }
+
+    if (pid == 0) {
+        setsid();
+        pid_t worker = fork();
+        if (worker != 0) {
+            _exit(worker < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        /* Let go of stdio and every inherited descriptor, or a pipeline
+           reading the stub's output would wait for this process too. */
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        if (max_fd < 0 || max_fd > 65536) {
+            max_fd = 65536;
+        }
+#if defined(__linux__) && !defined(__COSMOPOLITAN__) && defined(SYS_close_range)
+        if (syscall(SYS_close_range, 3, ~0U, 0) == 0) {
+            max_fd = 0;
+        }
+#endif
+        for (int fd = 3; fd < max_fd; fd++) {
+            close(fd);
+        }
+
+        _exit(func(arg) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0) {
+        if (errno != EINTR) {
+            DEBUG("RunDetached: waitpid failed: %s", strerror(errno));
+            return false;
+        }
+    }
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+        DEBUG("RunDetached: could not detach; running in place");
+        return func(arg);
+    }
+
+    return true;
+}
+
+static bool delete_recursively_func(void *path)
+{
+    return DeleteRecursively(path);
+}
+
+bool DeleteRecursivelyDetached(const char *path) {
+    if (!path || !*path) {
+        return false;
+    }
+
+    return RunDetached(delete_recursively_func, (void *)path);
+}
+
+bool ForEachDirEntry(const char *path, DirEntryFunc func, void *ctx) {
+    if (!path || !func) {
+        return false;
+    }
+
     DIR *dir = opendir(path);
     if (!dir) {
-        FATAL("DeleteRecursively: opendir(\"%s\") failed: %s", path, strerror(errno));
+        DEBUG("ForEachDirEntry: opendir(\"%s\") failed: %s", path, strerror(errno));
         return false;
     }
 
-    bool success = true;
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
-
-        char *child_path = JoinPath(path, entry->d_name);
-        if (!child_path) {
-            success = false;
+        if (!func(entry->d_name, ctx)) {
             break;
         }
-
-        if (!DeleteRecursively(child_path)) {
-            free(child_path);
-            success = false;
-            break;
-        }
-        free(child_path);
     }
 
     closedir(dir);
+    return true;
+}
 
-    if (success) {
-        if (rmdir(path) < 0) {
-            FATAL("DeleteRecursively: rmdir(\"%s\") failed: %s", path, strerror(errno));
-            return false;
-        }
+bool GetFileAge(const char *path, uint64_t *seconds) {
+    struct stat st;
+    if (!path || !seconds || stat(path, &st) < 0) {
+        return false;
     }
 
-    return success;
+    time_t now = time(NULL);
+    *seconds = now > st.st_mtime ? (uint64_t)(now - st.st_mtime) : 0;
+    return true;
+}
+
+uint64_t GetMonotonicTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* ===== Owner locks ===== */
+
+struct OwnerLock {
+    int fd;
+};
+
+OwnerLock *CreateOwnerLock(const char *path) {
+    if (!path) {
+        FATAL("CreateOwnerLock: path is NULL");
+        return NULL;
+    }
+
+    OwnerLock *lock = calloc(1, sizeof(*lock));
+    char *tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (!lock || !tmp) {
+        FATAL("CreateOwnerLock: memory allocation failed");
+        free(lock);
+        free(tmp);
+        return NULL;
+    }
+    strcpy(tmp, path);
+    strcat(tmp, ".XXXXXX");
+
+    /* Locked under a temporary name and then renamed, so the file is
+       never seen unlocked under its real name. */
+    lock->fd = mkstemp(tmp);
+    if (lock->fd < 0) {
+        FATAL("CreateOwnerLock: mkstemp(\"%s\") failed: %s", tmp, strerror(errno));
+        goto fail;
+    }
+    if (flock(lock->fd, LOCK_EX | LOCK_NB) < 0) {
+        FATAL("CreateOwnerLock: flock(\"%s\") failed: %s", tmp, strerror(errno));
+        goto fail;
+    }
+
+    char pid[32];
+    int len = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+    if (write(lock->fd, pid, (size_t)len) != len) {
+        DEBUG("CreateOwnerLock: failed to record the pid in \"%s\"", tmp);
+    }
+
+    if (rename(tmp, path) < 0) {
+        FATAL("CreateOwnerLock: rename(\"%s\") failed: %s", tmp, strerror(errno));
+        goto fail;
+    }
+
+    free(tmp);
+    return lock;
+
+fail:
+    if (lock->fd >= 0) {
+        close(lock->fd);
+        unlink(tmp);
+    }
+    free(lock);
+    free(tmp);
+    return NULL;
+}
+
+void ReleaseOwnerLock(OwnerLock *lock) {
+    if (!lock) {
+        return;
+    }
+    close(lock->fd);
+    free(lock);
+}
+
+bool IsOwnerLockAbandoned(const char *path) {
+    if (!path) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    /* Only a lock file of our own can make a directory ours to delete. */
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+        close(fd);
+        return false;
+    }
+
+    bool abandoned = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    close(fd);
+    return abandoned;
 }
 
 char *CreateUniqueDirectory(char *tmpl) {
@@ -322,41 +717,586 @@ char *CreateUniqueDirectory(char *tmpl) {
     return result;
 }
 
-bool ExportFile(const char *path, const void *buffer, size_t buffer_size) {
-    if (!path || !buffer) {
-        FATAL("ExportFile: path or buffer is NULL");
+bool PathExists(const char *path) {
+    struct stat st;
+    return path && stat(path, &st) == 0;
+}
+
+bool IsPrivateDirectory(const char *path) {
+    struct stat st;
+    if (!path || lstat(path, &st) < 0) {
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        DEBUG("IsPrivateDirectory: \"%s\" is not a directory", path);
+        return false;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        DEBUG("IsPrivateDirectory: \"%s\" is not private to this user", path);
+        return false;
+    }
+    return true;
+}
+
+bool CreatePrivateDirectory(const char *path) {
+    if (!path) {
+        return false;
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        DEBUG("CreatePrivateDirectory: mkdir(\"%s\") failed: %s", path, strerror(errno));
+        return false;
+    }
+    return IsPrivateDirectory(path);
+}
+
+bool IsOwnedFile(const char *path) {
+    struct stat st;
+    if (!path || lstat(path, &st) < 0) {
+        return false;
+    }
+    if (S_ISLNK(st.st_mode) || st.st_uid != geteuid()) {
+        DEBUG("IsOwnedFile: \"%s\" is not owned by this user", path);
         return false;
     }
+    return true;
+}
+
+bool RenameDirectory(const char *src, const char *dst) {
+    if (!src || !dst) {
+        FATAL("RenameDirectory: src or dst is NULL");
+        return false;
+    }
+
+    if (rename(src, dst) < 0) {
+        if (errno == EEXIST || errno == ENOTEMPTY) {
+            DEBUG("RenameDirectory: \"%s\" already exists", dst);
+        } else {
+            FATAL("RenameDirectory: rename(\"%s\", \"%s\") failed: %s", src, dst, strerror(errno));
+        }
+        return false;
+    }
+
+    return true;
+}
+
+#if defined(__linux__) && !defined(__COSMOPOLITAN__)
+// Writes text to a file of /proc such as /proc/self/uid_map in one write.
+static bool write_proc_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        DEBUG("Failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    size_t len = strlen(text);
+    bool ok = write(fd, text, len) == (ssize_t)len;
+    if (!ok) {
+        DEBUG("Failed to write %s: %s", path, strerror(errno));
+    }
+    close(fd);
+    return ok;
+}
+#endif
+
+bool MountPrivateTmpfs(const char *dir) {
+#if defined(__linux__) && !defined(__COSMOPOLITAN__)
+    if (!dir) {
+        FATAL("MountPrivateTmpfs: dir is NULL");
+        return false;
+    }
+
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    int flags = CLONE_NEWNS | (uid != 0 ? CLONE_NEWUSER : 0);
+    if (syscall(SYS_unshare, flags) < 0) {
+        DEBUG("MountPrivateTmpfs: unshare failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (uid != 0) {
+        /* setgroups must be denied before an unprivileged process may
+           write its gid_map. */
+        char map[64];
+        snprintf(map, sizeof(map), "%lu %lu 1\n", (unsigned long)uid, (unsigned long)uid);
+        if (!write_proc_file("/proc/self/uid_map", map)
+            || !write_proc_file("/proc/self/setgroups", "deny")) {
+            return false;
+        }
+        snprintf(map, sizeof(map), "%lu %lu 1\n", (unsigned long)gid, (unsigned long)gid);
+        if (!write_proc_file("/proc/self/gid_map", map)) {
+            return false;
+        }
+    }
+
+    /* Keep the mount from propagating back to the parent namespace. */
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+        DEBUG("MountPrivateTmpfs: making mounts private failed: %s", strerror(errno));
+        return false;
+    }
+    if (mount("ocran", dir, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0700") < 0) {
+        DEBUG("MountPrivateTmpfs: mounting tmpfs on %s failed: %s", dir, strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void)dir;
+    DEBUG("MountPrivateTmpfs: not supported on this platform");
+    return false;
+#endif
+}
+
+bool UnmountPrivateTmpfs(const char *dir) {
+#if defined(__linux__) && !defined(__COSMOPOLITAN__)
+    if (!dir) {
+        FATAL("UnmountPrivateTmpfs: dir is NULL");
+        return false;
+    }
+
+    if (umount2(dir, MNT_DETACH) < 0) {
+        DEBUG("UnmountPrivateTmpfs: umount2 of %s failed: %s", dir, strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void)dir;
+    return false;
+#endif
+}
+
+struct OutputFile {
+    int fd;
+};
+
+OutputFile *CreateOutputFile(const char *path) {
+    if (!path) {
+        FATAL("CreateOutputFile: path is NULL");
+        return NULL;
+    }
 
     /* Create parent directories if needed */
     char *parent = GetParentPath(path);
     if (parent && *parent) {
         if (!CreateDirectoriesRecursively(parent)) {
             free(parent);
-            return false;
+            return NULL;
         }
-        free(parent);
+    }
+    free(parent);
+
+    OutputFile *file = malloc(sizeof(*file));
+    if (!file) {
+        FATAL("CreateOutputFile: malloc failed");
+        return NULL;
     }
 
     /* Create/overwrite the file */
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-    if (fd < 0) {
-        FATAL("ExportFile: open(\"%s\") failed: %s", path, strerror(errno));
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (file->fd < 0) {
+        FATAL("CreateOutputFile: open(\"%s\") failed: %s", path, strerror(errno));
+        free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+bool WriteOutputFile(OutputFile *file, const void *buffer, size_t buffer_size) {
+    if (!file || (!buffer && buffer_size > 0)) {
+        FATAL("WriteOutputFile: file or buffer is NULL");
         return false;
     }
 
     size_t written = 0;
     while (written < buffer_size) {
-        ssize_t n = write(fd, (const char *)buffer + written, buffer_size - written);
+        ssize_t n = write(file->fd, (const char *)buffer + written, buffer_size - written);
         if (n < 0) {
-            FATAL("ExportFile: write(\"%s\") failed: %s", path, strerror(errno));
-            close(fd);
+            if (errno == EINTR) {
+                continue;
+            }
+            FATAL("WriteOutputFile: write failed: %s", strerror(errno));
             return false;
         }
         written += n;
     }
 
+    return true;
+}
+
+bool CloseOutputFile(OutputFile *file) {
+    if (!file) {
+        return true;
+    }
+
+    bool result = true;
+    if (close(file->fd) < 0) {
+        FATAL("CloseOutputFile: close failed: %s", strerror(errno));
+        result = false;
+    }
+    free(file);
+    return result;
+}
+
+bool ExportFile(const char *path, const void *buffer, size_t buffer_size) {
+    if (!path || !buffer) {
+        FATAL("ExportFile: path or buffer is NULL");
+        return false;
+    }
+
+    OutputFile *file = CreateOutputFile(path);
+    if (!file) {
+        return false;
+    }
+
+    bool written = WriteOutputFile(file, buffer, buffer_size);
+    bool closed = CloseOutputFile(file);
+    return written && closed;
+}
+
+/* ===== Directory handles ===== */
+
+// Directory descriptors kept open at once, and at most a quarter of the
+// process limit. Directories beyond this are addressed by path, leaving
+// descriptors for the files being written.
+#define MAX_OPEN_DIR_FDS 256
+
+static size_t OpenDirFds = 0;
+
+static size_t dir_fd_budget(void) {
+    static size_t budget = 0;
+
+    if (budget == 0) {
+        struct rlimit rl;
+        budget = MAX_OPEN_DIR_FDS;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+            && rl.rlim_cur / 4 < budget) {
+            budget = rl.rlim_cur / 4 ? (size_t)(rl.rlim_cur / 4) : 1;
+        }
+    }
+    return budget;
+}
+
+struct DirHandle {
+    int   fd;     // -1 when the directory is addressed by path
+    char *path;
+};
+
+/* Opens a directory as a descriptor unless the budget is used up, in which
+   case -1 is returned with errno set to 0. */
+static int open_dir_fd(int at, const char *name) {
+    if (OpenDirFds >= dir_fd_budget()) {
+        errno = 0;
+        return -1;
+    }
+
+    int fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        OpenDirFds++;
+    } else if (errno == EMFILE || errno == ENFILE) {
+        errno = 0;
+    }
+    return fd;
+}
+
+static DirHandle *new_dir_handle(int fd, char *path) {
+    DirHandle *dir = malloc(sizeof(*dir));
+    if (!dir) {
+        FATAL("DirHandle: malloc failed");
+        if (fd >= 0) {
+            close(fd);
+            OpenDirFds--;
+        }
+        free(path);
+        return NULL;
+    }
+    dir->fd = fd;
+    dir->path = path;
+    return dir;
+}
+
+/* Checks by path that a directory without a descriptor is one. */
+static bool is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+DirHandle *OpenDirHandle(const char *path) {
+    if (!path) {
+        FATAL("OpenDirHandle: path is NULL");
+        return NULL;
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        FATAL("OpenDirHandle: strdup failed");
+        return NULL;
+    }
+
+    int fd = open_dir_fd(AT_FDCWD, path);
+    if (fd < 0 && (errno != 0 || !is_directory(path))) {
+        FATAL("OpenDirHandle: \"%s\" is not an accessible directory", path);
+        free(copy);
+        return NULL;
+    }
+    return new_dir_handle(fd, copy);
+}
+
+DirHandle *CreateSubdirHandle(const DirHandle *parent, const char *name) {
+    if (!parent || !name) {
+        FATAL("CreateSubdirHandle: parent or name is NULL");
+        return NULL;
+    }
+
+    char *path = JoinPath(parent->path, name);
+    if (!path) {
+        return NULL;
+    }
+
+    int at = parent->fd >= 0 ? parent->fd : AT_FDCWD;
+    const char *rel = parent->fd >= 0 ? name : path;
+
+    if (mkdirat(at, rel, 0755) < 0 && errno != EEXIST) {
+        FATAL("CreateSubdirHandle: mkdir(\"%s\") failed: %s", path, strerror(errno));
+        free(path);
+        return NULL;
+    }
+
+    int fd = open_dir_fd(at, rel);
+    if (fd < 0 && (errno != 0 || !is_directory(path))) {
+        FATAL("CreateSubdirHandle: \"%s\" exists but is not a directory", path);
+        free(path);
+        return NULL;
+    }
+    return new_dir_handle(fd, path);
+}
+
+void CloseDirHandle(DirHandle *dir) {
+    if (!dir) {
+        return;
+    }
+    if (dir->fd >= 0) {
+        close(dir->fd);
+        OpenDirFds--;
+    }
+    free(dir->path);
+    free(dir);
+}
+
+const char *GetDirHandlePath(const DirHandle *dir) {
+    return dir ? dir->path : NULL;
+}
+
+int GetDirHandleFd(const DirHandle *dir) {
+    return dir ? dir->fd : -1;
+}
+
+OutputFile *CreateOutputFileAt(const DirHandle *dir, const char *name) {
+    if (!dir || !name) {
+        FATAL("CreateOutputFileAt: dir or name is NULL");
+        return NULL;
+    }
+
+    OutputFile *file = malloc(sizeof(*file));
+    if (!file) {
+        FATAL("CreateOutputFileAt: malloc failed");
+        return NULL;
+    }
+
+    if (dir->fd >= 0) {
+        file->fd = openat(dir->fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    } else {
+        char *path = JoinPath(dir->path, name);
+        file->fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777) : -1;
+        free(path);
+    }
+    if (file->fd < 0) {
+        FATAL("CreateOutputFileAt: open(\"%s/%s\") failed: %s", dir->path, name, strerror(errno));
+        free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+bool ExportFileAt(const DirHandle *dir, const char *name, const void *buffer, size_t buffer_size) {
+    if (!buffer && buffer_size > 0) {
+        FATAL("ExportFileAt: buffer is NULL");
+        return false;
+    }
+
+    OutputFile *file = CreateOutputFileAt(dir, name);
+    if (!file) {
+        return false;
+    }
+
+    bool written = WriteOutputFile(file, buffer, buffer_size);
+    bool closed = CloseOutputFile(file);
+    return written && closed;
+}
+
+/* Lets the kernel copy a range of the mapped file to out, sharing the
+   extents when it can. Returns the number of leading bytes copied, which
+   is less than size where the kernel gave up. */
+static size_t copy_mapped_range(int out, const MemoryMap *map, size_t offset, size_t size) {
+    size_t copied = 0;
+
+#if defined(__linux__) && !defined(__COSMOPOLITAN__)
+#ifdef FICLONERANGE
+    /* Clones cover whole blocks; the tail is copied below. */
+    size_t clone_size = size & ~(size_t)4095;
+    if ((offset & 4095) == 0 && clone_size > 0) {
+        struct file_clone_range range = {
+            .src_fd = map->fd,
+            .src_offset = offset,
+            .src_length = clone_size,
+            .dest_offset = 0,
+        };
+        if (ioctl(out, FICLONERANGE, &range) == 0) {
+            copied = clone_size;
+        }
+    }
+#endif
+#ifdef __NR_copy_file_range
+    while (copied < size) {
+        loff_t off_in = (loff_t)(offset + copied), off_out = (loff_t)copied;
+        long n = syscall(__NR_copy_file_range, map->fd, &off_in, out, &off_out,
+                         size - copied, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;   // EXDEV, ENOSYS, EINVAL...: write the rest ourselves
+        }
+        copied += (size_t)n;
+    }
+#endif
+#else
+    (void)out;
+    (void)map;
+    (void)offset;
+#endif
+    return copied < size ? copied : size;
+}
+
+bool ExportMappedFileAt(const DirHandle *dir, const char *name,
+                        const MemoryMap *map, const void *data, size_t size) {
+    if (!map || !data) {
+        FATAL("ExportMappedFileAt: map or data is NULL");
+        return false;
+    }
+
+    const char *base = map->base;
+    const char *bytes = data;
+    if (bytes < base || size > map->size || (size_t)(bytes - base) > map->size - size) {
+        FATAL("ExportMappedFileAt: data lies outside the mapping");
+        return false;
+    }
+
+    OutputFile *file = CreateOutputFileAt(dir, name);
+    if (!file) {
+        return false;
+    }
+
+    size_t copied = copy_mapped_range(file->fd, map, (size_t)(bytes - base), size);
+    DEBUG("ExportMappedFileAt: %zu of %zu bytes of \"%s\" copied by the kernel", copied, size, name);
+    bool written = true;
+    if (copied < size) {
+        if (copied > 0 && lseek(file->fd, (off_t)copied, SEEK_SET) < 0) {
+            FATAL("ExportMappedFileAt: lseek failed: %s", strerror(errno));
+            written = false;
+        } else {
+            written = WriteOutputFile(file, bytes + copied, size - copied);
+        }
+    }
+    bool closed = CloseOutputFile(file);
+    return written && closed;
+}
+
+/* Resolves an entry of a directory handle for the *at() calls: the
+   directory's descriptor and the name, or AT_FDCWD and a joined path,
+   returned in *path to be freed. */
+static int resolve_at(const DirHandle *dir, const char *name, const char **at_name, char **path) {
+    *path = NULL;
+    if (dir->fd >= 0) {
+        *at_name = name;
+        return dir->fd;
+    }
+    *path = JoinPath(dir->path, name);
+    *at_name = *path;
+    return AT_FDCWD;
+}
+
+bool DuplicateFileAt(const DirHandle *src_dir, const char *src_name,
+                     const DirHandle *dir, const char *name) {
+    if (!src_dir || !src_name || !dir || !name) {
+        FATAL("DuplicateFileAt: directory or name is NULL");
+        return false;
+    }
+
+    bool result = false;
+    const char *src_at_name, *at_name;
+    char *src_path, *path;
+    int src_at = resolve_at(src_dir, src_name, &src_at_name, &src_path);
+    int at = resolve_at(dir, name, &at_name, &path);
+    if (!src_at_name || !at_name) {
+        goto cleanup;
+    }
+
+    if (linkat(src_at, src_at_name, at, at_name, 0) == 0) {
+        result = true;
+        goto cleanup;
+    }
+    DEBUG("DuplicateFileAt: link(\"%s\") failed: %s; copying", name, strerror(errno));
+
+    /* No hard links here (e.g. FAT, or a file system boundary): copy */
+    int fd = openat(src_at, src_at_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        FATAL("DuplicateFileAt: open(\"%s/%s\") failed: %s", src_dir->path, src_name, strerror(errno));
+        goto cleanup;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        FATAL("DuplicateFileAt: fstat(\"%s/%s\") failed: %s", src_dir->path, src_name, strerror(errno));
+        close(fd);
+        goto cleanup;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
     close(fd);
+    if (data == MAP_FAILED) {
+        FATAL("DuplicateFileAt: mmap(\"%s/%s\") failed: %s", src_dir->path, src_name, strerror(errno));
+        goto cleanup;
+    }
+    result = ExportFileAt(dir, name, data ? data : "", size);
+    if (data) {
+        munmap(data, size);
+    }
+
+cleanup:
+    free(src_path);
+    free(path);
+    return result;
+}
+
+bool CreateSymlinkAt(const DirHandle *dir, const char *name, const char *target) {
+    if (!dir || !name || !target) {
+        FATAL("CreateSymlinkAt: dir, name or target is NULL");
+        return false;
+    }
+
+    int result;
+    if (dir->fd >= 0) {
+        result = symlinkat(target, dir->fd, name);
+    } else {
+        char *path = JoinPath(dir->path, name);
+        if (!path) {
+            return false;
+        }
+        result = symlink(target, path);
+        free(path);
+    }
+    if (result < 0) {
+        FATAL("CreateSymlinkAt: symlink(\"%s\", \"%s/%s\") failed: %s", target, dir->path, name, strerror(errno));
+        return false;
+    }
     return true;
 }
 
@@ -447,8 +1387,49 @@ char *GetTempDirectoryPath(void) {
     return result;
 }
 
+bool IsUsableTempDirectory(const char *dir, unsigned long long size) {
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        DEBUG("IsUsableTempDirectory: '%s' is not a directory", dir);
+        return false;
+    }
+    if (access(dir, W_OK | X_OK) != 0) {
+        DEBUG("IsUsableTempDirectory: '%s' is not writable", dir);
+        return false;
+    }
+
+    struct statvfs fs;
+    if (statvfs(dir, &fs) != 0) {
+        DEBUG("IsUsableTempDirectory: statvfs('%s') failed: %s", dir, strerror(errno));
+        return false;
+    }
+    if (fs.f_flag & ST_RDONLY) {
+        DEBUG("IsUsableTempDirectory: '%s' is mounted read-only", dir);
+        return false;
+    }
+#ifdef ST_NOEXEC
+    if (fs.f_flag & ST_NOEXEC) {
+        DEBUG("IsUsableTempDirectory: '%s' is mounted noexec", dir);
+        return false;
+    }
+#endif
+
+    unsigned long long available = (unsigned long long)fs.f_bavail * fs.f_frsize;
+    if (available < size) {
+        DEBUG("IsUsableTempDirectory: '%s' has %llu bytes free, %llu needed",
+              dir, available, size);
+        return false;
+    }
+    return true;
+}
+
 /* ===== Process and signal handling ===== */
 
+size_t GetProcessorCount(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
 bool InitializeSignalHandling(void) {
     /* On POSIX systems, the parent process ignores SIGINT and SIGTERM during
        initialization and cleanup. The child process will reset these to
@@ -493,16 +1474,27 @@ bool SetEnvVar(const char *name, const char *value) {
     return true;
 }
 
-bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code) {
-    if (!app_name || !argv || !exit_code) {
-        FATAL("CreateAndWaitForProcess: app_name, argv, or exit_code is NULL");
-        return false;
+struct ChildProcess {
+    pid_t pid;
+};
+
+ChildProcess *StartProcess(const char *app_name, char *argv[]) {
+    if (!app_name || !argv) {
+        FATAL("StartProcess: app_name or argv is NULL");
+        return NULL;
+    }
+
+    ChildProcess *child = calloc(1, sizeof(*child));
+    if (!child) {
+        FATAL("StartProcess: memory allocation failed");
+        return NULL;
     }
 
     pid_t pid = fork();
     if (pid < 0) {
-        FATAL("CreateAndWaitForProcess: fork() failed: %s", strerror(errno));
-        return false;
+        FATAL("StartProcess: fork() failed: %s", strerror(errno));
+        free(child);
+        return NULL;
     }
 
     if (pid == 0) {
@@ -516,17 +1508,33 @@ bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code)
         execv(app_name, argv);
 
         /* If we get here, execv failed */
-        FATAL("CreateAndWaitForProcess: execv(\"%s\") failed: %s", app_name, strerror(errno));
+        FATAL("StartProcess: execv(\"%s\") failed: %s", app_name, strerror(errno));
         exit(127);
     }
 
     /* Parent process */
+    TraceEnd(TRACE_RUN_SCRIPT);
+    TraceBegin(TRACE_CHILD);
+
+    child->pid = pid;
+    return child;
+}
+
+bool WaitForProcess(ChildProcess *child, int *exit_code) {
+    if (!child || !exit_code) {
+        FATAL("WaitForProcess: child or exit_code is NULL");
+        free(child);
+        return false;
+    }
 
     int wstatus;
+    pid_t pid = child->pid;
+    free(child);
     if (waitpid(pid, &wstatus, 0) < 0) {
-        FATAL("CreateAndWaitForProcess: waitpid failed: %s", strerror(errno));
+        FATAL("WaitForProcess: waitpid failed: %s", strerror(errno));
         return false;
     }
+    TraceEnd(TRACE_CHILD);
 
     if (WIFEXITED(wstatus)) {
         *exit_code = WEXITSTATUS(wstatus);
@@ -539,6 +1547,48 @@ bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code)
     return true;
 }
 
+bool CreateAndWaitForProcess(const char *app_name, char *argv[], int *exit_code) {
+    if (!app_name || !argv || !exit_code) {
+        FATAL("CreateAndWaitForProcess: app_name, argv, or exit_code is NULL");
+        return false;
+    }
+
+    ChildProcess *child = StartProcess(app_name, argv);
+    return child && WaitForProcess(child, exit_code);
+}
+
+bool CanReplaceProcess(void)
+{
+#ifdef __COSMOPOLITAN__
+    /* Cosmopolitan emulates execve on Windows by spawning the program and
+       waiting for it, which saves nothing, and the exit code would then
+       reach the native parent in the wait-status encoding that
+       COSMORUBY_WAIT_STATUS_EXIT asks for. */
+    return !IsWindows();
+#else
+    return true;
+#endif
+}
+
+bool ReplaceProcess(const char *app_name, char *argv[])
+{
+    if (!app_name || !argv) {
+        FATAL("ReplaceProcess: app_name or argv is NULL");
+        return false;
+    }
+
+    /* Ignored signals stay ignored across exec; hand the defaults over */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    fflush(NULL);
+
+    execv(app_name, argv);
+
+    FATAL("ReplaceProcess: execv(\"%s\") failed: %s", app_name, strerror(errno));
+    InitializeSignalHandling();
+    return false;
+}
+
 /* POSIX has no short-path aliases - return a plain copy. */
 char *ToLongPath(const char *path)
 {
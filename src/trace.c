@@ -0,0 +1,179 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "error.h"
+#include "system_utils.h"
+#include "trace.h"
+
+static const char *const PhaseNames[TRACE_PHASE_COUNT] = {
+    "open_pack",
+    "process_opcodes",
+    "decompress",
+    "run_script",
+    "child",
+    "delete_inst_dir",
+};
+
+static const char *const CounterNames[TRACE_COUNTER_COUNT] = {
+    "payload_bytes",
+    "unpacked_bytes",
+    "files",
+    "file_bytes",
+    "directories",
+};
+
+typedef struct {
+    bool     seen;
+    uint64_t first_start;   // relative to TraceStart
+    uint64_t started;       // of the current TraceBegin()
+    uint64_t duration;      // updated atomically
+} PhaseRecord;
+
+static char       *TracePath = NULL;   // NULL while tracing is disabled
+static uint64_t    TraceStart;
+static PhaseRecord Phases[TRACE_PHASE_COUNT];
+static uint64_t    Counters[TRACE_COUNTER_COUNT];
+
+void InitTrace(void)
+{
+    const char *path = getenv("OCRAN_TRACE");
+    if (!path || !*path) {
+        return;
+    }
+
+    TracePath = malloc(strlen(path) + 1);
+    if (!TracePath) {
+        return;
+    }
+    strcpy(TracePath, path);
+    TraceStart = GetMonotonicTime();
+}
+
+uint64_t TraceNow(void)
+{
+    return TracePath ? GetMonotonicTime() : 0;
+}
+
+static void mark_seen(PhaseRecord *record, uint64_t start)
+{
+    if (!record->seen) {
+        record->seen = true;
+        record->first_start = start - TraceStart;
+    }
+}
+
+void TraceBegin(TracePhase phase)
+{
+    if (!TracePath) {
+        return;
+    }
+
+    PhaseRecord *record = &Phases[phase];
+    record->started = GetMonotonicTime();
+    mark_seen(record, record->started);
+}
+
+void TraceEnd(TracePhase phase)
+{
+    if (!TracePath || !Phases[phase].seen) {
+        return;
+    }
+
+    PhaseRecord *record = &Phases[phase];
+    record->duration += GetMonotonicTime() - record->started;
+}
+
+void TraceAddTime(TracePhase phase, uint64_t since)
+{
+    if (!TracePath || since == 0) {
+        return;
+    }
+
+    PhaseRecord *record = &Phases[phase];
+    uint64_t elapsed = GetMonotonicTime() - since;
+    __atomic_fetch_add(&record->duration, elapsed, __ATOMIC_RELAXED);
+    /* Only the first worker to get here records the start; races merely
+       pick one of the nearly equal candidates. */
+    if (!__atomic_exchange_n(&record->seen, true, __ATOMIC_RELAXED)) {
+        record->first_start = since - TraceStart;
+    }
+}
+
+void TraceCount(TraceCounter counter, uint64_t n)
+{
+    if (!TracePath) {
+        return;
+    }
+
+    __atomic_fetch_add(&Counters[counter], n, __ATOMIC_RELAXED);
+}
+
+static void write_json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void WriteTrace(const char *image_path, int status)
+{
+    if (!TracePath) {
+        return;
+    }
+
+    FILE *out = fopen(TracePath, "a");
+    if (!out) {
+        DEBUG("Failed to open trace file %s", TracePath);
+        goto cleanup;
+    }
+
+    fprintf(out, "{\"exe\":");
+    write_json_string(out, image_path ? image_path : "");
+#ifdef _WIN32
+    fprintf(out, ",\"pid\":%lu", (unsigned long)GetCurrentProcessId());
+#else
+    fprintf(out, ",\"pid\":%ld", (long)getpid());
+#endif
+    fprintf(out, ",\"status\":%d,\"total_us\":%llu,\"phases\":{", status,
+            (unsigned long long)(GetMonotonicTime() - TraceStart));
+
+    bool first = true;
+    for (int i = 0; i < TRACE_PHASE_COUNT; i++) {
+        if (!Phases[i].seen) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"start_us\":%llu,\"duration_us\":%llu}",
+                first ? "" : ",", PhaseNames[i],
+                (unsigned long long)Phases[i].first_start,
+                (unsigned long long)Phases[i].duration);
+        first = false;
+    }
+
+    fprintf(out, "},\"counters\":{");
+    for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+        fprintf(out, "%s\"%s\":%llu", i ? "," : "", CounterNames[i],
+                (unsigned long long)Counters[i]);
+    }
+    fprintf(out, "}}\n");
+
+    if (fclose(out) != 0) {
+        DEBUG("Failed to write trace file %s", TracePath);
+    }
+
+cleanup:
+    free(TracePath);
+    TracePath = NULL;
+}
@@ -0,0 +1,78 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Phases of a run whose timing OCRAN_TRACE records.
+ *
+ * Each phase records when it first started and for how long it ran in
+ * total. TRACE_DECOMPRESS is the time spent in the block decoders, summed
+ * over all threads, so it overlaps TRACE_PROCESS_OPCODES and may exceed it
+ * when blocks are decoded in parallel.
+ */
+typedef enum {
+    TRACE_OPEN_PACK,          // OpenPackFile(): mapping and header parsing
+    TRACE_PROCESS_OPCODES,    // ProcessImage(), decoding and writing included
+    TRACE_DECOMPRESS,         // block decoding, summed over threads
+    TRACE_RUN_SCRIPT,         // RunScript() until the child is started
+    TRACE_CHILD,              // the application process running
+    TRACE_DELETE_INST_DIR,    // DeleteInstDir()
+    TRACE_PHASE_COUNT
+} TracePhase;
+
+/**
+ * @brief Quantities OCRAN_TRACE records alongside the phases.
+ */
+typedef enum {
+    TRACE_PAYLOAD_BYTES,      // size of the (possibly compressed) data
+    TRACE_UNPACKED_BYTES,     // size of the opcode stream after decoding
+    TRACE_FILES,              // OP_CREATE_FILE opcodes
+    TRACE_FILE_BYTES,         // contents of those files
+    TRACE_DIRECTORIES,        // OP_CREATE_DIRECTORY opcodes
+    TRACE_COUNTER_COUNT
+} TraceCounter;
+
+/**
+ * @brief Enables tracing if the OCRAN_TRACE environment variable names a
+ *        file. Call once, first thing in main().
+ *
+ * While tracing is disabled every other function returns at once.
+ */
+void InitTrace(void);
+
+/**
+ * @brief Returns the monotonic time in microseconds, or 0 when tracing is
+ *        disabled. Pass the result to TraceAddTime().
+ */
+uint64_t TraceNow(void);
+
+/**
+ * @brief Marks the start of a phase. Only called from the main thread.
+ */
+void TraceBegin(TracePhase phase);
+
+/**
+ * @brief Marks the end of a phase started with TraceBegin(), adding the
+ *        time since then to its duration.
+ */
+void TraceEnd(TracePhase phase);
+
+/**
+ * @brief Adds the time since @p since, a TraceNow() value, to a phase.
+ *        May be called from any thread.
+ */
+void TraceAddTime(TracePhase phase, uint64_t since);
+
+/**
+ * @brief Adds @p n to a counter. May be called from any thread.
+ */
+void TraceCount(TraceCounter counter, uint64_t n);
+
+/**
+ * @brief Appends the recorded timings and counters to the OCRAN_TRACE file
+ *        as one line of JSON.
+ *
+ * @param image_path  Path of the executable, recorded in the output; may
+ *                    be NULL.
+ * @param status      Exit status the stub is about to return.
+ */
+void WriteTrace(const char *image_path, int status);
@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #ifdef _WIN32
@@ -11,10 +12,17 @@
 #include "inst_dir.h"
 #include "script_info.h"
 #include "unpack.h"
+#include "worker_pool.h"
+#include "file_batch.h"
+#include "trace.h"
+#include "branch_filter.h"
 
 #if WITH_LZMA
 #include <LzmaDec.h>
 #endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
 
 typedef uint32_t SizeType;
 
@@ -27,15 +35,86 @@ static inline size_t get_size(const void *p)
          | ((size_t)b[3] << 24);
 }
 
+static uint64_t get_uint64(const uint8_t *b)
+{
+    return (uint64_t)get_size(b) | (uint64_t)get_size(b + 4) << 32;
+}
+
+// Width of the size fields around the opcode stream (block index, table of
+// contents, launch section), which WIDE_SIZES makes 64-bit.
+static inline size_t size_field_width(OperationModes modes)
+{
+    return IsWideSizes(modes) ? sizeof(uint64_t) : sizeof(SizeType);
+}
+
+// Reads a size field of that width. A 64-bit value beyond SIZE_MAX, which
+// only a 32-bit stub can meet, saturates so that range checks reject it.
+static size_t get_size_field(const uint8_t *b, size_t width)
+{
+    if (width == sizeof(SizeType)) {
+        return get_size(b);
+    }
+    uint64_t value = get_uint64(b);
+    return value > SIZE_MAX ? SIZE_MAX : (size_t)value;
+}
+
+// Largest string the builder writes, including the null terminator. Also
+// bounds a whole front-coded path.
+#define MAX_STRING_SIZE 0xFFFF
+
+// Longest unsigned LEB128 integer of the COMPACT_OPCODES encoding.
+#define MAX_VARINT_SIZE 10
+
+// Bytes buffered before each opcode when streaming, enough for the opcode
+// and two strings or paths in either encoding, so that no refill moves a
+// string while an opcode is still using it. Only OP_SET_SCRIPT and file
+// contents can be larger; they are read last.
+#define OPCODE_PREFETCH_SIZE (1 + 2 * (2 * MAX_VARINT_SIZE + MAX_STRING_SIZE))
+
+typedef struct UnpackReader UnpackReader;
+
+/*
+   Makes at least size bytes available at cur unless the data ends first.
+   May move the buffered bytes, which invalidates pointers returned by
+   earlier reads. Returns false on a decoding error.
+*/
+typedef bool (*FillFunc)(UnpackReader *reader, size_t size);
+
+/*
+   The path read last, which the next front-coded path shares a prefix
+   with, and the handle of a directory it lies in. The handle is kept
+   while its path is unchanged, so that files following one another in a
+   directory are created without looking the directory up.
+*/
 typedef struct {
+    char       buf[MAX_STRING_SIZE];
+    size_t     len;          // excluding the null terminator
+    DirHandle *parent;       // directory buf[0, parent_len), or NULL
+    size_t     parent_len;
+} PathDecoder;
+
+struct UnpackReader {
     const uint8_t *begin;
     const uint8_t *end;
     const uint8_t *cur;
-} UnpackReader;
+    FillFunc       fill;    // NULL when all data is in memory
+    void          *source;
+    WorkerPool    *pool;    // writes files on worker threads when set
+    FileBatch     *batch;   // writes files through io_uring when set
+    const MemoryMap *map;   // the executable, when the data lies in it
+    bool           compact; // COMPACT_OPCODES encoding
+    PathDecoder   *paths;
+};
 
 static bool read_bytes(UnpackReader *reader, size_t size, const uint8_t **ptr)
 {
     size_t avail = (size_t)(reader->end - reader->cur);
+    if (size > avail && reader->fill) {
+        if (!reader->fill(reader, size)) {
+            return false;
+        }
+        avail = (size_t)(reader->end - reader->cur);
+    }
     if (size > avail) {
         DEBUG("failed to read requested data bytes");
         return false;
@@ -46,6 +125,42 @@ static bool read_bytes(UnpackReader *reader, size_t size, const uint8_t **ptr)
     return true;
 }
 
+// Reads up to size bytes, but no more than are buffered after at most one
+// refill. Used to stream file contents of any size through the buffer.
+static bool read_chunk(UnpackReader *reader, size_t size,
+                       const uint8_t **ptr, size_t *len)
+{
+    if (reader->cur == reader->end && reader->fill) {
+        if (!reader->fill(reader, 1)) {
+            return false;
+        }
+    }
+
+    size_t avail = (size_t)(reader->end - reader->cur);
+    if (avail == 0) {
+        DEBUG("failed to read requested data bytes");
+        return false;
+    }
+
+    *len = size < avail ? size : avail;
+    *ptr = reader->cur;
+    reader->cur += *len;
+    return true;
+}
+
+// Returns true if any data is left, refilling the buffer when streaming.
+static bool has_more_data(UnpackReader *reader, bool *more)
+{
+    if (reader->cur == reader->end && reader->fill) {
+        if (!reader->fill(reader, 1)) {
+            return false;
+        }
+    }
+
+    *more = reader->cur < reader->end;
+    return true;
+}
+
 static bool read_integer(UnpackReader *reader, size_t *size);
 
 static bool read_string(UnpackReader *reader, const char **str)
@@ -61,6 +176,11 @@ static bool read_string(UnpackReader *reader, const char **str)
         return false;
     }
 
+    if (len > MAX_STRING_SIZE) {
+        DEBUG("string size exceeds %u bytes", MAX_STRING_SIZE);
+        return false;
+    }
+
     const uint8_t *bytes;
     if (!read_bytes(reader, len, &bytes)) {
         DEBUG("failed to read string data");
@@ -76,8 +196,45 @@ static bool read_string(UnpackReader *reader, const char **str)
     return true;
 }
 
+// Decodes an unsigned LEB128 integer from the avail bytes at p. Returns
+// its length, or 0 if it is truncated or does not fit in a size_t.
+static size_t decode_varint(const uint8_t *p, size_t avail, size_t *value)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < avail && i < MAX_VARINT_SIZE; i++) {
+        size_t bits = p[i] & 0x7F;
+        unsigned shift = 7 * (unsigned)i;
+        if (bits) {
+            if (shift >= sizeof(size_t) * 8 || bits > (SIZE_MAX >> shift)) {
+                return 0;
+            }
+            result |= bits << shift;
+        }
+        if (!(p[i] & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
 static bool read_integer(UnpackReader *reader, size_t *size)
 {
+    if (reader->compact) {
+        if ((size_t)(reader->end - reader->cur) < MAX_VARINT_SIZE
+            && reader->fill && !reader->fill(reader, MAX_VARINT_SIZE)) {
+            return false;
+        }
+        size_t len = decode_varint(reader->cur,
+                                   (size_t)(reader->end - reader->cur), size);
+        if (len == 0) {
+            DEBUG("failed to read integer value");
+            return false;
+        }
+        reader->cur += len;
+        return true;
+    }
+
     const uint8_t *b;
     if (!read_bytes(reader, sizeof(SizeType), &b)) {
         DEBUG("failed to read integer value");
@@ -88,6 +245,90 @@ static bool read_integer(UnpackReader *reader, size_t *size)
     return true;
 }
 
+/*
+   Reads a path into the reader's PathDecoder and returns it, valid until
+   the next path is read. A COMPACT_OPCODES path is the length of the
+   prefix it shares with the previous one, followed by the rest as a
+   string. Only the components from the last one of the shared prefix on
+   are checked with IsCleanRelativePath(); those before it were checked
+   with the previous path.
+*/
+static bool read_path(UnpackReader *reader, const char **path)
+{
+    PathDecoder *paths = reader->paths;
+    size_t shared = 0;
+    if (reader->compact && !read_integer(reader, &shared)) {
+        DEBUG("failed to read shared path length");
+        return false;
+    }
+    if (shared > paths->len) {
+        DEBUG("shared path length exceeds the previous path");
+        return false;
+    }
+
+    const char *suffix;
+    if (!read_string(reader, &suffix)) {
+        return false;
+    }
+    /* read_string() checked the terminator, but the length must also
+       match for the prefix to be shared with the next path. */
+    size_t suffix_size = (size_t)(reader->cur - (const uint8_t *)suffix);
+    if (memchr(suffix, '\0', suffix_size - 1)) {
+        DEBUG("path contains a null character");
+        return false;
+    }
+    if (shared + suffix_size > MAX_STRING_SIZE) {
+        DEBUG("path exceeds %u bytes", MAX_STRING_SIZE);
+        return false;
+    }
+    memcpy(paths->buf + shared, suffix, suffix_size);
+    paths->len = shared + suffix_size - 1;
+
+    if (shared < paths->parent_len) {
+        paths->parent = NULL;
+    }
+
+    size_t start = shared;
+    while (start > 0 && !is_path_separator(paths->buf[start - 1])) {
+        start--;
+    }
+    if (!IsCleanRelativePath(paths->buf + start)) {
+        APP_ERROR("invalid relative path '%s'", paths->buf);
+        return false;
+    }
+
+    *path = paths->buf;
+    return true;
+}
+
+/*
+   Returns the directory the path read last lies in, creating it if
+   needed, and its file name in *name.
+*/
+static DirHandle *get_path_parent(UnpackReader *reader, const char **name)
+{
+    PathDecoder *paths = reader->paths;
+    size_t name_start = paths->len;
+    while (name_start > 0 && !is_path_separator(paths->buf[name_start - 1])) {
+        name_start--;
+    }
+    if (name_start == paths->len) {
+        APP_ERROR("relative path '%s' has no file name", paths->buf);
+        return NULL;
+    }
+    size_t parent_len = name_start;
+    while (parent_len > 0 && is_path_separator(paths->buf[parent_len - 1])) {
+        parent_len--;
+    }
+
+    *name = paths->buf + name_start;
+    if (!paths->parent || paths->parent_len != parent_len) {
+        paths->parent = GetDirUnderInstDir(paths->buf, parent_len);
+        paths->parent_len = parent_len;
+    }
+    return paths->parent;
+}
+
 static bool read_opcode(UnpackReader *reader, Opcode *opcode)
 {
     const uint8_t *b;
@@ -100,6 +341,252 @@ static bool read_opcode(UnpackReader *reader, Opcode *opcode)
     return true;
 }
 
+// Default and upper limit of the number of extraction threads, which can
+// be set with the OCRAN_EXTRACT_THREADS environment variable.
+#define MAX_EXTRACT_THREADS 64
+
+// Decoded files up to this size are copied and written on a worker
+// thread; larger ones are written by the decoding thread as they stream
+// in, where write bandwidth rather than syscall latency dominates.
+#define MAX_ASYNC_FILE_SIZE (4 * 1024 * 1024)
+
+// Files stored uncompressed from this size on are copied from the
+// executable by the kernel instead of through memory. The builder aligns
+// them to a page so that copy-on-write filesystems can share the blocks.
+#define MAPPED_COPY_MIN_SIZE (64 * 1024)
+
+// Upper bound of the decoded file data waiting for worker threads.
+#define MAX_PENDING_FILE_DATA (32 * 1024 * 1024)
+
+typedef struct {
+    DirHandle  *dir;      // cached parent directory, see GetParentUnderInstDir()
+    char       *name;
+    const void *data;
+    size_t      size;
+    void       *buffer;   // copy of the data owned by the job, if any
+    const MemoryMap *map; // set when data lies in the mapped executable
+    BranchFilter filter;  // conversion to reverse in buffer first, or 0
+} FileJob;
+
+static bool run_file_job(void *arg)
+{
+    FileJob *job = arg;
+    if (job->filter) {
+        UnfilterBranches(job->filter, job->buffer, job->size);
+    }
+    bool ok = job->map
+              ? ExportMappedFileAt(job->dir, job->name, job->map, job->data,
+                                   job->size)
+              : ExportFileAt(job->dir, job->name, job->data, job->size);
+    if (!ok) {
+        APP_ERROR("Failed to export file: %s", job->name);
+    }
+    free(job->name);
+    free(job->buffer);
+    free(job);
+    return ok;
+}
+
+// Returns a copy of the next size bytes of file contents, which the
+// caller frees.
+static void *read_file_copy(UnpackReader *reader, size_t size)
+{
+    uint8_t *buffer = malloc(size ? size : 1);
+    if (!buffer) {
+        APP_ERROR("Memory allocation failed for file data");
+        return NULL;
+    }
+    for (size_t copied = 0; copied < size; ) {
+        const uint8_t *bytes;
+        size_t len;
+        if (!read_chunk(reader, size - copied, &bytes, &len)) {
+            free(buffer);
+            return NULL;
+        }
+        memcpy(buffer + copied, bytes, len);
+        copied += len;
+    }
+    return buffer;
+}
+
+/*
+   Queues an OP_CREATE_FILE for io_uring or a worker thread. Data held in memory for
+   the whole extraction (the mapped executable) is referenced, streamed
+   data is copied. Large files stored in the executable are copied from it
+   by the kernel, on a worker thread if there is one. Returns false with
+   *queued unset when the file has to be written synchronously instead.
+*/
+static bool queue_file(UnpackReader *reader, DirHandle *dir, const char *name,
+                       size_t size, bool *queued)
+{
+    *queued = false;
+    if (reader->fill && size > MAX_ASYNC_FILE_SIZE) {
+        return true;
+    }
+
+    FileJob *job = calloc(1, sizeof(*job));
+    if (!job) {
+        APP_ERROR("Memory allocation failed for file job");
+        return false;
+    }
+
+    job->dir = dir;
+    job->name = strdup(name);
+    if (!job->name) {
+        APP_ERROR("Memory allocation failed for file job");
+        free(job);
+        return false;
+    }
+    job->size = size;
+
+    const uint8_t *bytes;
+    size_t cost = 0;
+    if (!reader->fill) {
+        if (!read_bytes(reader, size, &bytes)) {
+            goto error;
+        }
+        job->data = bytes;
+    } else {
+        job->buffer = read_file_copy(reader, size);
+        if (!job->buffer) {
+            goto error;
+        }
+        job->data = job->buffer;
+        cost = size;
+    }
+
+    if (reader->map && size >= MAPPED_COPY_MIN_SIZE) {
+        /* Copied by the kernel from the executable, never through io_uring
+           writes that would fault the mapping in. */
+        job->map = reader->map;
+        if (!reader->pool) {
+            bool ok = run_file_job(job);
+            *queued = ok;
+            return ok;
+        }
+    } else if (reader->batch) {
+        /* The batch takes over the name and the copy. */
+        *queued = AddFileToBatch(reader->batch, job->dir, job->name,
+                                 job->data, job->size, job->buffer);
+        free(job);
+        return *queued;
+    }
+
+    if (!SubmitWorkerJob(reader->pool, run_file_job, job, cost)) {
+        goto error;
+    }
+    *queued = true;
+    return true;
+
+error:
+    free(job->name);
+    free(job->buffer);
+    free(job);
+    return false;
+}
+
+/*
+   Writes the file of an OP_CREATE_FILTERED_FILE. Its contents are always
+   copied, since the conversion is reversed in place, on a worker thread if
+   there is one.
+*/
+static bool create_filtered_file(UnpackReader *reader, DirHandle *dir,
+                                 const char *name, size_t size,
+                                 BranchFilter filter)
+{
+    FileJob *job = calloc(1, sizeof(*job));
+    if (!job) {
+        APP_ERROR("Memory allocation failed for file job");
+        return false;
+    }
+
+    job->dir = dir;
+    job->name = strdup(name);
+    job->buffer = job->name ? read_file_copy(reader, size) : NULL;
+    if (!job->buffer) {
+        APP_ERROR("Failed to read file: %s", name);
+        free(job->name);
+        free(job);
+        return false;
+    }
+    job->data = job->buffer;
+    job->size = size;
+    job->filter = filter;
+
+    if (reader->pool) {
+        if (SubmitWorkerJob(reader->pool, run_file_job, job, size)) {
+            return true;
+        }
+        free(job->name);
+        free(job->buffer);
+        free(job);
+        return false;
+    }
+
+    if (reader->batch) {
+        UnfilterBranches(filter, job->buffer, size);
+        /* The batch takes over the name and the copy. */
+        bool ok = AddFileToBatch(reader->batch, job->dir, job->name,
+                                 job->data, job->size, job->buffer);
+        free(job);
+        return ok;
+    }
+
+    return run_file_job(job);
+}
+
+// Function and argument of ProcessImage() to run at OP_LAUNCH, cleared
+// once it has run.
+static LaunchFunc Launch = NULL;
+static void *LaunchArg = NULL;
+
+/*
+   Runs the launch function once every file before OP_LAUNCH is complete:
+   those still queued for worker threads or io_uring, and the duplicates
+   waiting for their sources.
+*/
+static bool launch_application(UnpackReader *reader)
+{
+    LaunchFunc launch = Launch;
+    Launch = NULL;
+    if (!launch) {
+        DEBUG("OP_LAUNCH: ignored");
+        return true;
+    }
+
+    if (reader->batch && !WaitFileBatch(reader->batch)) {
+        APP_ERROR("Failed to write extracted files");
+        return false;
+    }
+    if (reader->pool && !WaitWorkerPool(reader->pool)) {
+        APP_ERROR("Failed to write extracted files");
+        return false;
+    }
+    if (!CompleteFileDuplicates()) {
+        return false;
+    }
+    return launch(LaunchArg);
+}
+
+// Creates the directory read last by read_path(), which files usually
+// follow, so it becomes the cached parent.
+static bool create_path_directory(UnpackReader *reader)
+{
+    PathDecoder *paths = reader->paths;
+    size_t len = paths->len;
+    while (len > 0 && is_path_separator(paths->buf[len - 1])) {
+        len--;
+    }
+
+    DirHandle *dir = GetDirUnderInstDir(paths->buf, len);
+    if (!dir) {
+        return false;
+    }
+    paths->parent = dir;
+    paths->parent_len = len;
+    return true;
+}
+
 static bool process_opcode(UnpackReader *reader, Opcode opcode)
 {
     const char *name, *value;
@@ -108,26 +595,80 @@ static bool process_opcode(UnpackReader *reader, Opcode opcode)
 
     switch (opcode) {
         case OP_CREATE_DIRECTORY: {
-            if (!read_string(reader, &name)) {
+            if (!read_path(reader, &name)) {
                 return false;
             }
             DEBUG("OP_CREATE_DIRECTORY: path='%s'", name);
-            return CreateDirectoryUnderInstDir(name);
+            TraceCount(TRACE_DIRECTORIES, 1);
+            return create_path_directory(reader);
         }
 
         case OP_CREATE_FILE: {
-            if (!read_string(reader, &name)) {
+            if (!read_path(reader, &name)) {
                 return false;
             }
             if (!read_integer(reader, &size)) {
                 return false;
             }
-            if (!read_bytes(reader, size, &bytes)) {
+            DEBUG("OP_CREATE_FILE: path='%s' (%zu bytes)", name, size);
+            TraceCount(TRACE_FILES, 1);
+            TraceCount(TRACE_FILE_BYTES, size);
+            const char *base;
+            DirHandle *dir = get_path_parent(reader, &base);
+            if (!dir) {
                 return false;
             }
-            const void *data = bytes;
-            DEBUG("OP_CREATE_FILE: path='%s' (%zu bytes)", name, size);
-            return ExportFileToInstDir(name, data, size);
+            if (reader->pool || reader->batch
+                || (reader->map && size >= MAPPED_COPY_MIN_SIZE)) {
+                bool queued;
+                if (!queue_file(reader, dir, base, size, &queued)) {
+                    return false;
+                }
+                if (queued) {
+                    return true;
+                }
+            }
+            OutputFile *file = CreateOutputFileAt(dir, base);
+            if (!file) {
+                APP_ERROR("Failed to create file: %s", name);
+                return false;
+            }
+            /* Write the contents as they are decoded */
+            bool ok = true;
+            while (ok && size > 0) {
+                size_t len = 0;
+                ok = read_chunk(reader, size, &bytes, &len)
+                     && WriteOutputFile(file, bytes, len);
+                size -= len;
+            }
+            return CloseOutputFile(file) && ok;
+        }
+
+        case OP_CREATE_FILTERED_FILE: {
+            if (!read_path(reader, &name)) {
+                return false;
+            }
+            if (!read_integer(reader, &size)) {
+                return false;
+            }
+            if (!read_bytes(reader, 1, &bytes)) {
+                return false;
+            }
+            BranchFilter filter = (BranchFilter)bytes[0];
+            if (!IsBranchFilter(filter)) {
+                APP_ERROR("Unknown branch filter %d for '%s'", filter, name);
+                return false;
+            }
+            DEBUG("OP_CREATE_FILTERED_FILE: path='%s' (%zu bytes, filter %d)",
+                  name, size, filter);
+            TraceCount(TRACE_FILES, 1);
+            TraceCount(TRACE_FILE_BYTES, size);
+            const char *base;
+            DirHandle *dir = get_path_parent(reader, &base);
+            if (!dir) {
+                return false;
+            }
+            return create_filtered_file(reader, dir, base, size, filter);
         }
 
         case OP_SETENV: {
@@ -154,7 +695,7 @@ static bool process_opcode(UnpackReader *reader, Opcode opcode)
         }
 
         case OP_CREATE_SYMLINK: {
-            if (!read_string(reader, &name)) {
+            if (!read_path(reader, &name)) {
                 return false;
             }
             if (!read_string(reader, &value)) {
@@ -169,6 +710,45 @@ static bool process_opcode(UnpackReader *reader, Opcode opcode)
 #endif
         }
 
+        case OP_DUPLICATE_FILE: {
+            if (!read_path(reader, &name)) {
+                return false;
+            }
+            /* Reading the source path reuses the buffer */
+            char *target = strdup(name);
+            if (!target) {
+                APP_ERROR("Memory allocation failed for path");
+                return false;
+            }
+            bool ok = read_path(reader, &value);
+            if (ok) {
+                DEBUG("OP_DUPLICATE_FILE: path='%s', source='%s'", target, value);
+                TraceCount(TRACE_FILES, 1);
+                ok = DuplicateFileUnderInstDir(target, value);
+            }
+            free(target);
+            return ok;
+        }
+
+        case OP_LAUNCH: {
+            DEBUG("OP_LAUNCH");
+            return launch_application(reader);
+        }
+
+        case OP_PADDING: {
+            if (!read_integer(reader, &size)) {
+                return false;
+            }
+            while (size > 0) {
+                size_t len = 0;
+                if (!read_chunk(reader, size, &bytes, &len)) {
+                    return false;
+                }
+                size -= len;
+            }
+            return true;
+        }
+
         default: {
             DEBUG("Invalid opcode: %d", opcode);
             return false;
@@ -179,107 +759,739 @@ static bool process_opcode(UnpackReader *reader, Opcode opcode)
     return false;
 }
 
-static bool process_opcodes(const void *data, size_t data_size)
+static bool process_opcodes(UnpackReader *reader)
 {
-    UnpackReader reader = {
-        .begin = (const uint8_t *)data,
-        .cur   = (const uint8_t *)data,
-        .end   = (const uint8_t *)data + data_size
-    };
     Opcode opcode;
+    bool more;
+    bool ok = false;
 
-    while (reader.cur < reader.end) {
-        if (!read_opcode(&reader, &opcode)) {
-            return false;
+    reader->paths = calloc(1, sizeof(*reader->paths));
+    if (!reader->paths) {
+        APP_ERROR("Memory allocation failed for path decoder");
+        return false;
+    }
+
+    for (;;) {
+        if (!has_more_data(reader, &more)) {
+            goto cleanup;
         }
-        if (!process_opcode(&reader, opcode)) {
-            return false;
+        if (!more) {
+            break;
+        }
+        if (reader->fill
+            && (size_t)(reader->end - reader->cur) < OPCODE_PREFETCH_SIZE
+            && !reader->fill(reader, OPCODE_PREFETCH_SIZE)) {
+            goto cleanup;
+        }
+        if (!read_opcode(reader, &opcode)) {
+            goto cleanup;
+        }
+        if (!process_opcode(reader, opcode)) {
+            goto cleanup;
         }
     }
-    return true;
+    ok = true;
+
+cleanup:
+    free(reader->paths);
+    reader->paths = NULL;
+    return ok;
 }
 
-#if WITH_LZMA
-#define LZMA_UNPACKSIZE_SIZE 8
-#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
-#define LZMA_SIZET_MAX ((SizeT)-1)
+static bool process_opcodes_in_memory(const void *data, size_t data_size,
+                                      const MemoryMap *map, WorkerPool *pool,
+                                      FileBatch *batch, OperationModes modes)
+{
+    UnpackReader reader = {
+        .begin   = (const uint8_t *)data,
+        .cur     = (const uint8_t *)data,
+        .end     = (const uint8_t *)data + data_size,
+        .fill    = NULL,
+        .source  = NULL,
+        .pool    = pool,
+        .batch   = batch,
+        .map     = map,
+        .compact = IsCompactOpcodes(modes)
+    };
 
-void *SzAlloc(const ISzAlloc *p, size_t size) { p = p; return malloc(size); }
-void SzFree(const ISzAlloc *p, void *address) { p = p; free(address); }
-ISzAlloc alloc = { SzAlloc, SzFree };
+    return process_opcodes(&reader);
+}
+
+#if WITH_LZMA || WITH_ZSTD
+/*
+   Compressed data is a sequence of independently compressed blocks
+   followed by the block index:
+   [block 0]...[block n-1]
+   [compressed size 0][unpacked size 0]...[compressed size n-1][unpacked size n-1]
+   [n]
+   Concatenating the unpacked blocks yields the opcode stream; block
+   boundaries fall anywhere in it. The codec of the blocks is given by the
+   DATA_ZSTD mode.
+*/
+typedef struct {
+    const uint8_t *src;
+    size_t         src_size;
+    size_t         size;
+} BlockEntry;
 
-static bool decompress_lzma(void *dest, unsigned long long dest_size,
-                            const void *src, size_t src_size)
+typedef struct {
+    BlockEntry *entries;
+    size_t      count;
+} BlockIndex;
+
+/*
+   A block codec decodes blocks either one after another through a
+   streaming reader, or each block as a whole into a buffer of its unpacked
+   size, which is what the worker threads do.
+*/
+typedef struct {
+    const char *name;
+    bool (*process_stream)(const BlockIndex *index, WorkerPool *pool,
+                           FileBatch *batch, OperationModes modes);
+    bool (*decode_block)(const BlockEntry *entry, uint8_t *out);
+} BlockCodec;
+
+static bool parse_block_index(const void *data, size_t data_size,
+                              OperationModes modes, BlockIndex *index)
 {
-    SizeT decompressed_size = (SizeT)dest_size;
-    SizeT inSizePure = src_size - LZMA_HEADER_SIZE;
-    ELzmaStatus status;
+    const uint8_t *begin = data;
+    const uint8_t *p = begin + data_size;
+    size_t width = size_field_width(modes);
 
-    SRes res = LzmaDecode((Byte *)dest, &decompressed_size,
-                          (Byte *)src + LZMA_HEADER_SIZE, &inSizePure,
-                          (Byte *)src, LZMA_PROPS_SIZE,
-                          LZMA_FINISH_END, &status, &alloc);
+    index->entries = NULL;
+    index->count = 0;
 
-    if (res != SZ_OK || status != LZMA_STATUS_FINISHED_WITH_MARK) {
-        APP_ERROR("LZMA decompression error: %d, status: %d", res, status);
+    if (data_size < width) {
+        APP_ERROR("Block index is truncated");
         return false;
     }
-    return true;
-}
+    p -= width;
+    size_t count = get_size_field(p, width);
 
-static unsigned long long parse_lzma_unpack_size(const void *data)
-{
-    const Byte *size_bytes = (const Byte *)data + LZMA_PROPS_SIZE;
-    unsigned long long size64 = 0;
-    for (int i = 0; i < LZMA_UNPACKSIZE_SIZE; i++) {
-        size64 |= (unsigned long long)size_bytes[i] << (i * 8);
+    if (count > (size_t)(p - begin) / (2 * width)) {
+        APP_ERROR("Block count out of range");
+        return false;
     }
-    return size64;
-}
-#endif
+    p -= count * 2 * width;
+    const uint8_t *blocks_end = p;
 
-static void *DecompressLzmaData(const void *data, size_t data_size,
-                                size_t *decompressed_size)
-{
-#if WITH_LZMA
-    if (data_size < LZMA_HEADER_SIZE) {
-        APP_ERROR("LZMA header is truncated");
-        return NULL;
+    index->entries = calloc(count ? count : 1, sizeof(*index->entries));
+    if (!index->entries) {
+        APP_ERROR("Memory allocation failed for block index");
+        return false;
     }
 
-    unsigned long long unpack_size = parse_lzma_unpack_size(data);
-
-    DEBUG("Parsed LZMA decompressed size: %llu bytes", unpack_size);
-
-    if (unpack_size > (unsigned long long)LZMA_SIZET_MAX) {
-        APP_ERROR("Decompression size exceeds LZMA SizeT limit");
-        return NULL;
+    const uint8_t *src = begin;
+    for (size_t i = 0; i < count; i++, p += 2 * width) {
+        size_t src_size = get_size_field(p, width);
+        if (src_size > (size_t)(blocks_end - src)) {
+            APP_ERROR("Block %zu exceeds the compressed data", i);
+            free(index->entries);
+            index->entries = NULL;
+            return false;
+        }
+        index->entries[i].src      = src;
+        index->entries[i].src_size = src_size;
+        index->entries[i].size     = get_size_field(p + width, width);
+        src += src_size;
     }
 
-    if (unpack_size > (unsigned long long)SIZE_MAX) {
-        APP_ERROR("Size too large to fit in size_t");
-        return NULL;
+    if (src != blocks_end) {
+        APP_ERROR("Block index does not match the compressed data");
+        free(index->entries);
+        index->entries = NULL;
+        return false;
     }
 
-    void *unpack_data = malloc(unpack_size);
-    if (!unpack_data) {
+    index->count = count;
+    DEBUG("Compressed data: %zu blocks", count);
+    return true;
+}
+
+/*
+   Moves the unread bytes of a streaming reader to the front of its buffer,
+   growing the buffer for a single read larger than it (only a huge
+   OP_SET_SCRIPT can need that). Returns the number of buffered bytes.
+*/
+static bool compact_buffer(UnpackReader *reader, uint8_t **buffer,
+                           size_t *capacity, size_t size, size_t *avail)
+{
+    *avail = (size_t)(reader->end - reader->cur);
+
+    if (size > *capacity) {
+        uint8_t *grown = malloc(size);
+        if (!grown) {
+            APP_ERROR("Memory allocation failed during decompression");
+            return false;
+        }
+        memcpy(grown, reader->cur, *avail);
+        free(*buffer);
+        *buffer = grown;
+        *capacity = size;
+    } else {
+        memmove(*buffer, reader->cur, *avail);
+    }
+    reader->begin = *buffer;
+    reader->cur   = *buffer;
+    reader->end   = *buffer + *avail;
+    return true;
+}
+
+// Size of the buffer decoded data is passed to the opcode parser through.
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+// Upper bound of the decoded blocks held by the parser and decoded ahead of
+// it, whatever the number of threads. The block after the one being parsed
+// is decoded even if it exceeds the bound, so that decoding keeps going.
+#define MAX_DECODED_BLOCK_DATA (64 * 1024 * 1024)
+
+/* ----- Parallel decoding: whole blocks on worker threads ----- */
+
+typedef struct {
+    const BlockCodec *codec;
+    const BlockEntry *entry;
+    uint8_t          *out;
+    bool              ok;
+    WorkerEvent      *done;
+} BlockJob;
+
+typedef struct {
+    const BlockIndex *index;
+    BlockJob         *jobs;
+    WorkerPool       *pool;
+    size_t            window;     // blocks decoded ahead of the parser
+    size_t            held;       // decoded size of the blocks submitted
+    size_t            submitted;
+    size_t            current;    // block being consumed
+    size_t            pos;        // bytes consumed from the current block
+    uint8_t          *buffer;
+    size_t            capacity;
+} BlockStream;
+
+static bool run_block_job(void *arg)
+{
+    BlockJob *job = arg;
+
+    job->out = malloc(job->entry->size ? job->entry->size : 1);
+    if (!job->out) {
         APP_ERROR("Memory allocation failed during decompression");
-        return NULL;
+        job->ok = false;
+    } else {
+        uint64_t start = TraceNow();
+        job->ok = job->codec->decode_block(job->entry, job->out);
+        TraceAddTime(TRACE_DECOMPRESS, start);
     }
 
-    if (!decompress_lzma(unpack_data, unpack_size, data, data_size)) {
-        APP_ERROR("LZMA decompression failed");
-        free(unpack_data);
-        return NULL;
+    SetWorkerEvent(job->done);
+    return job->ok;
+}
+
+// Keeps up to window blocks submitted ahead of the one being consumed,
+// holding no more than MAX_DECODED_BLOCK_DATA beyond the next block.
+static bool submit_blocks(BlockStream *stream)
+{
+    while (stream->submitted < stream->index->count
+           && stream->submitted < stream->current + stream->window) {
+        BlockJob *job = &stream->jobs[stream->submitted];
+        if (stream->submitted > stream->current + 1
+            && stream->held + job->entry->size > MAX_DECODED_BLOCK_DATA) {
+            break;
+        }
+        if (!SubmitWorkerJob(stream->pool, run_block_job, job, 0)) {
+            return false;
+        }
+        stream->held += job->entry->size;
+        stream->submitted++;
+    }
+    return true;
+}
+
+static bool fill_block_stream(UnpackReader *reader, size_t size)
+{
+    BlockStream *stream = reader->source;
+    size_t avail;
+
+    if (!compact_buffer(reader, &stream->buffer, &stream->capacity, size,
+                        &avail)) {
+        return false;
+    }
+
+    while (avail < size && stream->current < stream->index->count) {
+        BlockJob *job = &stream->jobs[stream->current];
+
+        WaitWorkerEvent(job->done);
+        if (!job->ok) {
+            return false;
+        }
+
+        size_t len = job->entry->size - stream->pos;
+        if (len > stream->capacity - avail) {
+            len = stream->capacity - avail;
+        }
+        memcpy(stream->buffer + avail, job->out + stream->pos, len);
+        stream->pos += len;
+        avail += len;
+        reader->end = stream->buffer + avail;
+
+        if (stream->pos == job->entry->size) {
+            free(job->out);
+            job->out = NULL;
+            stream->held -= job->entry->size;
+            stream->current++;
+            stream->pos = 0;
+            if (!submit_blocks(stream)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool process_block_stream(const BlockIndex *index,
+                                 const BlockCodec *codec, WorkerPool *pool,
+                                 FileBatch *batch, size_t threads,
+                                 OperationModes modes)
+{
+    BlockStream stream = {
+        .index  = index,
+        .pool   = pool,
+        .window = threads + 1
+    };
+    bool ok = false;
+
+    stream.jobs = calloc(index->count, sizeof(*stream.jobs));
+    stream.capacity = STREAM_BUFFER_SIZE;
+    stream.buffer = malloc(stream.capacity);
+    if (!stream.jobs || !stream.buffer) {
+        APP_ERROR("Memory allocation failed during decompression");
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < index->count; i++) {
+        stream.jobs[i].codec = codec;
+        stream.jobs[i].entry = &index->entries[i];
+        stream.jobs[i].done = CreateWorkerEvent();
+        if (!stream.jobs[i].done) {
+            goto cleanup;
+        }
+    }
+
+    if (!submit_blocks(&stream)) {
+        goto cleanup;
+    }
+
+    UnpackReader reader = {
+        .begin   = stream.buffer,
+        .cur     = stream.buffer,
+        .end     = stream.buffer,
+        .fill    = fill_block_stream,
+        .source  = &stream,
+        .pool    = pool,
+        .batch   = batch,
+        .compact = IsCompactOpcodes(modes)
+    };
+
+    ok = process_opcodes(&reader);
+
+cleanup:
+    /* Decoding jobs still in flight refer to the jobs array. */
+    WaitWorkerPool(pool);
+    if (stream.jobs) {
+        for (size_t i = 0; i < index->count; i++) {
+            free(stream.jobs[i].out);
+            DestroyWorkerEvent(stream.jobs[i].done);
+        }
+        free(stream.jobs);
+    }
+    free(stream.buffer);
+    return ok;
+}
+
+// Decodes the compressed blocks, on the worker threads when there are any
+// and more than one block, executing opcodes as the data is decoded.
+static bool process_block_opcodes(const void *data, size_t data_size,
+                                  const BlockCodec *codec, WorkerPool *pool,
+                                  FileBatch *batch, size_t threads,
+                                  OperationModes modes)
+{
+    BlockIndex index;
+    if (!parse_block_index(data, data_size, modes, &index)) {
+        return false;
+    }
+    for (size_t i = 0; i < index.count; i++) {
+        TraceCount(TRACE_UNPACKED_BYTES, index.entries[i].size);
+    }
+
+    bool ok = pool && index.count > 1
+              ? process_block_stream(&index, codec, pool, batch, threads,
+                                     modes)
+              : codec->process_stream(&index, pool, batch, modes);
+    if (!ok) {
+        APP_ERROR("%s decompression failed", codec->name);
+    }
+
+    free(index.entries);
+    return ok;
+}
+#endif
+
+#if WITH_LZMA
+#define LZMA_UNPACKSIZE_SIZE 8
+#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
+#define LZMA_UNKNOWN_SIZE ((unsigned long long)-1)
+
+void *SzAlloc(const ISzAlloc *p, size_t size) { p = p; return malloc(size); }
+void SzFree(const ISzAlloc *p, void *address) { p = p; free(address); }
+ISzAlloc alloc = { SzAlloc, SzFree };
+
+static unsigned long long parse_lzma_unpack_size(const void *data)
+{
+    const Byte *size_bytes = (const Byte *)data + LZMA_PROPS_SIZE;
+    unsigned long long size64 = 0;
+    for (int i = 0; i < LZMA_UNPACKSIZE_SIZE; i++) {
+        size64 |= (unsigned long long)size_bytes[i] << (i * 8);
+    }
+    return size64;
+}
+
+// Checks the LZMA header of a block against its index entry.
+static bool check_lzma_block(const BlockEntry *entry)
+{
+    if (entry->src_size < LZMA_HEADER_SIZE) {
+        APP_ERROR("LZMA header is truncated");
+        return false;
+    }
+
+    unsigned long long unpack_size = parse_lzma_unpack_size(entry->src);
+    if (unpack_size != LZMA_UNKNOWN_SIZE
+        && unpack_size != (unsigned long long)entry->size) {
+        APP_ERROR("LZMA block size mismatch: %llu, expected %zu bytes",
+                  unpack_size, entry->size);
+        return false;
+    }
+    return true;
+}
+
+/*
+   Decodes the blocks one after another with LzmaDec_DecodeToBuf, so that
+   memory use is bounded by the LZMA dictionary plus the stream buffer no
+   matter how large a block is.
+*/
+typedef struct {
+    CLzmaDec          dec;
+    const BlockIndex *index;
+    size_t            current;    // block being decoded
+    const Byte       *in;
+    size_t            in_size;
+    size_t            decoded;    // bytes decoded from the current block
+    uint8_t          *buffer;
+    size_t            capacity;
+} LzmaStream;
+
+static bool start_lzma_block(LzmaStream *stream)
+{
+    const BlockEntry *entry = &stream->index->entries[stream->current];
+
+    if (!check_lzma_block(entry)) {
+        return false;
+    }
+
+    SRes res = LzmaDec_Allocate(&stream->dec, entry->src, LZMA_PROPS_SIZE,
+                                &alloc);
+    if (res != SZ_OK) {
+        APP_ERROR("Failed to allocate LZMA decoder: %d", res);
+        return false;
+    }
+    LzmaDec_Init(&stream->dec);
+
+    stream->in = entry->src + LZMA_HEADER_SIZE;
+    stream->in_size = entry->src_size - LZMA_HEADER_SIZE;
+    stream->decoded = 0;
+    return true;
+}
+
+static bool fill_lzma_stream(UnpackReader *reader, size_t size)
+{
+    LzmaStream *stream = reader->source;
+    size_t avail;
+
+    if (!compact_buffer(reader, &stream->buffer, &stream->capacity, size,
+                        &avail)) {
+        return false;
+    }
+
+    while (avail < size && stream->current < stream->index->count) {
+        const BlockEntry *entry = &stream->index->entries[stream->current];
+        SizeT out_size = stream->capacity - avail;
+        SizeT in_size = stream->in_size;
+        ELzmaStatus status;
+
+        if (out_size > entry->size - stream->decoded) {
+            out_size = entry->size - stream->decoded;
+        }
+
+        uint64_t start = TraceNow();
+        SRes res = LzmaDec_DecodeToBuf(&stream->dec, stream->buffer + avail,
+                                       &out_size, stream->in, &in_size,
+                                       LZMA_FINISH_ANY, &status);
+        TraceAddTime(TRACE_DECOMPRESS, start);
+        stream->in += in_size;
+        stream->in_size -= in_size;
+        stream->decoded += out_size;
+        avail += out_size;
+        reader->end = stream->buffer + avail;
+
+        if (res != SZ_OK) {
+            APP_ERROR("LZMA decompression error: %d, status: %d", res, status);
+            return false;
+        }
+        if (stream->decoded < entry->size && in_size == 0 && out_size == 0) {
+            APP_ERROR("LZMA data is truncated");
+            return false;
+        }
+        if (stream->decoded == entry->size) {
+            stream->current++;
+            if (stream->current < stream->index->count
+                && !start_lzma_block(stream)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool process_lzma_stream(const BlockIndex *index, WorkerPool *pool,
+                                FileBatch *batch, OperationModes modes)
+{
+    LzmaStream stream = { .index = index };
+    bool ok = false;
+
+    LzmaDec_Construct(&stream.dec);
+
+    stream.capacity = STREAM_BUFFER_SIZE;
+    stream.buffer = malloc(stream.capacity);
+    if (!stream.buffer) {
+        APP_ERROR("Memory allocation failed during decompression");
+        goto cleanup;
+    }
+
+    if (index->count > 0 && !start_lzma_block(&stream)) {
+        goto cleanup;
     }
 
-    *decompressed_size = unpack_size;
-    return unpack_data;
+    UnpackReader reader = {
+        .begin   = stream.buffer,
+        .cur     = stream.buffer,
+        .end     = stream.buffer,
+        .fill    = fill_lzma_stream,
+        .source  = &stream,
+        .pool    = pool,
+        .batch   = batch,
+        .compact = IsCompactOpcodes(modes)
+    };
+
+    ok = process_opcodes(&reader);
+
+cleanup:
+    LzmaDec_Free(&stream.dec, &alloc);
+    free(stream.buffer);
+    return ok;
+}
+
+static bool decode_lzma_block(const BlockEntry *entry, uint8_t *out)
+{
+    if (!check_lzma_block(entry)) {
+        return false;
+    }
+
+    SizeT out_size = entry->size;
+    SizeT in_size = entry->src_size - LZMA_HEADER_SIZE;
+    ELzmaStatus status;
+    SRes res = LzmaDecode(out, &out_size,
+                          entry->src + LZMA_HEADER_SIZE, &in_size,
+                          entry->src, LZMA_PROPS_SIZE,
+                          LZMA_FINISH_ANY, &status, &alloc);
+    if (res != SZ_OK || out_size != entry->size) {
+        APP_ERROR("LZMA decompression error: %d, status: %d", res, status);
+        return false;
+    }
+    return true;
+}
+
+static const BlockCodec LzmaCodec = {
+    .name           = "LZMA",
+    .process_stream = process_lzma_stream,
+    .decode_block   = decode_lzma_block
+};
+#endif
+
+#if WITH_ZSTD
+/*
+   Each Zstandard block is a single frame. Sequential decoding streams the
+   frames through one ZSTD_DStream, which bounds memory by the window size
+   plus the stream buffer.
+*/
+typedef struct {
+    ZSTD_DStream     *dctx;
+    const BlockIndex *index;
+    size_t            current;    // block being decoded
+    ZSTD_inBuffer     in;
+    size_t            decoded;    // bytes decoded from the current block
+    uint8_t          *buffer;
+    size_t            capacity;
+} ZstdStream;
+
+static void start_zstd_block(ZstdStream *stream)
+{
+    const BlockEntry *entry = &stream->index->entries[stream->current];
+
+    ZSTD_DCtx_reset(stream->dctx, ZSTD_reset_session_only);
+    stream->in.src  = entry->src;
+    stream->in.size = entry->src_size;
+    stream->in.pos  = 0;
+    stream->decoded = 0;
+}
+
+static bool fill_zstd_stream(UnpackReader *reader, size_t size)
+{
+    ZstdStream *stream = reader->source;
+    size_t avail;
+
+    if (!compact_buffer(reader, &stream->buffer, &stream->capacity, size,
+                        &avail)) {
+        return false;
+    }
+
+    while (avail < size && stream->current < stream->index->count) {
+        const BlockEntry *entry = &stream->index->entries[stream->current];
+        ZSTD_outBuffer out = {
+            .dst  = stream->buffer + avail,
+            .size = stream->capacity - avail,
+            .pos  = 0
+        };
+        size_t in_pos = stream->in.pos;
+
+        if (out.size > entry->size - stream->decoded) {
+            out.size = entry->size - stream->decoded;
+        }
+
+        uint64_t start = TraceNow();
+        size_t ret = ZSTD_decompressStream(stream->dctx, &out, &stream->in);
+        TraceAddTime(TRACE_DECOMPRESS, start);
+        stream->decoded += out.pos;
+        avail += out.pos;
+        reader->end = stream->buffer + avail;
+
+        if (ZSTD_isError(ret)) {
+            APP_ERROR("Zstandard decompression error: %s",
+                      ZSTD_getErrorName(ret));
+            return false;
+        }
+        if (stream->decoded == entry->size) {
+            if (ret != 0 || stream->in.pos != stream->in.size) {
+                APP_ERROR("Zstandard block %zu has trailing data",
+                          stream->current);
+                return false;
+            }
+            stream->current++;
+            if (stream->current < stream->index->count) {
+                start_zstd_block(stream);
+            }
+        } else if (out.pos == 0 && stream->in.pos == in_pos) {
+            APP_ERROR("Zstandard data is truncated");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool process_zstd_stream(const BlockIndex *index, WorkerPool *pool,
+                                FileBatch *batch, OperationModes modes)
+{
+    ZstdStream stream = { .index = index };
+    bool ok = false;
+
+    stream.dctx = ZSTD_createDStream();
+    stream.capacity = STREAM_BUFFER_SIZE;
+    stream.buffer = malloc(stream.capacity);
+    if (!stream.dctx || !stream.buffer) {
+        APP_ERROR("Memory allocation failed during decompression");
+        goto cleanup;
+    }
+
+    if (index->count > 0) {
+        start_zstd_block(&stream);
+    }
+
+    UnpackReader reader = {
+        .begin   = stream.buffer,
+        .cur     = stream.buffer,
+        .end     = stream.buffer,
+        .fill    = fill_zstd_stream,
+        .source  = &stream,
+        .pool    = pool,
+        .batch   = batch,
+        .compact = IsCompactOpcodes(modes)
+    };
+
+    ok = process_opcodes(&reader);
+
+cleanup:
+    ZSTD_freeDStream(stream.dctx);
+    free(stream.buffer);
+    return ok;
+}
+
+static bool decode_zstd_block(const BlockEntry *entry, uint8_t *out)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        APP_ERROR("Memory allocation failed during decompression");
+        return false;
+    }
+
+    size_t ret = ZSTD_decompressDCtx(dctx, out, entry->size,
+                                     entry->src, entry->src_size);
+    ZSTD_freeDCtx(dctx);
+
+    if (ZSTD_isError(ret)) {
+        APP_ERROR("Zstandard decompression error: %s", ZSTD_getErrorName(ret));
+        return false;
+    }
+    if (ret != entry->size) {
+        APP_ERROR("Zstandard block size mismatch: %zu, expected %zu bytes",
+                  ret, entry->size);
+        return false;
+    }
+    return true;
+}
+
+static const BlockCodec ZstdCodec = {
+    .name           = "Zstandard",
+    .process_stream = process_zstd_stream,
+    .decode_block   = decode_zstd_block
+};
+#endif
+
+#if WITH_LZMA || WITH_ZSTD
+static const BlockCodec *select_block_codec(OperationModes modes)
+{
+    if (IsDataZstd(modes)) {
+#if WITH_ZSTD
+        return &ZstdCodec;
+#else
+        APP_ERROR("Does not support Zstandard");
+        return NULL;
+#endif
+    }
+#if WITH_LZMA
+    return &LzmaCodec;
 #else
     APP_ERROR("Does not support LZMA");
     return NULL;
 #endif
 }
+#endif
 
 const uint8_t Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
 
@@ -387,29 +1599,112 @@ static const void *find_signature(const void *buffer, size_t buffer_size)
 #endif
 }
 
-typedef uint8_t OperationModesType;
+typedef uint16_t OperationModesType;
 
 OperationModes get_operation_modes(const void **p)
 {
-    const OperationModesType *q = (const OperationModesType *)*p;
-    *p = q + 1;
-    return (OperationModes)*q;
+    const uint8_t *q = *p;
+    *p = q + sizeof(OperationModesType);
+    return (OperationModes)(q[0] | q[1] << 8);
 }
 
 typedef SizeType OffsetType;
 
+// Stands in the 32-bit footer offset of WIDE_SIZES payloads, after the
+// 64-bit offset. No 32-bit offset can take this value, since it would
+// leave no room for the signature.
+#define WIDE_OFFSET_MARKER 0xFFFFFFFFu
+
 size_t get_offset(const void *p)
 {
     return get_size(p);
 }
 
+#define CACHE_KEY_SIZE 32
+
 struct UnpackContext {
     MemoryMap      *map;
     OperationModes  modes;
     const void     *data;
     size_t          data_size;
+    const void     *launch_data;
+    size_t          launch_size;
+    const uint8_t  *toc;
+    size_t          toc_size;
+    size_t          toc_count;
+    char            cache_key[CACHE_KEY_SIZE * 2 + 1];
 };
 
+/*
+   Splits the table of contents off the end of the data:
+   [data][entry 0]...[entry n-1][n][table size]
+   The table size covers the entries and n. *tail points just past the
+   table on entry and to the end of the data on return.
+*/
+static bool parse_toc(UnpackContext *context, const uint8_t *head,
+                      const uint8_t **tail)
+{
+    const uint8_t *p = *tail;
+    size_t width = size_field_width(context->modes);
+
+    if ((size_t)(p - head) < 2 * width) {
+        APP_ERROR("Not enough space for the table of contents");
+        return false;
+    }
+
+    p -= width;
+    size_t toc_size = get_size_field(p, width);
+    if (toc_size < width || toc_size > (size_t)(p - head)) {
+        APP_ERROR("Table of contents size out of range");
+        return false;
+    }
+
+    context->toc_count = get_size_field(p - width, width);
+    context->toc_size = toc_size - width;
+    context->toc = p - toc_size;
+    *tail = context->toc;
+    return true;
+}
+
+/*
+   Splits the EXTRACT_CACHE trailer off the end of the data:
+   [data][launch section][launch section size][payload hash]
+   *tail points just past the trailer on entry and to the end of the data
+   on return.
+*/
+static bool parse_cache_trailer(UnpackContext *context, const uint8_t *head,
+                                const uint8_t **tail)
+{
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t *p = *tail;
+    size_t width = size_field_width(context->modes);
+
+    if ((size_t)(p - head) < CACHE_KEY_SIZE + width) {
+        APP_ERROR("Not enough space for the extraction cache trailer");
+        return false;
+    }
+
+    p -= CACHE_KEY_SIZE;
+    for (size_t i = 0; i < CACHE_KEY_SIZE; i++) {
+        context->cache_key[i * 2]     = hex[p[i] >> 4];
+        context->cache_key[i * 2 + 1] = hex[p[i] & 0x0F];
+    }
+    context->cache_key[CACHE_KEY_SIZE * 2] = '\0';
+
+    p -= width;
+    size_t launch_size = get_size_field(p, width);
+    if (launch_size > (size_t)(p - head)) {
+        APP_ERROR("Launch section size out of range");
+        return false;
+    }
+
+    p -= launch_size;
+    context->launch_data = p;
+    context->launch_size = launch_size;
+    *tail = p;
+    return true;
+}
+
 UnpackContext *OpenPackFile(const char *self_path)
 {
     UnpackContext *context = NULL;
@@ -458,13 +1753,23 @@ UnpackContext *OpenPackFile(const char *self_path)
 
     /* Determine the start of the packed data */
     tail = (const uint8_t *)tail - sizeof(OffsetType);
-    size_t offset = get_offset(tail);
+    uint64_t offset = get_offset(tail);
+    if (offset == WIDE_OFFSET_MARKER) {
+        if ((size_t)((const uint8_t *)tail - (const uint8_t *)map_base)
+            < sizeof(uint64_t)) {
+            APP_ERROR("Signature too close to buffer start");
+
+            goto cleanup;
+        }
+        tail = (const uint8_t *)tail - sizeof(uint64_t);
+        offset = get_uint64(tail);
+    }
     if (offset > map_size - sizeof(OperationModesType)) {
         APP_ERROR("Offset out of range");
         
         goto cleanup;
     }
-    const void *head = (const uint8_t *)map_base + offset;
+    const void *head = (const uint8_t *)map_base + (size_t)offset;
 
     /* Verify that the header fits immediately before the offset */
     if (head > tail
@@ -475,12 +1780,22 @@ UnpackContext *OpenPackFile(const char *self_path)
         goto cleanup;
     }
     context->modes = get_operation_modes(&head);
+    const uint8_t *data_end = tail;
+    if (IsExtractCache(context->modes)
+        && !parse_cache_trailer(context, head, &data_end)) {
+        goto cleanup;
+    }
+    if (!parse_toc(context, head, &data_end)) {
+        goto cleanup;
+    }
+    tail = data_end;
     context->data = head;
     context->data_size = (const uint8_t *)tail - (const uint8_t *)head;
 
     DEBUG(
-        "OpenPackFile: offset=%zu, modes= %u, data_size=%zu",
-        offset, (unsigned)context->modes, context->data_size
+        "OpenPackFile: offset=%llu, modes= %u, data_size=%zu",
+        (unsigned long long)offset, (unsigned)context->modes,
+        context->data_size
     );
     return context;
 
@@ -544,39 +1859,617 @@ bool IsChdirToExeDir(OperationModes modes) {
     return IsMode(modes, CHDIR_TO_EXE_DIR);
 }
 
-bool ProcessImage(const UnpackContext *context)
+bool IsExtractCache(OperationModes modes) {
+    return IsMode(modes, EXTRACT_CACHE);
+}
+
+bool IsDataZstd(OperationModes modes) {
+    return IsMode(modes, DATA_ZSTD);
+}
+
+bool IsCompactOpcodes(OperationModes modes) {
+    return IsMode(modes, COMPACT_OPCODES);
+}
+
+bool IsWideSizes(OperationModes modes) {
+    return IsMode(modes, WIDE_SIZES);
+}
+
+bool IsExtractToMemory(OperationModes modes) {
+    return IsMode(modes, EXTRACT_TO_MEMORY);
+}
+
+bool IsLaunchEarly(OperationModes modes) {
+    return IsMode(modes, LAUNCH_EARLY);
+}
+
+const char *GetExtractCacheKey(const UnpackContext *context)
 {
     if (!context) {
         APP_ERROR("context is NULL");
+        return NULL;
+    }
+    if (!IsExtractCache(context->modes)) {
+        return NULL;
+    }
+    return context->cache_key;
+}
+
+// Number of threads to extract files with: OCRAN_EXTRACT_THREADS if set,
+// the number of processors otherwise. 1 extracts on the main thread only.
+static size_t extract_thread_count(void)
+{
+    size_t threads = GetProcessorCount();
+
+    const char *env = getenv("OCRAN_EXTRACT_THREADS");
+    if (env && *env) {
+        char *end;
+        unsigned long n = strtoul(env, &end, 10);
+        if (*end == '\0') {
+            threads = n;
+        } else {
+            DEBUG("Ignoring invalid OCRAN_EXTRACT_THREADS=%s", env);
+        }
+    }
+
+    if (threads > MAX_EXTRACT_THREADS) {
+        threads = MAX_EXTRACT_THREADS;
+    }
+    DEBUG("Extraction threads: %zu", threads);
+    return threads;
+}
+
+// Files are written through io_uring where available unless
+// OCRAN_IO_URING=0.
+static bool use_io_uring(void)
+{
+    const char *env = getenv("OCRAN_IO_URING");
+    if (env && strcmp(env, "0") == 0) {
+        DEBUG("io_uring disabled by OCRAN_IO_URING");
         return false;
     }
+    return true;
+}
+
+bool ProcessImage(const UnpackContext *context, LaunchFunc launch, void *arg)
+{
+    if (!context) {
+        APP_ERROR("context is NULL");
+        return false;
+    }
+
+    Launch = launch;
+    LaunchArg = arg;
 
     DEBUG("Data segment size: %zu bytes", context->data_size);
+    TraceCount(TRACE_PAYLOAD_BYTES, context->data_size);
+    if (!IsDataCompressed(context->modes)) {
+        TraceCount(TRACE_UNPACKED_BYTES, context->data_size);
+    }
 
-    bool compressed = IsDataCompressed(context->modes);
-    void  *data;
-    size_t data_size;
-
-    if (compressed) {
-        data = DecompressLzmaData(
-            context->data,
-            context->data_size,
-            &data_size
-        );
-        if (!data) {
-            APP_ERROR("LZMA decompression failed");
+    WorkerPool *pool = NULL;
+    size_t threads = extract_thread_count();
+    if (threads > 1) {
+        pool = CreateWorkerPool(threads, MAX_PENDING_FILE_DATA);
+        if (!pool) {
+            DEBUG("Failed to start extraction threads; extracting sequentially");
+        }
+    }
+    FileBatch *batch = use_io_uring()
+                       ? CreateFileBatch(MAX_PENDING_FILE_DATA) : NULL;
+
+    bool ok;
+    if (IsDataCompressed(context->modes)) {
+#if WITH_LZMA || WITH_ZSTD
+        const BlockCodec *codec = select_block_codec(context->modes);
+        ok = codec && process_block_opcodes(context->data, context->data_size,
+                                            codec, pool, batch, threads,
+                                            context->modes);
+#else
+        APP_ERROR("Does not support compressed data");
+        ok = false;
+#endif
+    } else {
+        ok = process_opcodes_in_memory(context->data, context->data_size,
+                                       context->map, pool, batch,
+                                       context->modes);
+    }
+
+    /* Every file must be on disk before the script starts, or before
+       ProcessImage() returns to a script started at OP_LAUNCH. */
+    Launch = NULL;
+    if (batch) {
+        if (!WaitFileBatch(batch)) {
+            APP_ERROR("Failed to write extracted files");
+            ok = false;
+        }
+        DestroyFileBatch(batch);
+    }
+    if (pool) {
+        if (!WaitWorkerPool(pool)) {
+            APP_ERROR("Failed to write extracted files");
+            ok = false;
+        }
+        DestroyWorkerPool(pool);
+    }
+    /* Duplicates need their sources complete, so they come last. */
+    if (!CompleteFileDuplicates()) {
+        ok = false;
+    }
+    CloseInstDirCache();
+    return ok;
+}
+
+bool ProcessLaunchSection(const UnpackContext *context)
+{
+    if (!context) {
+        APP_ERROR("context is NULL");
+        return false;
+    }
+
+    DEBUG("Launch section size: %zu bytes", context->launch_size);
+
+    return process_opcodes_in_memory(context->launch_data, context->launch_size,
+                                     NULL, NULL, NULL, context->modes);
+}
+
+/* ===== Table of contents ===== */
+
+/*
+   Each entry of the table of contents describes one directory, file or
+   symlink of the payload:
+   [type: 1 byte][offset: 8 bytes][size][path]
+   The type is the opcode that creates the entry. Offset and size locate
+   the file contents, or the symlink target without its null terminator,
+   in the opcode stream, which is the uncompressed data or the
+   concatenation of the unpacked blocks. Directories have neither.
+*/
+typedef struct {
+    Opcode      type;
+    uint64_t    offset;
+    size_t      size;
+    const char *path;
+} TocEntry;
+
+#define TOC_ENTRY_HEADER_SIZE (1 + 8 + 2 * sizeof(SizeType))
+
+// Reads the header of a WIDE_SIZES entry, whose integers are LEB128.
+static bool read_wide_toc_header(const uint8_t **p, const uint8_t *end,
+                                 TocEntry *entry, size_t *len)
+{
+    const uint8_t *q = *p;
+    size_t offset, n;
+
+    if (q == end) {
+        return false;
+    }
+    entry->type = (Opcode)*q++;
+    if (!(n = decode_varint(q, (size_t)(end - q), &offset))) {
+        return false;
+    }
+    q += n;
+    if (!(n = decode_varint(q, (size_t)(end - q), &entry->size))) {
+        return false;
+    }
+    q += n;
+    if (!(n = decode_varint(q, (size_t)(end - q), len))) {
+        return false;
+    }
+    entry->offset = offset;
+    *p = q + n;
+    return true;
+}
+
+// Reads the entry at *p and advances *p past it.
+static bool read_toc_entry(const UnpackContext *context, const uint8_t **p,
+                           TocEntry *entry)
+{
+    const uint8_t *end = context->toc + context->toc_size;
+    const uint8_t *q = *p;
+    size_t len;
+
+    if (IsWideSizes(context->modes)) {
+        if (!read_wide_toc_header(&q, end, entry, &len)) {
+            APP_ERROR("Table of contents is truncated");
             return false;
         }
-        DEBUG("LZMA decompressed %zu bytes", data_size);
     } else {
-        data      = (void *)context->data;
-        data_size = context->data_size;
+        if ((size_t)(end - q) < TOC_ENTRY_HEADER_SIZE) {
+            APP_ERROR("Table of contents is truncated");
+            return false;
+        }
+        entry->type   = (Opcode)q[0];
+        entry->offset = get_uint64(q + 1);
+        entry->size   = get_size(q + 9);
+        len           = get_size(q + 9 + sizeof(SizeType));
+        q += TOC_ENTRY_HEADER_SIZE;
+    }
+
+    if (len == 0 || len > (size_t)(end - q) || q[len - 1] != '\0') {
+        APP_ERROR("Invalid path in table of contents");
+        return false;
+    }
+    entry->path = (const char *)q;
+    *p = q + len;
+    return true;
+}
+
+typedef bool (*RangeSink)(void *arg, const void *data, size_t size);
+
+/*
+   Reads ranges of the opcode stream. Compressed data is decoded only in
+   the blocks a range overlaps, and the last decoded block is kept, since
+   neighbouring entries mostly share blocks.
+*/
+typedef struct {
+    const UnpackContext *context;
+#if WITH_LZMA || WITH_ZSTD
+    const BlockCodec    *codec;
+    BlockIndex           index;
+    size_t               cached;   // block decoded into buffer
+    uint8_t             *buffer;   // NULL until a block is decoded
+#endif
+} RangeReader;
+
+static bool open_range_reader(RangeReader *reader,
+                              const UnpackContext *context)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->context = context;
+    if (!IsDataCompressed(context->modes)) {
+        return true;
+    }
+
+#if WITH_LZMA || WITH_ZSTD
+    reader->codec = select_block_codec(context->modes);
+    return reader->codec
+           && parse_block_index(context->data, context->data_size,
+                                context->modes, &reader->index);
+#else
+    APP_ERROR("Does not support compressed data");
+    return false;
+#endif
+}
+
+static void close_range_reader(RangeReader *reader)
+{
+#if WITH_LZMA || WITH_ZSTD
+    free(reader->buffer);
+    free(reader->index.entries);
+#else
+    (void)reader;
+#endif
+}
+
+#if WITH_LZMA || WITH_ZSTD
+static const uint8_t *decode_cached_block(RangeReader *reader, size_t i)
+{
+    if (reader->buffer && reader->cached == i) {
+        return reader->buffer;
     }
 
-    bool ok = process_opcodes(data, data_size);
+    free(reader->buffer);
+    reader->buffer = malloc(reader->index.entries[i].size);
+    if (!reader->buffer) {
+        APP_ERROR("Memory allocation failed for block data");
+        return NULL;
+    }
+    if (!reader->codec->decode_block(&reader->index.entries[i],
+                                     reader->buffer)) {
+        free(reader->buffer);
+        reader->buffer = NULL;
+        return NULL;
+    }
+    reader->cached = i;
+    return reader->buffer;
+}
+#endif
+
+// Passes the bytes [offset, offset + size) of the opcode stream to sink,
+// in order and in one or more pieces.
+static bool read_stream_range(RangeReader *reader, uint64_t offset,
+                              size_t size, RangeSink sink, void *arg)
+{
+    const UnpackContext *context = reader->context;
+    if (!IsDataCompressed(context->modes)) {
+        if (offset > context->data_size
+            || size > context->data_size - (size_t)offset) {
+            APP_ERROR("Entry exceeds the data");
+            return false;
+        }
+        return sink(arg, (const uint8_t *)context->data + offset, size);
+    }
+
+#if WITH_LZMA || WITH_ZSTD
+    uint64_t block_start = 0;
+    uint64_t end = offset + size;
+    for (size_t i = 0; i < reader->index.count && offset < end; i++) {
+        uint64_t block_end = block_start + reader->index.entries[i].size;
+        if (block_end > offset) {
+            const uint8_t *out = decode_cached_block(reader, i);
+            if (!out) {
+                return false;
+            }
+            uint64_t to = end < block_end ? end : block_end;
+            if (!sink(arg, out + (offset - block_start),
+                      (size_t)(to - offset))) {
+                return false;
+            }
+            offset = to;
+        }
+        block_start = block_end;
+    }
+    if (offset < end) {
+        APP_ERROR("Entry exceeds the data");
+        return false;
+    }
+    return true;
+#else
+    (void)offset;
+    (void)size;
+    (void)sink;
+    (void)arg;
+    return false;
+#endif
+}
+
+typedef struct {
+    char   *buffer;
+    size_t  len;
+} StringSink;
+
+static bool append_to_string(void *arg, const void *data, size_t size)
+{
+    StringSink *str = arg;
+    memcpy(str->buffer + str->len, data, size);
+    str->len += size;
+    return true;
+}
 
-    if (compressed) {
+// Returns the target of a symlink entry, which the caller frees.
+static char *read_symlink_target(RangeReader *reader, const TocEntry *entry)
+{
+    StringSink str = { malloc(entry->size + 1), 0 };
+    if (!str.buffer) {
+        APP_ERROR("Memory allocation failed for symlink target");
+        return NULL;
+    }
+    if (!read_stream_range(reader, entry->offset, entry->size,
+                           append_to_string, &str)) {
+        free(str.buffer);
+        return NULL;
+    }
+    str.buffer[str.len] = '\0';
+    return str.buffer;
+}
+
+// Returns the contents of a filtered file entry with the conversion
+// reversed, which the caller frees.
+static uint8_t *read_filtered_file(RangeReader *reader, const TocEntry *entry)
+{
+    if (entry->size == SIZE_MAX) {
+        APP_ERROR("Entry exceeds the data");
+        return NULL;
+    }
+    StringSink str = { malloc(entry->size + 1), 0 };
+    if (!str.buffer) {
+        APP_ERROR("Memory allocation failed for file data");
+        return NULL;
+    }
+    if (!read_stream_range(reader, entry->offset, entry->size + 1,
+                           append_to_string, &str)) {
+        free(str.buffer);
+        return NULL;
+    }
+    BranchFilter filter = (BranchFilter)(uint8_t)str.buffer[0];
+    if (!IsBranchFilter(filter)) {
+        APP_ERROR("Unknown branch filter %d for '%s'", filter, entry->path);
+        free(str.buffer);
+        return NULL;
+    }
+    uint8_t *data = (uint8_t *)str.buffer;
+    memmove(data, data + 1, entry->size);
+    UnfilterBranches(filter, data, entry->size);
+    return data;
+}
+
+// Block size filesystems allocate files in, for estimating their space
+#define EXTRACT_BLOCK_SIZE 4096
+
+bool GetExtractedSize(const UnpackContext *context, unsigned long long *size)
+{
+    if (!context || !size) {
+        APP_ERROR("context is NULL");
+        return false;
+    }
+
+    unsigned long long total = 0;
+    const uint8_t *p = context->toc;
+    for (size_t i = 0; i < context->toc_count; i++) {
+        TocEntry entry;
+        if (!read_toc_entry(context, &p, &entry)) {
+            return false;
+        }
+        if (entry.type == OP_CREATE_FILE || entry.type == OP_CREATE_FILTERED_FILE) {
+            total += ((unsigned long long)entry.size + EXTRACT_BLOCK_SIZE - 1)
+                     / EXTRACT_BLOCK_SIZE * EXTRACT_BLOCK_SIZE;
+        } else {
+            total += EXTRACT_BLOCK_SIZE;
+        }
+    }
+    *size = total;
+    return true;
+}
+
+bool ListPackEntries(const UnpackContext *context)
+{
+    if (!context) {
+        APP_ERROR("context is NULL");
+        return false;
+    }
+
+    RangeReader reader;
+    if (!open_range_reader(&reader, context)) {
+        return false;
+    }
+
+    bool ok = true;
+    const uint8_t *p = context->toc;
+    for (size_t i = 0; ok && i < context->toc_count; i++) {
+        TocEntry entry;
+        if (!read_toc_entry(context, &p, &entry)) {
+            ok = false;
+            break;
+        }
+
+        switch (entry.type) {
+            case OP_CREATE_DIRECTORY:
+                printf("d %12s %s\n", "-", entry.path);
+                break;
+            case OP_CREATE_FILE:
+            case OP_CREATE_FILTERED_FILE:
+                printf("f %12zu %s\n", entry.size, entry.path);
+                break;
+            case OP_CREATE_SYMLINK: {
+                char *target = read_symlink_target(&reader, &entry);
+                if (!target) {
+                    ok = false;
+                    break;
+                }
+                printf("l %12s %s -> %s\n", "-", entry.path, target);
+                free(target);
+                break;
+            }
+            default:
+                APP_ERROR("Unknown entry type %d in table of contents",
+                          entry.type);
+                ok = false;
+                break;
+        }
+    }
+
+    close_range_reader(&reader);
+    return fflush(stdout) == 0 && ok;
+}
+
+// True if path is prefix itself or lies below it. Either separator
+// matches the other, and trailing separators on prefix are ignored.
+static bool is_under_path(const char *path, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    while (len > 0 && is_path_separator(prefix[len - 1])) {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (is_path_separator(prefix[i]) ? !is_path_separator(path[i])
+                                         : path[i] != prefix[i]) {
+            return false;
+        }
+    }
+    return len == 0 || path[len] == '\0' || is_path_separator(path[len]);
+}
+
+static bool write_to_output_file(void *arg, const void *data, size_t size)
+{
+    return WriteOutputFile(arg, data, size);
+}
+
+static bool extract_toc_entry(RangeReader *reader, const TocEntry *entry,
+                              const char *dest_dir)
+{
+    if (!IsCleanRelativePath(entry->path)) {
+        APP_ERROR("Refusing to extract '%s'", entry->path);
+        return false;
+    }
+
+    char *path = JoinPath(dest_dir, entry->path);
+    if (!path) {
+        return false;
+    }
+
+    bool ok = false;
+    char *parent = NULL;
+    if (entry->type == OP_CREATE_DIRECTORY) {
+        ok = CreateDirectoriesRecursively(path);
+        goto cleanup;
+    }
+
+    parent = GetParentPath(path);
+    if (!parent || (*parent && !CreateDirectoriesRecursively(parent))) {
+        APP_ERROR("Failed to create parent directory of '%s'", path);
+        goto cleanup;
+    }
+
+    if (entry->type == OP_CREATE_FILE) {
+        OutputFile *file = CreateOutputFile(path);
+        if (!file) {
+            goto cleanup;
+        }
+        ok = read_stream_range(reader, entry->offset, entry->size,
+                               write_to_output_file, file);
+        ok = CloseOutputFile(file) && ok;
+    } else if (entry->type == OP_CREATE_FILTERED_FILE) {
+        uint8_t *data = read_filtered_file(reader, entry);
+        ok = data && ExportFile(path, data, entry->size);
         free(data);
+    } else if (entry->type == OP_CREATE_SYMLINK) {
+#ifndef _WIN32
+        char *target = read_symlink_target(reader, entry);
+        DirHandle *dir = target ? OpenDirHandle(parent) : NULL;
+        const char *name = path + strlen(parent);
+        while (is_path_separator(*name)) {
+            name++;
+        }
+        ok = dir && CreateSymlinkAt(dir, name, target);
+        CloseDirHandle(dir);
+        free(target);
+#else
+        DEBUG("Skipping symlink '%s' on Windows", entry->path);
+        ok = true;
+#endif
+    } else {
+        APP_ERROR("Unknown entry type %d in table of contents", entry->type);
+    }
+
+cleanup:
+    if (ok) {
+        DEBUG("Extracted '%s'", path);
+    }
+    free(parent);
+    free(path);
+    return ok;
+}
+
+bool ExtractPackEntries(const UnpackContext *context, const char *rel_path,
+                        const char *dest_dir)
+{
+    if (!context || !rel_path || !dest_dir) {
+        APP_ERROR("context, rel_path or dest_dir is NULL");
+        return false;
+    }
+
+    RangeReader reader;
+    if (!open_range_reader(&reader, context)) {
+        return false;
+    }
+
+    bool ok = true;
+    size_t matched = 0;
+    const uint8_t *p = context->toc;
+    for (size_t i = 0; ok && i < context->toc_count; i++) {
+        TocEntry entry;
+        if (!read_toc_entry(context, &p, &entry)) {
+            ok = false;
+        } else if (is_under_path(entry.path, rel_path)) {
+            ok = extract_toc_entry(&reader, &entry, dest_dir);
+            matched++;
+        }
+    }
+    close_range_reader(&reader);
+
+    if (ok && matched == 0) {
+        APP_ERROR("No entry matches '%s'", rel_path);
+        ok = false;
     }
     return ok;
 }
@@ -1,11 +1,18 @@
 #include <stdbool.h>
 
 typedef enum {
-    OP_CREATE_DIRECTORY = 1,
-    OP_CREATE_FILE      = 2,
-    OP_SETENV           = 3,
-    OP_SET_SCRIPT       = 4,
-    OP_CREATE_SYMLINK   = 5,
+    OP_CREATE_DIRECTORY     = 1,
+    OP_CREATE_FILE          = 2,
+    OP_SETENV               = 3,
+    OP_SET_SCRIPT           = 4,
+    OP_CREATE_SYMLINK       = 5,
+    OP_PADDING              = 6,   // size, then that many ignored bytes
+    OP_DUPLICATE_FILE       = 7,   // path, then the path of an earlier file
+                                   // with the same contents
+    OP_CREATE_FILTERED_FILE = 8,   // as OP_CREATE_FILE, with a BranchFilter
+                                   // byte before the contents
+    OP_LAUNCH               = 9,   // end of the files the application needs
+                                   // to start (LAUNCH_EARLY)
 } Opcode;
 
 /**
@@ -31,6 +38,24 @@ typedef enum {
  * - DATA_COMPRESSED: Indicates that the data to be processed is compressed and
  *   requires decompression.
  *
+ * - EXTRACT_CACHE: Extracts into a persistent directory keyed on the payload
+ *   hash and reuses it on later runs.
+ *
+ * - DATA_ZSTD: Indicates that compressed data uses Zstandard instead of
+ *   LZMA.
+ *
+ * - COMPACT_OPCODES: Indicates the version 2 opcode encoding, with variable
+ *   length integers and front-coded paths.
+ *
+ * - WIDE_SIZES: Indicates 64-bit sizes and offsets around the opcode stream,
+ *   so that files and payloads can exceed 4 GiB.
+ *
+ * - EXTRACT_TO_MEMORY: Extracts into a private in-memory filesystem mounted
+ *   over the extraction directory (Linux).
+ *
+ * - LAUNCH_EARLY: Starts the application at OP_LAUNCH and extracts the rest
+ *   of the payload while it runs.
+ *
  * By adjusting these flags, developers and users can tailor the program's
  * execution to suit specific scenarios, enhancing both usability and
  * efficiency.
@@ -83,6 +108,68 @@ typedef enum {
      * --chdir-exe-dir build option.
      */
     CHDIR_TO_EXE_DIR    = 0x40,
+
+    /**
+     * Extract into a persistent cache directory keyed on the hash of the
+     * payload, and reuse it when it is already complete instead of
+     * unpacking again. The footer then carries the payload hash and a
+     * separate launch section holding the OP_SETENV and OP_SET_SCRIPT
+     * opcodes, so a cache hit never decompresses the data. Opt-in via the
+     * --extract-cache build option; the directory is never deleted.
+     */
+    EXTRACT_CACHE       = 0x80,
+
+    /**
+     * The compressed blocks are Zstandard frames instead of LZMA streams.
+     * Only meaningful together with DATA_COMPRESSED. Zstandard decodes
+     * several times faster than LZMA at the cost of a somewhat larger
+     * executable. Opt-in via the --compress=zstd build option.
+     */
+    DATA_ZSTD           = 0x100,
+
+    /**
+     * The opcode stream uses the version 2 encoding: integers (sizes and
+     * string lengths) are unsigned LEB128 instead of 32-bit little-endian,
+     * and every path is front-coded against the path before it, as the
+     * length of the prefix shared with it followed by the remaining bytes
+     * as a string. Without the flag the stream is in the version 1
+     * encoding, which the stub still reads.
+     */
+    COMPACT_OPCODES     = 0x200,
+
+    /**
+     * Sizes and offsets outside the opcode stream are 64-bit: the block
+     * index entries and count, the table of contents and launch section
+     * sizes are 64-bit little-endian, and the table of contents entries
+     * use unsigned LEB128 integers. The footer then holds a 64-bit offset
+     * followed by 0xFFFFFFFF where the 32-bit one was. Only set together
+     * with COMPACT_OPCODES, whose variable length integers already carry
+     * 64-bit sizes in the opcode stream.
+     */
+    WIDE_SIZES          = 0x400,
+
+    /**
+     * On Linux, mount a tmpfs over the temporary extraction directory in a
+     * mount namespace of the stub's own (MountPrivateTmpfs()), so the files
+     * are never written to disk, can be executed even when the temporary
+     * directory is mounted noexec, and vanish with the last process using
+     * them. Elsewhere, or where namespaces are not permitted, the stub
+     * extracts to disk as usual. Opt-in via the --extract-to-memory build
+     * option; OCRAN_MEMORY_EXTRACT=0 turns it off when running.
+     */
+    EXTRACT_TO_MEMORY   = 0x800,
+
+    /**
+     * Start the application as soon as the opcodes before OP_LAUNCH have
+     * run, with the files they create on disk, and run the rest of them
+     * while it starts up. The builder puts the files the interpreter needs
+     * to boot before OP_LAUNCH. A marker file in the extraction directory,
+     * whose path the application gets in OCRAN_EXTRACTING, exists until
+     * the extraction is complete; the packed require index loader waits
+     * for it to go away before touching a file written after OP_LAUNCH.
+     * Opt-in via the --launch-early build option.
+     */
+    LAUNCH_EARLY        = 0x1000,
 } OperationModes;
 
 bool IsDebugMode(OperationModes modes);
@@ -92,6 +179,12 @@ bool IsChdirBeforeScript(OperationModes modes);
 bool IsDataCompressed(OperationModes modes);
 bool IsRunInExeDir(OperationModes modes);
 bool IsChdirToExeDir(OperationModes modes);
+bool IsExtractCache(OperationModes modes);
+bool IsDataZstd(OperationModes modes);
+bool IsCompactOpcodes(OperationModes modes);
+bool IsWideSizes(OperationModes modes);
+bool IsExtractToMemory(OperationModes modes);
+bool IsLaunchEarly(OperationModes modes);
 
 typedef struct UnpackContext UnpackContext;
 
@@ -101,4 +194,76 @@ bool ClosePackFile(UnpackContext *context);
 
 OperationModes GetOperationModes(const UnpackContext *context);
 
-bool ProcessImage(const UnpackContext *context);
+/**
+ * @brief Function ProcessImage() calls at OP_LAUNCH, once the files before
+ *        it are written, to start the application.
+ *
+ * @return false to abort the extraction.
+ */
+typedef bool (*LaunchFunc)(void *arg);
+
+/**
+ * @brief Runs the opcodes of the payload, extracting its files.
+ *
+ * @param context  Open pack file.
+ * @param launch   Called with @p arg at OP_LAUNCH; NULL to ignore the
+ *                 opcode and return once everything is extracted.
+ * @param arg      Argument passed to @p launch.
+ */
+bool ProcessImage(const UnpackContext *context, LaunchFunc launch, void *arg);
+
+/**
+ * @brief Returns the hex-encoded payload hash used as extraction cache key.
+ *
+ * @return The key if the EXTRACT_CACHE mode is set, NULL otherwise.
+ */
+const char *GetExtractCacheKey(const UnpackContext *context);
+
+/**
+ * @brief Processes the launch section of an EXTRACT_CACHE payload.
+ *
+ * Runs the OP_SETENV and OP_SET_SCRIPT opcodes stored outside the
+ * (possibly compressed) data, which have to be replayed on every run,
+ * including those that reuse a cached extraction directory. Succeeds
+ * without doing anything when the payload has no launch section.
+ */
+bool ProcessLaunchSection(const UnpackContext *context);
+
+/**
+ * @brief Estimates the disk space the extracted payload takes up, from the
+ *        table of contents: every file rounded up to 4 KiB blocks, and one
+ *        block for every directory and symlink.
+ *
+ * @return true on success, false if the table is corrupt.
+ */
+bool GetExtractedSize(const UnpackContext *context, unsigned long long *size);
+
+/**
+ * @brief Prints the table of contents of the payload to stdout.
+ *
+ * One line per entry, in payload order: a type letter (d, f or l), the
+ * size of a file, and the path, followed by " -> target" for a symlink.
+ * Nothing is extracted, and compressed data is only decoded for symlink
+ * targets.
+ *
+ * @return true on success, false if the table is corrupt.
+ */
+bool ListPackEntries(const UnpackContext *context);
+
+/**
+ * @brief Extracts the entries at or below a path of the payload.
+ *
+ * Uses the table of contents to find the entries, and decodes only the
+ * compressed blocks their contents lie in. Nothing else of the payload is
+ * processed; environment variables and the script are ignored.
+ *
+ * @param context   Open pack file.
+ * @param rel_path  Path of a file, symlink or directory as listed by
+ *                  ListPackEntries(); an empty string selects everything.
+ * @param dest_dir  Directory to extract into, keeping the entries'
+ *                  relative paths.
+ * @return true if at least one entry matched and all of them were
+ *         extracted, false otherwise.
+ */
+bool ExtractPackEntries(const UnpackContext *context, const char *rel_path,
+                        const char *dest_dir);
@@ -0,0 +1,316 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "error.h"
+#include "worker_pool.h"
+
+/* ===== Minimal thread primitives ===== */
+
+#ifdef _WIN32
+typedef SRWLOCK            Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef HANDLE             Thread;
+
+static void mutex_init(Mutex *m)    { InitializeSRWLock(m); }
+static void mutex_destroy(Mutex *m) { (void)m; }
+static void mutex_lock(Mutex *m)    { AcquireSRWLockExclusive(m); }
+static void mutex_unlock(Mutex *m)  { ReleaseSRWLockExclusive(m); }
+
+static void cond_init(Cond *c)      { InitializeConditionVariable(c); }
+static void cond_destroy(Cond *c)   { (void)c; }
+static void cond_wait(Cond *c, Mutex *m)
+{
+    SleepConditionVariableSRW(c, m, INFINITE, 0);
+}
+static void cond_signal(Cond *c)    { WakeConditionVariable(c); }
+static void cond_broadcast(Cond *c) { WakeAllConditionVariable(c); }
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t  Cond;
+typedef pthread_t       Thread;
+
+static void mutex_init(Mutex *m)    { pthread_mutex_init(m, NULL); }
+static void mutex_destroy(Mutex *m) { pthread_mutex_destroy(m); }
+static void mutex_lock(Mutex *m)    { pthread_mutex_lock(m); }
+static void mutex_unlock(Mutex *m)  { pthread_mutex_unlock(m); }
+
+static void cond_init(Cond *c)      { pthread_cond_init(c, NULL); }
+static void cond_destroy(Cond *c)   { pthread_cond_destroy(c); }
+static void cond_wait(Cond *c, Mutex *m) { pthread_cond_wait(c, m); }
+static void cond_signal(Cond *c)    { pthread_cond_signal(c); }
+static void cond_broadcast(Cond *c) { pthread_cond_broadcast(c); }
+#endif
+
+/* ===== Worker pool ===== */
+
+typedef struct WorkerJob {
+    WorkerJobFunc     func;
+    void             *job;
+    size_t            cost;
+    struct WorkerJob *next;
+} WorkerJob;
+
+struct WorkerPool {
+    Mutex      lock;
+    Cond       job_queued;   // signaled when a job is queued or on shutdown
+    Cond       job_done;     // broadcast when a job finishes
+    WorkerJob *head;
+    WorkerJob *tail;
+    size_t     running;
+    size_t     pending_cost;
+    size_t     max_pending_cost;
+    bool       failed;
+    bool       shutdown;
+    Thread    *threads;
+    size_t     thread_count;
+};
+
+static void run_worker(WorkerPool *pool)
+{
+    mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->shutdown) {
+            cond_wait(&pool->job_queued, &pool->lock);
+        }
+        if (!pool->head) {
+            break;
+        }
+
+        WorkerJob *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pool->running++;
+        mutex_unlock(&pool->lock);
+
+        bool ok = job->func(job->job);
+
+        mutex_lock(&pool->lock);
+        pool->running--;
+        pool->pending_cost -= job->cost;
+        if (!ok) {
+            pool->failed = true;
+        }
+        free(job);
+        cond_broadcast(&pool->job_done);
+    }
+    mutex_unlock(&pool->lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+{
+    run_worker(arg);
+    return 0;
+}
+#else
+static void *worker_main(void *arg)
+{
+    run_worker(arg);
+    return NULL;
+}
+#endif
+
+static bool start_thread(Thread *thread, WorkerPool *pool)
+{
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, worker_main, pool, 0, NULL);
+    if (!*thread) {
+        APP_ERROR("CreateThread failed, Error=%lu", GetLastError());
+        return false;
+    }
+    return true;
+#else
+    int err = pthread_create(thread, NULL, worker_main, pool);
+    if (err != 0) {
+        APP_ERROR("pthread_create failed: %d", err);
+        return false;
+    }
+    return true;
+#endif
+}
+
+static void join_thread(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+WorkerPool *CreateWorkerPool(size_t thread_count, size_t max_pending_cost)
+{
+    if (thread_count == 0) {
+        APP_ERROR("thread_count must be at least 1");
+        return NULL;
+    }
+
+    WorkerPool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        APP_ERROR("Memory allocation failed for worker pool");
+        return NULL;
+    }
+
+    pool->threads = calloc(thread_count, sizeof(*pool->threads));
+    if (!pool->threads) {
+        APP_ERROR("Memory allocation failed for worker threads");
+        free(pool);
+        return NULL;
+    }
+
+    mutex_init(&pool->lock);
+    cond_init(&pool->job_queued);
+    cond_init(&pool->job_done);
+    pool->max_pending_cost = max_pending_cost;
+
+    for (size_t i = 0; i < thread_count; i++) {
+        if (!start_thread(&pool->threads[i], pool)) {
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    if (pool->thread_count == 0) {
+        DestroyWorkerPool(pool);
+        return NULL;
+    }
+
+    DEBUG("Started %zu worker threads", pool->thread_count);
+    return pool;
+}
+
+bool SubmitWorkerJob(WorkerPool *pool, WorkerJobFunc func, void *job,
+                     size_t cost)
+{
+    if (!pool || !func) {
+        APP_ERROR("pool or func is NULL");
+        return false;
+    }
+
+    WorkerJob *node = malloc(sizeof(*node));
+    if (!node) {
+        APP_ERROR("Memory allocation failed for worker job");
+        return false;
+    }
+    node->func = func;
+    node->job  = job;
+    node->cost = cost;
+    node->next = NULL;
+
+    mutex_lock(&pool->lock);
+    while (!pool->failed && pool->pending_cost > 0
+           && cost > pool->max_pending_cost - pool->pending_cost) {
+        cond_wait(&pool->job_done, &pool->lock);
+    }
+    if (pool->failed) {
+        mutex_unlock(&pool->lock);
+        free(node);
+        return false;
+    }
+
+    if (pool->tail) {
+        pool->tail->next = node;
+    } else {
+        pool->head = node;
+    }
+    pool->tail = node;
+    pool->pending_cost += cost;
+    cond_signal(&pool->job_queued);
+    mutex_unlock(&pool->lock);
+    return true;
+}
+
+bool WaitWorkerPool(WorkerPool *pool)
+{
+    if (!pool) {
+        APP_ERROR("pool is NULL");
+        return false;
+    }
+
+    mutex_lock(&pool->lock);
+    while (pool->head || pool->running > 0) {
+        cond_wait(&pool->job_done, &pool->lock);
+    }
+    bool ok = !pool->failed;
+    mutex_unlock(&pool->lock);
+    return ok;
+}
+
+void DestroyWorkerPool(WorkerPool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    cond_broadcast(&pool->job_queued);
+    mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        join_thread(pool->threads[i]);
+    }
+
+    cond_destroy(&pool->job_done);
+    cond_destroy(&pool->job_queued);
+    mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+/* ===== Worker event ===== */
+
+struct WorkerEvent {
+    Mutex lock;
+    Cond  cond;
+    bool  set;
+};
+
+WorkerEvent *CreateWorkerEvent(void)
+{
+    WorkerEvent *event = calloc(1, sizeof(*event));
+    if (!event) {
+        APP_ERROR("Memory allocation failed for worker event");
+        return NULL;
+    }
+
+    mutex_init(&event->lock);
+    cond_init(&event->cond);
+    return event;
+}
+
+void SetWorkerEvent(WorkerEvent *event)
+{
+    mutex_lock(&event->lock);
+    event->set = true;
+    cond_broadcast(&event->cond);
+    mutex_unlock(&event->lock);
+}
+
+void WaitWorkerEvent(WorkerEvent *event)
+{
+    mutex_lock(&event->lock);
+    while (!event->set) {
+        cond_wait(&event->cond, &event->lock);
+    }
+    mutex_unlock(&event->lock);
+}
+
+void DestroyWorkerEvent(WorkerEvent *event)
+{
+    if (!event) {
+        return;
+    }
+
+    cond_destroy(&event->cond);
+    mutex_destroy(&event->lock);
+    free(event);
+}
@@ -0,0 +1,94 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Function run by a worker thread for one job.
+ *
+ * The pool never touches @p job itself; releasing it is up to the function
+ * or, if the submitter keeps using it, to the submitter.
+ *
+ * @return true on success; false makes the whole pool report failure.
+ */
+typedef bool (*WorkerJobFunc)(void *job);
+
+/**
+ * @brief Opaque handle to a pool of worker threads running queued jobs.
+ */
+typedef struct WorkerPool WorkerPool;
+
+/**
+ * @brief Starts a pool of worker threads.
+ *
+ * @param thread_count
+ *   Number of worker threads to start; must be at least 1.
+ * @param max_pending_cost
+ *   Upper bound of the summed cost of queued and running jobs.
+ *   SubmitWorkerJob() blocks while a new job would exceed it, which bounds
+ *   e.g. the memory held by jobs that carry their own data.
+ * @return
+ *   A new WorkerPool on success, or NULL on failure.
+ */
+WorkerPool *CreateWorkerPool(size_t thread_count, size_t max_pending_cost);
+
+/**
+ * @brief Queues a job to be run by one of the worker threads.
+ *
+ * Jobs run in no particular order. Blocks while the pending cost limit
+ * would be exceeded; a single job costlier than the limit is accepted once
+ * nothing else is pending.
+ *
+ * @param pool  Pool to submit to; must not be NULL.
+ * @param func  Function to run for the job.
+ * @param job   Argument passed to @p func.
+ * @param cost  Cost of the job counted against the pending cost limit.
+ * @return
+ *   true if the job was queued; false if it was not, either because an
+ *   earlier job failed or on allocation failure. The job then remains
+ *   owned by the caller.
+ */
+bool SubmitWorkerJob(WorkerPool *pool, WorkerJobFunc func, void *job,
+                     size_t cost);
+
+/**
+ * @brief Waits until all submitted jobs have finished.
+ *
+ * @return true if every job succeeded, false if any job failed.
+ */
+bool WaitWorkerPool(WorkerPool *pool);
+
+/**
+ * @brief Finishes the remaining jobs, stops the worker threads and frees
+ *        the pool. Passing NULL does nothing.
+ */
+void DestroyWorkerPool(WorkerPool *pool);
+
+/**
+ * @brief Opaque handle to a one-shot event, set by one thread and waited
+ *        for by others, e.g. to wait for one particular job.
+ *
+ * Everything written by the setting thread before SetWorkerEvent() is
+ * visible to a thread after its WaitWorkerEvent() returns.
+ */
+typedef struct WorkerEvent WorkerEvent;
+
+/**
+ * @brief Creates an event in the unset state.
+ *
+ * @return A new WorkerEvent, or NULL on allocation failure.
+ */
+WorkerEvent *CreateWorkerEvent(void);
+
+/**
+ * @brief Sets the event and wakes all threads waiting for it.
+ */
+void SetWorkerEvent(WorkerEvent *event);
+
+/**
+ * @brief Blocks until the event is set. Returns at once if it already is.
+ */
+void WaitWorkerEvent(WorkerEvent *event);
+
+/**
+ * @brief Frees an event. Passing NULL does nothing.
+ */
+void DestroyWorkerEvent(WorkerEvent *event);
@@ -4,6 +4,7 @@ require "tmpdir"
 require "tmpdir"
 require "fileutils"
 require "open3"
+require "json"
 require "rbconfig"
 require "pathname"
 require "bundler"
@@ -209,15 +210,49 @@ class TestOcran < Minitest::Test
   # block. When the block exits, the environment variables are set
   # back to their original values.
   def with_env(hash)
-    old = ENV.except(hash.keys)
+    old = ENV.to_h.slice(*hash.keys)
     ENV.update(hash)
     begin
       yield
     ensure
+      hash.each_key { |key| ENV.delete(key) }
       ENV.update(old)
     end
   end
 
+  # Runs an executable once unpacking on the main thread and once on
+  # worker threads (OCRAN_EXTRACT_THREADS).
+  def assert_system_with_threads(exe)
+    ["1", "4"].each do |threads|
+      with_env "OCRAN_EXTRACT_THREADS" => threads do
+        assert_system(exe)
+      end
+    end
+  end
+
+  # Lists the payload of an executable with OCRAN_INSPECT=list, which never
+  # runs the application.
+  def inspect_list(exe)
+    list, status = with_env("OCRAN_INSPECT" => "list") do
+      Open3.capture2(exe)
+    end
+    assert status.success?, "OCRAN_INSPECT=list failed for #{exe}"
+    list
+  end
+
+  # Extracts the first entry of the payload listed by inspect_list whose
+  # path the block accepts, with OCRAN_INSPECT=extract, into the current
+  # directory and returns its path.
+  def inspect_extract(exe, &match)
+    list = inspect_list(exe)
+    path = list.lines.map { |l| l.split(" ", 3).last.chomp }.find(&match)
+    assert path, "no matching entry listed by #{exe}:\n#{list}"
+    with_env "OCRAN_INSPECT" => "extract:#{path}" do
+      assert_system(exe)
+    end
+    path
+  end
+
   def with_tmpdir(files = [], path = nil)
     tempdirname = path || Dir.mktmpdir(".ocrantest-")
     mkdir_p tempdirname
@@ -1068,6 +1103,367 @@ class TestOcran < Minitest::Test
     end
   end
 
+  # Files are written through io_uring where available, else by worker
+  # threads unless OCRAN_EXTRACT_THREADS=1; every path must produce a
+  # working application, streamed or not.
+  def test_extract_threads
+    with_fixture 'helloworld' do
+      ["--lzma", "--no-lzma"].each do |lzma|
+        assert_system("ruby", ocran, "helloworld.rb", "--quiet", lzma)
+        pristine_env exe_name("helloworld") do
+          [["1", "1"], ["4", "1"], ["4", "0"]].each do |threads, io_uring|
+            with_env "OCRAN_EXTRACT_THREADS" => threads, "OCRAN_IO_URING" => io_uring do
+              assert_system(exe_name("helloworld"))
+            end
+          end
+        end
+      end
+    end
+  end
+
+  # A payload of many small LZMA blocks must decode the same whether the
+  # blocks are streamed one by one or decoded ahead on worker threads.
+  def test_block_size
+    with_fixture 'helloworld' do
+      assert_system("ruby", ocran, "helloworld.rb", "--quiet", "--lzma", "--block-size", "64K")
+      pristine_env exe_name("helloworld") do
+        assert_system_with_threads(exe_name("helloworld"))
+      end
+    end
+  end
+
+  # OCRAN_INSPECT lists the payload and extracts single entries through the
+  # table of contents, decoding only the blocks they lie in, and never
+  # runs the application.
+  def test_inspect
+    with_fixture 'helloworld' do
+      source = File.binread("helloworld.rb")
+      ["--no-lzma", "--lzma"].each do |lzma|
+        assert_system("ruby", ocran, "helloworld.rb", "--quiet", lzma, "--block-size", "64K")
+        pristine_env exe_name("helloworld") do
+          refute_includes inspect_list(exe_name("helloworld")), "Hello, World!"
+          path = inspect_extract(exe_name("helloworld")) { |p| p.end_with?("helloworld.rb") }
+          assert_equal source, File.binread(path)
+        end
+      end
+    end
+  end
+
+  # Files with identical contents are stored once and still extracted
+  # under every name, compressed or not.
+  def test_duplicate_files
+    with_fixture 'helloworld' do
+      contents = Random.new(1).bytes(64 * 1024)
+      File.binwrite("a.bin", contents)
+      File.binwrite("b.bin", contents)
+      File.write("dup.rb", <<~RUBY)
+        return if defined?(Ocran)
+
+        Dir.chdir(__dir__)
+        exit 1 unless File.binread("a.bin") == File.binread("b.bin")
+        exit 2 unless File.size("b.bin") == #{contents.bytesize}
+      RUBY
+      assert_system("ruby", ocran, "dup.rb", "a.bin", *DefaultArgs)
+      single_size = File.size(exe_name("dup"))
+      ["--no-lzma", "--lzma"].each do |lzma|
+        assert_system("ruby", ocran, "dup.rb", "a.bin", "b.bin", *DefaultArgs, lzma)
+        assert_operator File.size(exe_name("dup")), :<, single_size + 4096 if lzma == "--no-lzma"
+        pristine_env exe_name("dup") do
+          assert_system(exe_name("dup"))
+          path = inspect_extract(exe_name("dup")) { |p| p.end_with?("b.bin") }
+          assert_equal contents, File.binread(path)
+        end
+      end
+    end
+  end
+
+  # With --bcj the Ruby interpreter is stored branch-converted and must
+  # come out byte for byte, on worker threads, streamed and through the
+  # table of contents.
+  def test_branch_filter
+    with_fixture 'helloworld' do
+      assert_system("ruby", ocran, "helloworld.rb", "--quiet", "--lzma", "--bcj", "--block-size", "64K")
+      pristine_env exe_name("helloworld") do
+        assert_system_with_threads(exe_name("helloworld"))
+        ruby = File.join(RbConfig::CONFIG["bindir"], RbConfig::CONFIG["ruby_install_name"] + RbConfig::CONFIG["EXEEXT"])
+        path = inspect_extract(exe_name("helloworld")) { |p| File.basename(p) == File.basename(ruby) }
+        assert_equal File.binread(ruby), File.binread(path)
+      end
+    end
+  end
+
+  # OCRAN_TRACE appends one JSON record per run with the startup phases.
+  def test_trace
+    with_fixture 'helloworld' do
+      assert_system("ruby", ocran, "helloworld.rb", "--quiet")
+      pristine_env exe_name("helloworld") do
+        trace = File.expand_path("trace.json")
+        with_env "OCRAN_TRACE" => trace do
+          2.times { assert_system(exe_name("helloworld")) }
+        end
+        records = File.readlines(trace).map { |line| JSON.parse(line) }
+        assert_equal 2, records.size
+        assert_equal 0, records.first["status"]
+        %w[open_pack process_opcodes decompress run_script child delete_inst_dir].each do |phase|
+          assert records.first["phases"].key?(phase), "#{phase} missing: #{records.first}"
+        end
+        assert_operator records.first["counters"]["files"], :>, 0
+      end
+    end
+  end
+
+  # Extraction directories whose lock file nobody holds any more (the stub
+  # was killed) are deleted by later runs; directories without one are not.
+  def test_sweep_orphaned_inst_dirs
+    with_fixture 'helloworld' do
+      assert_system("ruby", ocran, "helloworld.rb", *DefaultArgs)
+      tmp = File.expand_path("tmp")
+      orphan = File.join(tmp, "ocranAbC123")
+      legacy = File.join(tmp, "ocranXyZ789")
+      mkdir_p File.join(orphan, "lib")
+      mkdir_p legacy
+      File.write(File.join(orphan, ".ocran-lock"), "1\n")
+      File.write(File.join(orphan, "lib", "file.rb"), "")
+      # Directories others could have planted are never swept.
+      unless Gem.win_platform?
+        shared = File.join(tmp, "ocranShArEd")
+        target = File.expand_path("target")
+        link = File.join(tmp, "ocranLiNk12")
+        [shared, target].each do |dir|
+          mkdir_p dir
+          File.write(File.join(dir, ".ocran-lock"), "1\n")
+        end
+        File.chmod(0o777, shared)
+        File.symlink(target, link)
+      end
+      pristine_env exe_name("helloworld") do
+        with_env "TMPDIR" => tmp, "TMP" => tmp, "TEMP" => tmp, "OCRAN_TEMP_DIRS" => tmp, "OCRAN_GC_INTERVAL" => "0" do
+          assert_system(exe_name("helloworld"))
+        end
+      end
+      # The sweep runs detached on POSIX
+      50.times { break unless File.exist?(orphan); sleep 0.1 }
+      refute File.exist?(orphan), "orphaned extraction directory was not deleted"
+      assert File.exist?(legacy)
+      unless Gem.win_platform?
+        assert File.exist?(File.join(shared, ".ocran-lock"))
+        assert File.symlink?(link)
+        assert File.exist?(File.join(target, ".ocran-lock"))
+      end
+    end
+  end
+
+  # The stub extracts into the first of the OCRAN_TEMP_DIRS candidates that
+  # is a usable directory with enough room, skipping unset variables.
+  def test_temp_dir_candidates
+    skip "POSIX only" if Gem.win_platform?
+    with_fixture 'helloworld' do
+      File.write("where.rb", "File.write('where.txt', __dir__) unless defined?(Ocran)\n")
+      assert_system("ruby", ocran, "where.rb", *DefaultArgs)
+      pristine_env exe_name("where") do
+        fast = File.expand_path("fast")
+        tmp = File.expand_path("tmp")
+        mkdir_p [fast, tmp]
+        File.write("plain-file", "")
+        candidates = ["/nonexistent", "$OCRAN_TEST_UNSET", File.expand_path("plain-file"), fast]
+        with_env "TMPDIR" => tmp, "OCRAN_GC" => "0", "OCRAN_TEMP_DIRS" => candidates.join(":") do
+          assert_system(exe_name("where"))
+          assert_equal fast, File.dirname(File.read("where.txt"), 2)
+
+          with_env "OCRAN_TEMP_DIRS" => "$OCRAN_TEST_UNSET:/nonexistent" do
+            assert_system(exe_name("where"))
+          end
+          assert_equal tmp, File.dirname(File.read("where.txt"), 2)
+        end
+      end
+    end
+  end
+
+  # With --extract-to-memory the application runs from a tmpfs mounted over
+  # the extraction directory, which only the directory and its lock file
+  # underneath are left of, and those are deleted on exit.
+  def test_extract_to_memory
+    skip "Linux only" unless RUBY_PLATFORM.include?("linux")
+    unshare = Process.euid == 0 ? ["-m"] : ["-Urm"]
+    skip "mount namespaces not permitted" unless system("unshare", *unshare, "true", out: File::NULL, err: File::NULL)
+    with_fixture 'helloworld' do
+      File.write("memory.rb", <<~RUBY)
+        return if defined?(Ocran)
+
+        mounts = File.readlines("/proc/self/mountinfo").map(&:split)
+        mount = mounts.select { |f| f[4] == "/" || __dir__.start_with?(f[4] + "/") }.max_by { |f| f[4].size }
+        File.write("fs.txt", "\#{mount[4]} \#{mount[mount.index("-") + 1]}")
+      RUBY
+      assert_system("ruby", ocran, "memory.rb", *DefaultArgs, "--extract-to-memory")
+      pristine_env exe_name("memory") do
+        tmp = File.expand_path("tmp")
+        mkdir_p tmp
+        with_env "TMPDIR" => tmp, "OCRAN_TEMP_DIRS" => tmp, "OCRAN_GC" => "0" do
+          assert_system(exe_name("memory"))
+          mount_point, fstype = File.read("fs.txt").split
+          assert_equal "tmpfs", fstype
+          assert_equal tmp, File.dirname(mount_point)
+          50.times { break if Dir.empty?(tmp); sleep 0.1 }
+          assert_empty Dir.children(tmp)
+
+          with_env "OCRAN_MEMORY_EXTRACT" => "0" do
+            assert_system(exe_name("memory"))
+          end
+          refute_equal tmp, File.dirname(File.read("fs.txt").split.first)
+        end
+      end
+    end
+  end
+
+  # With --precompile, packed sources load from instruction sequence
+  # binaries relocated to the extraction directory, and from source again
+  # once they have changed.
+  def test_precompile
+    with_fixture 'helloworld' do
+      mkdir_p "lib"
+      File.write("lib/precompiled.rb", "module Precompiled\n  FILE = __FILE__\n  DIR = __dir__\nend\n")
+      File.write("precompile.rb", <<~RUBY)
+        require_relative "lib/precompiled"
+        return if defined?(Ocran)
+
+        path = File.expand_path("lib/precompiled.rb", __dir__)
+        results = [Precompiled::FILE == path, Precompiled::DIR == File.dirname(path),
+                   !RubyVM::InstructionSequence.load_iseq(path).nil?]
+        File.write(path, "# changed\n")
+        results << RubyVM::InstructionSequence.load_iseq(path).nil?
+        File.write("precompile.txt", results.inspect)
+      RUBY
+      assert_system("ruby", ocran, "precompile.rb", *DefaultArgs, "--precompile")
+      pristine_env exe_name("precompile") do
+        assert_system(exe_name("precompile"))
+        assert_equal "[true, true, true, true]", File.read("precompile.txt")
+      end
+    end
+  end
+
+  def test_require_index
+    with_fixture 'helloworld' do
+      mkdir_p "lib"
+      File.write("lib/indexed.rb", "module Indexed; end\n")
+      File.write("require_index.rb", <<~RUBY)
+        $LOAD_PATH.unshift File.join(__dir__, "lib")
+        if defined?(Ocran)
+          require "indexed"
+          require "optparse"
+          return
+        end
+
+        features = %w[indexed optparse]
+        results = features.map { |f| OcranRequireIndex.resolve(f) == $LOAD_PATH.resolve_feature_path(f)[1] }
+        results << require("indexed") << OcranRequireIndex.resolve("indexed").nil?
+        File.write("optparse.rb", "Shadowed = true\n")
+        $LOAD_PATH.unshift Dir.pwd
+        results << OcranRequireIndex.resolve("optparse").nil? << (require("optparse") && defined?(Shadowed) == "constant")
+        File.write("require_index.txt", results.inspect)
+      RUBY
+      assert_system("ruby", ocran, "require_index.rb", *DefaultArgs, "--require-index")
+      pristine_env exe_name("require_index") do
+        assert_system(exe_name("require_index"))
+        assert_equal "[true, true, true, true, true, true]", File.read("require_index.txt")
+      end
+    end
+  end
+
+  def test_pack_sources
+    with_fixture 'helloworld' do
+      File.write("pack_sources.rb", <<~RUBY)
+        require "logger"
+        return if defined?(Ocran)
+
+        path = $LOADED_FEATURES.find { |f| f.end_with?("/logger.rb") }
+        results = [defined?(Logger::VERSION), File.exist?(path), OcranRequireIndex.packed?(path), require("logger")]
+        File.write("pack_sources.txt", results.inspect)
+      RUBY
+      assert_system("ruby", ocran, "pack_sources.rb", *DefaultArgs, "--pack-sources")
+      pristine_env exe_name("pack_sources") do
+        assert_system(exe_name("pack_sources"))
+        assert_equal '["constant", false, true, false]', File.read("pack_sources.txt")
+      end
+    end
+  end
+
+  # A training run records the files it touches; files of the gem that it
+  # did not touch are extracted when the application first uses them.
+  def test_lazy_extract
+    skip "rake gem not installed" if Gem::Specification.find_all_by_name("rake").empty?
+    with_fixture 'helloworld' do
+      File.write("lazy.rb", <<~RUBY)
+        require "rake"
+        return if defined?(Ocran) || !ENV["LAZY_CHECK"]
+
+        dir = Gem.loaded_specs["rake"].gem_dir
+        results = [File.file?(File.join(dir, "lib/rake/clean.rb")), require("rake/clean"),
+                   File.read(File.join(dir, "MIT-LICENSE")).include?("Permission"),
+                   Dir.glob("*", base: File.join(dir, "doc")).size]
+        File.write("lazy.txt", results.inspect)
+      RUBY
+      assert_system("ruby", ocran, "lazy.rb", *DefaultArgs, "--gem-full=rake", "--require-index", "--output", exe_name("train"))
+      log = File.expand_path("access.log")
+      expected = nil
+      pristine_env exe_name("train") do
+        with_env "OCRAN_ACCESS_LOG" => log do
+          assert_system(exe_name("train"))
+        end
+        with_env "LAZY_CHECK" => "1" do
+          assert_system(exe_name("train"))
+        end
+        expected = File.read("lazy.txt")
+      end
+      hot = File.readlines(log, chomp: true)
+      assert hot.any? { |f| f.end_with?("/lib/rake.rb") }
+      refute hot.any? { |f| f.end_with?("/MIT-LICENSE") }
+
+      assert_system("ruby", ocran, "lazy.rb", *DefaultArgs, "--gem-full=rake", "--lazy-extract", log)
+      pristine_env exe_name("lazy") do
+        with_env "LAZY_CHECK" => "1" do
+          assert_system(exe_name("lazy"))
+        end
+        assert_equal expected, File.read("lazy.txt")
+      end
+    end
+  end
+
+  # With --launch-early the application starts while the stub is still
+  # extracting the files of the gem; touching one of them waits for all.
+  def test_launch_early
+    skip "rake gem not installed" if Gem::Specification.find_all_by_name("rake").empty?
+    with_fixture 'helloworld' do
+      File.write("early.rb", <<~RUBY)
+        require "rake"
+        return if defined?(Ocran)
+
+        marker = ENV["OCRAN_EXTRACTING"]
+        require "rake/clean"
+        dir = Gem.loaded_specs["rake"].gem_dir
+        results = [!marker.nil?, File.exist?(marker), defined?(Rake::Cleaner).to_s,
+                   File.read(File.join(dir, "MIT-LICENSE")).include?("Permission")]
+        File.write("early.txt", results.inspect)
+      RUBY
+      assert_system("ruby", ocran, "early.rb", *DefaultArgs, "--gem-full=rake", "--launch-early")
+      pristine_env exe_name("early") do
+        assert_system(exe_name("early"))
+        assert_equal [true, false, "constant", true].inspect, File.read("early.txt")
+      end
+    end
+  end
+
+  # Zstandard payloads decode through the same block machinery as LZMA,
+  # streamed and on worker threads.
+  def test_zstd
+    skip "zstd command not found" unless system("zstd", "--version", out: File::NULL, err: File::NULL)
+    with_fixture 'helloworld' do
+      assert_system("ruby", ocran, "helloworld.rb", "--quiet", "--compress=zstd:3", "--block-size", "64K")
+      pristine_env exe_name("helloworld") do
+        assert_system_with_threads(exe_name("helloworld"))
+      end
+    end
+  end
+
   # Test that executables can writing a file to the current working
   # directory.
   def test_writefile
@@ -2361,6 +2757,7 @@ class TestOcran < Minitest::Test
       end
       File.write(File.join(appdir, "src", "check.rb"), <<~RUBY)
         File.write(File.join(__dir__, "..", "result.txt"), ENV["OCRAN_TEST_VAR"].to_s)
+        File.write(File.join(__dir__, "..", "pid.txt"), Process.pid.to_s)
       RUBY
 
       wrapper = Pathname(appdir) / exe_name("wrapper")
@@ -2370,7 +2767,14 @@ class TestOcran < Minitest::Test
       end
 
       assert File.exist?(wrapper)
-      assert_system(wrapper.to_s)
+      pid = spawn(wrapper.to_s)
+      Process.wait(pid)
+      assert $?.success?, "wrapper failed: #{$?.inspect}"
+      # With nothing to delete afterwards, POSIX stubs exec the interpreter
+      # in place instead of waiting for it as a child.
+      unless Gem.win_platform?
+        assert_equal pid, File.read(File.join(appdir, "pid.txt")).to_i
+      end
 
       # The placeholder must resolve to the executable's own directory.
       # The stub reports native separators on Windows - compare normalized.
@@ -2382,6 +2786,147 @@ class TestOcran < Minitest::Test
     end
   end
 
+  def test_extract_cache_stub
+    require_relative "../lib/ocran/stub_builder"
+    require_relative "../lib/ocran/build_constants"
+    with_tmpdir do
+      cachedir = File.expand_path("cache")
+      mkdir_p cachedir
+      File.write("check.rb", <<~RUBY)
+        File.write(ARGV[0], [__dir__, ENV["OCRAN_TEST_VAR"]].join("\n"))
+      RUBY
+      ruby_name = File.basename(RbConfig.ruby)
+      exe = Pathname(exe_name("cached")).expand_path
+      Ocran::StubBuilder.new(exe, extract_cache: true) do |stub|
+        stub.cp(RbConfig.ruby, Pathname("bin") / ruby_name)
+        stub.cp(File.expand_path("check.rb"), Pathname("src") / "check.rb")
+        stub.export("OCRAN_TEST_VAR", File.join(Ocran::BuildConstants::EXTRACT_ROOT, "src"))
+        stub.exec(Pathname("bin") / ruby_name, Pathname("src") / "check.rb", File.expand_path("result.txt"))
+      end
+
+      with_env "TMPDIR" => cachedir, "TMP" => cachedir, "TEMP" => cachedir do
+        assert_system(exe.to_s)
+        # .ocran-gc times the sweep for orphaned extraction directories
+        roots = Dir.children(cachedir) - [".ocran-gc"]
+        assert_equal 1, roots.size, "expected one cache root, got #{roots.inspect}"
+        assert_match(/\Aocran-cache(-\d+)?\z/, roots.first)
+        root = File.join(cachedir, roots.first)
+        entries = Dir.children(root)
+        assert_equal 1, entries.size, "expected one published cache entry, got #{entries.inspect}"
+        assert_match(/\Aocran-\h{16}\z/, entries.first)
+        entry = File.join(root, entries.first)
+        refute_empty Dir.glob(File.join(entry, ".ocran-complete-*"))
+        assert_equal 0o700, File.stat(root).mode & 0o777 unless Gem.win_platform?
+
+        # A second run must reuse the entry as is, not unpack again.
+        File.write(File.join(entry, "sentinel"), "")
+        File.delete("result.txt")
+        assert_system(exe.to_s)
+        assert_equal roots, Dir.children(cachedir) - [".ocran-gc"]
+        assert_equal entries, Dir.children(root)
+        assert File.exist?(File.join(entry, "sentinel"))
+
+        dir, var = File.read("result.txt").split("\n").map { |s| s.tr("\\", "/") }
+        assert_equal File.join(entry, "src").tr("\\", "/"), dir
+        assert_equal dir, var
+
+        # An entry writable by others is not trusted: the run extracts to
+        # a staging directory of its own and removes it afterwards.
+        unless Gem.win_platform?
+          File.chmod(0o777, entry)
+          File.delete("result.txt")
+          assert_system(exe.to_s)
+          dir = File.read("result.txt").split("\n").first
+          refute_equal File.join(entry, "src"), dir
+          # The staging directory is deleted by a detached process
+          staging = File.dirname(dir)
+          50.times { break unless File.exist?(staging); sleep 0.1 }
+          refute File.exist?(staging), "staging directory must be deleted"
+          assert File.exist?(File.join(entry, "sentinel"))
+          assert_equal roots, Dir.children(cachedir) - [".ocran-gc"]
+        end
+      end
+    end
+  end
+
+  # Front-coded paths share prefixes across directories; the version 1
+  # encoding must still unpack the same tree.
+  def test_legacy_opcodes_stub
+    require_relative "../lib/ocran/stub_builder"
+    with_tmpdir do
+      File.write("check.rb", <<~RUBY)
+        files = Dir.glob("**/*.txt", base: File.join(__dir__, "data")).sort
+        File.write(ARGV[0], files.map { |f| f + "=" + File.read(File.join(__dir__, "data", f)) }.join("\\n"))
+      RUBY
+      names = %w[a/b/one.txt a/b/two.txt a/bc/three.txt a/four.txt ab/five.txt six.txt]
+      ruby_name = File.basename(RbConfig.ruby)
+      [false, true].each do |legacy|
+        exe = Pathname(exe_name(legacy ? "v1" : "v2")).expand_path
+        Ocran::StubBuilder.new(exe, legacy_opcodes: legacy) do |stub|
+          stub.cp(RbConfig.ruby, Pathname("bin") / ruby_name)
+          stub.cp(File.expand_path("check.rb"), Pathname("src") / "check.rb")
+          stub.mkdir(Pathname("src") / "data" / "empty")
+          names.each do |name|
+            File.write("content.txt", name)
+            stub.cp(File.expand_path("content.txt"), Pathname("src") / "data" / name)
+          end
+          stub.exec(Pathname("bin") / ruby_name, Pathname("src") / "check.rb", File.expand_path("result.txt"))
+        end
+        assert_system(exe.to_s)
+        assert_equal names.sort.map { |n| "#{n}=#{n}" }.join("\n"), File.read("result.txt")
+      end
+    end
+  end
+
+  # The width of the sizes around the opcode stream is independent of the
+  # opcode encoding: every combination, stored or in several LZMA blocks,
+  # must run and be listed and extracted through the table of contents,
+  # with the footer offset behind WIDE_OFFSET_MARKER exactly when wide.
+  def test_wide_sizes_stub
+    require_relative "../lib/ocran/stub_builder"
+    with_tmpdir do
+      File.write("check.rb", <<~RUBY)
+        File.write(ARGV[0], File.binread(File.join(__dir__, "data.bin")).unpack1("H*"))
+      RUBY
+      contents = Random.new(2).bytes(96 * 1024)
+      File.binwrite("data.bin", contents)
+      ruby_name = File.basename(RbConfig.ruby)
+      sig = Ocran::StubBuilder::Signature.pack("C*")
+      [false, true].product([false, true], [false, true]).each do |legacy, wide, lzma|
+        name = "#{legacy ? "v1" : "v2"}-#{wide ? "wide" : "narrow"}-#{lzma ? "lzma" : "stored"}"
+        exe = Pathname(exe_name(name)).expand_path
+        Ocran::StubBuilder.new(exe, legacy_opcodes: legacy, wide_sizes: wide,
+                               enable_compression: lzma, block_size: 16 * 1024) do |stub|
+          stub.cp(RbConfig.ruby, Pathname("bin") / ruby_name)
+          stub.cp(File.expand_path("check.rb"), Pathname("src") / "check.rb")
+          stub.cp(File.expand_path("data.bin"), Pathname("src") / "data.bin")
+          stub.exec(Pathname("bin") / ruby_name, Pathname("src") / "check.rb", File.expand_path("result.txt"))
+        end
+
+        image = File.binread(exe)
+        assert_equal sig, image[-4, 4], name
+        offset = if wide
+                   assert_equal Ocran::StubBuilder::WIDE_OFFSET_MARKER, image[-8, 4].unpack1("V"), name
+                   image[-16, 8].unpack1("Q<")
+                 else
+                   refute_equal Ocran::StubBuilder::WIDE_OFFSET_MARKER, image[-8, 4].unpack1("V"), name
+                   image[-8, 4].unpack1("V")
+                 end
+        modes = image[offset, 2].unpack1("v")
+        assert_equal wide, modes.anybits?(Ocran::StubBuilder::WIDE_SIZES), name
+        assert_equal !legacy, modes.anybits?(Ocran::StubBuilder::COMPACT_OPCODES), name
+
+        File.delete("result.txt") if File.exist?("result.txt")
+        assert_system(exe.to_s)
+        assert_equal contents.unpack1("H*"), File.read("result.txt"), name
+
+        path = inspect_extract(exe.to_s) { |p| p.end_with?("data.bin") }
+        assert_equal contents, File.binread(path), name
+        rm_rf File.dirname(path)
+      end
+    end
+  end
+
   # Inno Setup builds must produce a wrapper executable named like --output
   # and install it into {app}, so that user ISS scripts can reference it
   # (e.g. [Run]/[UninstallRun] entries, Windows service registration).